@@ -0,0 +1,196 @@
+/*
+* Copyright (c) 2015 Owen Glofcheski
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+*    1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+*    2. Altered source versions must be plainly marked as such, and must not
+*    be misrepresented as being the original software.
+*
+*    3. This notice may not be removed or altered from any source
+*    distribution.
+*/
+
+
+#ifndef _BUFFER_HPP_
+#define _BUFFER_HPP_
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+/**
+ * Contiguous array that either owns its elements or views memory owned elsewhere,
+ * e.g. a mapped file, so loaded data can be used in place. Element access never
+ * checks which, anything that changes the size first copies a view into owned storage.
+ */
+template <typename T>
+class Buffer
+{
+public:
+	Buffer() : data_(NULL), size_(0), view_(false) {}
+	Buffer(const Buffer &other) : data_(NULL), size_(0), view_(false) {
+		*this = other;
+	}
+	Buffer(Buffer &&other) : data_(NULL), size_(0), view_(false) {
+		swap(other);
+	}
+
+	// Copies of a view view the same memory
+	Buffer &operator = (const Buffer &other) {
+		if (this == &other) {
+			return *this;
+		}
+		if (other.view_) {
+			owned_.clear();
+			data_ = other.data_;
+			size_ = other.size_;
+			view_ = true;
+		} else {
+			owned_ = other.owned_;
+			view_ = false;
+			sync();
+		}
+		return *this;
+	}
+
+	Buffer &operator = (Buffer &&other) {
+		swap(other);
+		return *this;
+	}
+
+	/** View |size| elements at |data|, which must outlive this buffer or its next resize. */
+	void view(const T *data, size_t size) {
+		std::vector<T>().swap(owned_);
+		data_ = const_cast<T *>(data);
+		size_ = size;
+		view_ = true;
+	}
+
+	bool isView() const {
+		return view_;
+	}
+
+	T &operator [] (size_t i) {
+		return data_[i];
+	}
+
+	const T &operator [] (size_t i) const {
+		return data_[i];
+	}
+
+	T *data() {
+		return data_;
+	}
+
+	const T *data() const {
+		return data_;
+	}
+
+	size_t size() const {
+		return size_;
+	}
+
+	bool empty() const {
+		return size_ == 0;
+	}
+
+	T *begin() {
+		return data_;
+	}
+
+	const T *begin() const {
+		return data_;
+	}
+
+	T *end() {
+		return data_ + size_;
+	}
+
+	const T *end() const {
+		return data_ + size_;
+	}
+
+	T &back() {
+		return data_[size_ - 1];
+	}
+
+	const T &back() const {
+		return data_[size_ - 1];
+	}
+
+	void resize(size_t size) {
+		own();
+		owned_.resize(size);
+		sync();
+	}
+
+	void resize(size_t size, const T &value) {
+		own();
+		owned_.resize(size, value);
+		sync();
+	}
+
+	void reserve(size_t capacity) {
+		own();
+		owned_.reserve(capacity);
+		sync();
+	}
+
+	void assign(size_t size, const T &value) {
+		view_ = false;
+		owned_.assign(size, value);
+		sync();
+	}
+
+	void push_back(const T &value) {
+		own();
+		owned_.push_back(value);
+		sync();
+	}
+
+	void clear() {
+		view_ = false;
+		owned_.clear();
+		sync();
+	}
+
+	void swap(Buffer &other) {
+		// Swapping vectors keeps their storage so the pointers stay valid
+		owned_.swap(other.owned_);
+		std::swap(data_, other.data_);
+		std::swap(size_, other.size_);
+		std::swap(view_, other.view_);
+	}
+
+private:
+	void own() {
+		if (view_) {
+			std::vector<T>(data_, data_ + size_).swap(owned_);
+			view_ = false;
+			sync();
+		}
+	}
+
+	void sync() {
+		data_ = owned_.empty() ? NULL : &owned_[0];
+		size_ = owned_.size();
+	}
+
+	std::vector<T> owned_;
+	T *data_;
+	size_t size_;
+	bool view_;
+};
+
+#endif
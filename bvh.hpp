@@ -0,0 +1,509 @@
+/*
+* Copyright (c) 2015 Owen Glofcheski
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+*    1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+*    2. Altered source versions must be plainly marked as such, and must not
+*    be misrepresented as being the original software.
+*
+*    3. This notice may not be removed or altered from any source
+*    distribution.
+*/
+
+#ifndef _BVH_HPP_
+#define _BVH_HPP_
+
+#include <algorithm>
+#include <iostream>
+#include <limits>
+#include <vector>
+
+#include "algebra.hpp"
+#include "buffer.hpp"
+#include "primitive.hpp"
+#include "stats.hpp"
+
+#define BVH_STACK_SIZE 64
+#define BVH_MAX_SAH_DEPTH 24 // Deeper nodes use median splits so the depth stays within the stack
+#define BVH_MAX_BINS 32
+
+struct BoundingBox
+{
+	BoundingBox()
+		: min(std::numeric_limits<double>::max(), std::numeric_limits<double>::max(), std::numeric_limits<double>::max()),
+		max(-std::numeric_limits<double>::max(), -std::numeric_limits<double>::max(), -std::numeric_limits<double>::max()) {}
+	BoundingBox(const Point3 &min, const Point3 &max) : min(min), max(max) {}
+
+	void extend(const Point3 &p) {
+		for (int i = 0; i < 3; ++i) {
+			min[i] = std::min(min[i], p[i]);
+			max[i] = std::max(max[i], p[i]);
+		}
+	}
+
+	void extend(const BoundingBox &other) {
+		for (int i = 0; i < 3; ++i) {
+			min[i] = std::min(min[i], other.min[i]);
+			max[i] = std::max(max[i], other.max[i]);
+		}
+	}
+
+	bool empty() const {
+		return min.x > max.x || min.y > max.y || min.z > max.z;
+	}
+
+	Point3 center() const {
+		return Point3((min.x + max.x) * 0.5, (min.y + max.y) * 0.5, (min.z + max.z) * 0.5);
+	}
+
+	Vector3 extent() const {
+		return max - min;
+	}
+
+	double area() const {
+		if (empty()) {
+			return 0;
+		}
+		Vector3 e = extent();
+		return 2 * (e.x * e.y + e.y * e.z + e.z * e.x);
+	}
+
+	int longestAxis() const {
+		Vector3 e = extent();
+		if (e.x > e.y && e.x > e.z) {
+			return 0;
+		}
+		return e.y > e.z ? 1 : 2;
+	}
+
+	Point3 min;
+	Point3 max;
+};
+
+inline
+BoundingBox TransformBounds(const Matrix4x4 &transform, const BoundingBox &box) {
+	BoundingBox transformed;
+	for (int i = 0; i < 8; ++i) {
+		Point3 corner((i & 1) ? box.max.x : box.min.x,
+			(i & 2) ? box.max.y : box.min.y,
+			(i & 4) ? box.max.z : box.min.z);
+		transformed.extend(transform * corner);
+	}
+	return transformed;
+}
+
+/** Slab test, |inv_dir| is the componentwise reciprocal of the ray direction. */
+inline
+bool BoxIntersect(const BoundingBox &box, const Point3 &origin, const Vector3 &inv_dir, double tmax, double *tnear) {
+	double t0 = 0;
+	double t1 = tmax;
+	for (int i = 0; i < 3; ++i) {
+		double near_t = (box.min[i] - origin[i]) * inv_dir[i];
+		double far_t = (box.max[i] - origin[i]) * inv_dir[i];
+		if (near_t > far_t) {
+			std::swap(near_t, far_t);
+		}
+		t0 = near_t > t0 ? near_t : t0;
+		t1 = far_t < t1 ? far_t : t1;
+		if (t0 > t1) {
+			return false;
+		}
+	}
+	*tnear = t0;
+	return true;
+}
+
+struct BVHSettings
+{
+	BVHSettings()
+		: max_leaf_size(4), bin_count(16), traversal_cost(1.0), intersection_cost(1.0) {}
+
+	unsigned int max_leaf_size;
+	unsigned int bin_count;
+	double traversal_cost;
+	double intersection_cost;
+};
+
+struct BVHNode
+{
+	bool leaf() const {
+		return count > 0;
+	}
+
+	BoundingBox bounds;
+	unsigned int offset; // Left child for interior nodes (right is offset + 1), first index for leaves
+	unsigned int count; // Number of primitives in a leaf, 0 for interior nodes
+};
+
+struct BVH
+{
+	Buffer<BVHNode> nodes;
+	Buffer<unsigned int> indices;
+	BVHSettings settings;
+};
+
+inline
+void BuildBVHNode(const std::vector<BoundingBox> &bounds,
+		const std::vector<Point3> &centroids,
+		unsigned int node_index,
+		unsigned int first,
+		unsigned int count,
+		unsigned int depth,
+		BVH *bvh) {
+	const BVHSettings &settings = bvh->settings;
+
+	BoundingBox node_bounds;
+	BoundingBox centroid_bounds;
+	for (unsigned int i = first; i < first + count; ++i) {
+		node_bounds.extend(bounds[bvh->indices[i]]);
+		centroid_bounds.extend(centroids[bvh->indices[i]]);
+	}
+	bvh->nodes[node_index].bounds = node_bounds;
+	bvh->nodes[node_index].offset = first;
+	bvh->nodes[node_index].count = count;
+
+	if (count <= 1) {
+		return;
+	}
+
+	// Binned SAH over all three axes
+	int best_axis = -1;
+	unsigned int best_split = 0;
+	// Nodes over the leaf size take the best split even if SAH would prefer a leaf
+	double best_cost = count > settings.max_leaf_size ?
+		std::numeric_limits<double>::max() : settings.intersection_cost * count;
+	unsigned int bin_count = std::max(2u, std::min(settings.bin_count, static_cast<unsigned int>(BVH_MAX_BINS)));
+	if (depth < BVH_MAX_SAH_DEPTH) {
+		BoundingBox bin_bounds[BVH_MAX_BINS];
+		unsigned int bin_counts[BVH_MAX_BINS];
+		double right_areas[BVH_MAX_BINS];
+		unsigned int right_counts[BVH_MAX_BINS];
+		double inv_area = 1.0 / std::max(node_bounds.area(), std::numeric_limits<double>::min());
+
+		for (int axis = 0; axis < 3; ++axis) {
+			double extent = centroid_bounds.max[axis] - centroid_bounds.min[axis];
+			if (extent <= 0) {
+				continue;
+			}
+			std::fill(bin_bounds, bin_bounds + bin_count, BoundingBox());
+			std::fill(bin_counts, bin_counts + bin_count, 0);
+
+			double scale = bin_count / extent;
+			for (unsigned int i = first; i < first + count; ++i) {
+				unsigned int index = bvh->indices[i];
+				unsigned int bin = std::min(bin_count - 1,
+					static_cast<unsigned int>((centroids[index][axis] - centroid_bounds.min[axis]) * scale));
+				bin_bounds[bin].extend(bounds[index]);
+				++bin_counts[bin];
+			}
+
+			BoundingBox right;
+			unsigned int right_count = 0;
+			for (unsigned int bin = bin_count - 1; bin > 0; --bin) {
+				right.extend(bin_bounds[bin]);
+				right_count += bin_counts[bin];
+				right_areas[bin] = right.area();
+				right_counts[bin] = right_count;
+			}
+
+			BoundingBox left;
+			unsigned int left_count = 0;
+			for (unsigned int split = 1; split < bin_count; ++split) {
+				left.extend(bin_bounds[split - 1]);
+				left_count += bin_counts[split - 1];
+				if (left_count == 0 || right_counts[split] == 0) {
+					continue;
+				}
+				double cost = settings.traversal_cost + settings.intersection_cost * inv_area *
+					(left.area() * left_count + right_areas[split] * right_counts[split]);
+				if (cost < best_cost) {
+					best_cost = cost;
+					best_axis = axis;
+					best_split = split;
+				}
+			}
+		}
+	}
+
+	unsigned int mid;
+	if (best_axis >= 0) {
+		double extent = centroid_bounds.max[best_axis] - centroid_bounds.min[best_axis];
+		double scale = bin_count / extent;
+		unsigned int *begin = &bvh->indices[first];
+		unsigned int *split = std::partition(begin, begin + count, [&](unsigned int index) {
+			unsigned int bin = std::min(bin_count - 1,
+				static_cast<unsigned int>((centroids[index][best_axis] - centroid_bounds.min[best_axis]) * scale));
+			return bin < best_split;
+		});
+		mid = first + static_cast<unsigned int>(split - begin);
+	} else if (count > settings.max_leaf_size) {
+		// Every centroid coincides or the tree is too deep for SAH but the leaf would be
+		// too large, fall back to a median split which also bounds the depth of the tree.
+		int axis = centroid_bounds.longestAxis();
+		unsigned int *begin = &bvh->indices[first];
+		std::nth_element(begin, begin + count / 2, begin + count, [&](unsigned int a, unsigned int b) {
+			return centroids[a][axis] < centroids[b][axis];
+		});
+		mid = first + count / 2;
+	} else {
+		return;
+	}
+
+	unsigned int left_index = bvh->nodes.size();
+	bvh->nodes.resize(left_index + 2);
+	bvh->nodes[node_index].offset = left_index;
+	bvh->nodes[node_index].count = 0;
+
+	BuildBVHNode(bounds, centroids, left_index, first, mid - first, depth + 1, bvh);
+	BuildBVHNode(bounds, centroids, left_index + 1, mid, first + count - mid, depth + 1, bvh);
+}
+
+/** Build |bvh| over primitives given by their bounds, leaves index into |bounds|. */
+inline
+void BuildBVHFromBounds(const std::vector<BoundingBox> &bounds, const BVHSettings &settings, BVH *bvh) {
+	bvh->settings = settings;
+	bvh->nodes.clear();
+	bvh->indices.resize(bounds.size());
+	if (bounds.empty()) {
+		return;
+	}
+
+	std::vector<Point3> centroids(bounds.size());
+	for (unsigned int i = 0; i < bounds.size(); ++i) {
+		centroids[i] = bounds[i].center();
+		bvh->indices[i] = i;
+	}
+
+	bvh->nodes.reserve(2 * bounds.size());
+	bvh->nodes.resize(1);
+	BuildBVHNode(bounds, centroids, 0, 0, bounds.size(), 0, bvh);
+}
+
+inline
+BoundingBox PrimitiveBounds(const Triangle &triangle) {
+	BoundingBox bounds;
+	bounds.extend(triangle.vertices[0]);
+	bounds.extend(triangle.vertices[1]);
+	bounds.extend(triangle.vertices[2]);
+	return bounds;
+}
+
+inline
+BoundingBox PrimitiveBounds(const Sphere &sphere) {
+	Vector3 radius(sphere.radius, sphere.radius, sphere.radius);
+	return BoundingBox(sphere.pos - radius, sphere.pos + radius);
+}
+
+inline
+bool PrimitiveIntersect(const Triangle &triangle, const Ray &ray, Intersection *intersection) {
+	return TriangleIntersect(triangle, ray, intersection);
+}
+
+inline
+bool PrimitiveIntersect(const Sphere &sphere, const Ray &ray, Intersection *intersection) {
+	// SphereIntersect doesn't respect the current closest hit
+	Intersection hit;
+	if (SphereIntersect(sphere, ray, &hit) && hit.t < intersection->t) {
+		*intersection = hit;
+		return true;
+	}
+	return false;
+}
+
+inline
+bool PrimitiveOccluded(const Triangle &triangle, const Ray &ray, double tmax) {
+	return TriangleOccluded(triangle, ray, tmax);
+}
+
+inline
+bool PrimitiveOccluded(const Sphere &sphere, const Ray &ray, double tmax) {
+	return SphereOccluded(sphere, ray, tmax);
+}
+
+template <typename Primitives>
+void BuildBVH(const Primitives &primitives, const BVHSettings &settings, BVH *bvh) {
+	std::vector<BoundingBox> bounds(primitives.size());
+	for (unsigned int i = 0; i < primitives.size(); ++i) {
+		bounds[i] = PrimitiveBounds(primitives[i]);
+	}
+	BuildBVHFromBounds(bounds, settings, bvh);
+}
+
+/**
+ * Collapse helper for wide layouts, gathers up to |width| descendants of the interior node
+ * |node_index| that together cover it by repeatedly opening the largest interior one.
+ * Returns the number written to |children|.
+ */
+inline
+unsigned int GatherBVHChildren(const BVH &bvh, unsigned int node_index, unsigned int width, unsigned int *children) {
+	const BVHNode &node = bvh.nodes[node_index];
+	children[0] = node.offset;
+	children[1] = node.offset + 1;
+	unsigned int count = 2;
+	while (count < width) {
+		int largest = -1;
+		double largest_area = -1;
+		for (unsigned int i = 0; i < count; ++i) {
+			const BVHNode &child = bvh.nodes[children[i]];
+			if (!child.leaf() && child.bounds.area() > largest_area) {
+				largest = i;
+				largest_area = child.bounds.area();
+			}
+		}
+		if (largest < 0) {
+			break;
+		}
+		unsigned int opened = bvh.nodes[children[largest]].offset;
+		children[largest] = opened;
+		children[count++] = opened + 1;
+	}
+	return count;
+}
+
+inline
+Vector3 InverseDirection(const Vector3 &dir) {
+	return Vector3(1.0 / dir.x, 1.0 / dir.y, 1.0 / dir.z);
+}
+
+/** Default node visitor for BVHTraverse, compiles away. */
+struct BVHNoVisit
+{
+	void operator () (unsigned int) const {}
+};
+
+/**
+ * Closest hit traversal calling leaf(node) for the leaves the ray reaches, nearer children first.
+ * leaf returns whether it found a hit and shrinks *tmax to it when it does.
+ * visit(node_index) is called for every node whose bounds are fetched.
+ */
+template <typename LeafFunc, typename VisitFunc>
+bool BVHTraverse(const BVH &bvh, const Ray &ray, double *tmax, const LeafFunc &leaf, const VisitFunc &visit) {
+	if (bvh.nodes.empty()) {
+		return false;
+	}
+
+	Vector3 inv_dir = InverseDirection(ray.dir);
+	double tnear;
+	visit(0);
+	if (!BoxIntersect(bvh.nodes[0].bounds, ray.origin, inv_dir, *tmax, &tnear)) {
+		return false;
+	}
+
+	bool has_intersection = false;
+	unsigned int stack[BVH_STACK_SIZE];
+	unsigned int stack_size = 0;
+	unsigned int node_index = 0;
+	while (true) {
+		const BVHNode &node = bvh.nodes[node_index];
+		STAT_INC(STAT_NODE_VISITS);
+		if (node.leaf()) {
+			STAT_INC(STAT_LEAF_VISITS);
+			if (leaf(node)) {
+				has_intersection = true;
+			}
+		} else {
+			double t_left, t_right;
+			visit(node.offset);
+			visit(node.offset + 1);
+			bool hit_left = BoxIntersect(bvh.nodes[node.offset].bounds, ray.origin, inv_dir, *tmax, &t_left);
+			bool hit_right = BoxIntersect(bvh.nodes[node.offset + 1].bounds, ray.origin, inv_dir, *tmax, &t_right);
+			if (hit_left && hit_right) {
+				// Visit the nearer child first so the farther one is more likely to be culled
+				bool left_first = t_left <= t_right;
+				stack[stack_size++] = left_first ? node.offset + 1 : node.offset;
+				STAT_MAX(STAT_MAX_TRAVERSAL_DEPTH, stack_size);
+				node_index = left_first ? node.offset : node.offset + 1;
+				continue;
+			} else if (hit_left || hit_right) {
+				node_index = hit_left ? node.offset : node.offset + 1;
+				continue;
+			}
+		}
+		if (stack_size == 0) {
+			break;
+		}
+		node_index = stack[--stack_size];
+	}
+	return has_intersection;
+}
+
+template <typename LeafFunc>
+bool BVHTraverse(const BVH &bvh, const Ray &ray, double *tmax, const LeafFunc &leaf) {
+	return BVHTraverse(bvh, ray, tmax, leaf, BVHNoVisit());
+}
+
+/** Any hit traversal, stops as soon as leaf(node) reports a hit in (EPSILON, tmax). */
+template <typename LeafFunc>
+bool BVHTraverseAny(const BVH &bvh, const Ray &ray, double tmax, const LeafFunc &leaf) {
+	if (bvh.nodes.empty()) {
+		return false;
+	}
+
+	Vector3 inv_dir = InverseDirection(ray.dir);
+	unsigned int stack[BVH_STACK_SIZE];
+	unsigned int stack_size = 0;
+	stack[stack_size++] = 0;
+	while (stack_size > 0) {
+		const BVHNode &node = bvh.nodes[stack[--stack_size]];
+		double tnear;
+		if (!BoxIntersect(node.bounds, ray.origin, inv_dir, tmax, &tnear)) {
+			continue;
+		}
+		// Counted once entered, as in BVHTraverse
+		STAT_INC(STAT_NODE_VISITS);
+		if (node.leaf()) {
+			STAT_INC(STAT_LEAF_VISITS);
+			if (leaf(node)) {
+				return true;
+			}
+		} else {
+			stack[stack_size++] = node.offset + 1;
+			stack[stack_size++] = node.offset;
+			STAT_MAX(STAT_MAX_TRAVERSAL_DEPTH, stack_size);
+		}
+	}
+	return false;
+}
+
+/**
+ * Closest hit against the |primitives| |bvh| was built over.
+ * intersection->t must be initialized and bounds the search, as for TriangleIntersect.
+ */
+template <typename Primitives>
+bool BVHIntersect(const BVH &bvh, const Primitives &primitives, const Ray &ray, Intersection *intersection) {
+	return BVHTraverse(bvh, ray, &intersection->t, [&](const BVHNode &node) {
+		bool has_intersection = false;
+		for (unsigned int i = node.offset; i < node.offset + node.count; ++i) {
+			if (PrimitiveIntersect(primitives[bvh.indices[i]], ray, intersection)) {
+				has_intersection = true;
+			}
+		}
+		return has_intersection;
+	});
+}
+
+/** Any hit in (EPSILON, tmax), returns on the first primitive found. */
+template <typename Primitives>
+bool BVHOccluded(const BVH &bvh, const Primitives &primitives, const Ray &ray, double tmax) {
+	return BVHTraverseAny(bvh, ray, tmax, [&](const BVHNode &node) {
+		for (unsigned int i = node.offset; i < node.offset + node.count; ++i) {
+			if (PrimitiveOccluded(primitives[bvh.indices[i]], ray, tmax)) {
+				return true;
+			}
+		}
+		return false;
+	});
+}
+
+#endif
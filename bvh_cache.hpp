@@ -0,0 +1,226 @@
+/*
+* Copyright (c) 2015 Owen Glofcheski
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+*    1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+*    2. Altered source versions must be plainly marked as such, and must not
+*    be misrepresented as being the original software.
+*
+*    3. This notice may not be removed or altered from any source
+*    distribution.
+*/
+
+
+#ifndef _BVH_CACHE_HPP_
+#define _BVH_CACHE_HPP_
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "bvh.hpp"
+#include "mapped_file.hpp"
+
+/**
+ * On-disk cache of built hierarchies. Nodes address their children and primitives by
+ * index so the arrays are relocatable and a cache file is used straight from a mapping.
+ * Files are keyed by BVHContentHash, a mismatch means the input changed and the caller rebuilds.
+ */
+#define BVH_CACHE_MAGIC 0x48435642 // "BVCH"
+#define BVH_CACHE_VERSION 1
+#define BVH_CACHE_ALIGNMENT 64
+
+struct BVHCacheHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t hash;
+	uint32_t node_size; // Catches layout changes in BVHNode
+	uint32_t node_count;
+	uint32_t index_count;
+	uint32_t max_leaf_size;
+	uint32_t bin_count;
+	uint32_t padding;
+	double traversal_cost;
+	double intersection_cost;
+	uint64_t node_offset;
+	uint64_t index_offset;
+};
+
+inline
+uint64_t HashMix(uint64_t x) {
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+
+inline
+uint64_t HashBytes(const void *data, size_t size, uint64_t hash) {
+	const char *bytes = static_cast<const char *>(data);
+	for (; size >= 8; size -= 8, bytes += 8) {
+		uint64_t word;
+		memcpy(&word, bytes, 8);
+		hash = (hash ^ HashMix(word)) * 0x9e3779b97f4a7c15ULL;
+	}
+	uint64_t tail = 0;
+	memcpy(&tail, bytes, size);
+	return HashMix(hash ^ HashMix(tail ^ (static_cast<uint64_t>(size) << 56)));
+}
+
+/**
+ * Hash of everything the builder reads, the primitive bounds and the settings,
+ * so any change to the input that could change the hierarchy changes the hash.
+ */
+template <typename Primitives>
+uint64_t BVHContentHash(const Primitives &primitives, const BVHSettings &settings) {
+	uint64_t hash = HashMix(BVH_CACHE_VERSION);
+	hash = HashBytes(&settings.max_leaf_size, sizeof(settings.max_leaf_size), hash);
+	hash = HashBytes(&settings.bin_count, sizeof(settings.bin_count), hash);
+	hash = HashBytes(&settings.traversal_cost, sizeof(settings.traversal_cost), hash);
+	hash = HashBytes(&settings.intersection_cost, sizeof(settings.intersection_cost), hash);
+	for (size_t i = 0; i < primitives.size(); ++i) {
+		BoundingBox bounds = PrimitiveBounds(primitives[i]);
+		double values[6] = { bounds.min.x, bounds.min.y, bounds.min.z, bounds.max.x, bounds.max.y, bounds.max.z };
+		hash = HashBytes(values, sizeof(values), hash);
+	}
+	return hash;
+}
+
+inline
+bool SaveBVHCache(const BVH &bvh, uint64_t hash, const std::string &filename) {
+	if (!IsLittleEndian()) {
+		return false;
+	}
+
+	BVHCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic = BVH_CACHE_MAGIC;
+	header.version = BVH_CACHE_VERSION;
+	header.hash = hash;
+	header.node_size = sizeof(BVHNode);
+	header.node_count = bvh.nodes.size();
+	header.index_count = bvh.indices.size();
+	header.max_leaf_size = bvh.settings.max_leaf_size;
+	header.bin_count = bvh.settings.bin_count;
+	header.traversal_cost = bvh.settings.traversal_cost;
+	header.intersection_cost = bvh.settings.intersection_cost;
+	header.node_offset = (sizeof(header) + BVH_CACHE_ALIGNMENT - 1) / BVH_CACHE_ALIGNMENT * BVH_CACHE_ALIGNMENT;
+	uint64_t node_end = header.node_offset + bvh.nodes.size() * sizeof(BVHNode);
+	header.index_offset = (node_end + BVH_CACHE_ALIGNMENT - 1) / BVH_CACHE_ALIGNMENT * BVH_CACHE_ALIGNMENT;
+
+	// Write to a temporary of our own and rename so concurrent loaders never map a partial file
+	std::string temporary = TemporaryFilename(filename);
+	{
+		std::ofstream ofs(temporary, std::ios::binary);
+		if (!ofs.is_open()) {
+			std::remove(temporary.c_str());
+			return false;
+		}
+		const char padding[BVH_CACHE_ALIGNMENT] = {};
+		ofs.write(reinterpret_cast<const char *>(&header), sizeof(header));
+		ofs.write(padding, header.node_offset - sizeof(header));
+		if (!bvh.nodes.empty()) {
+			ofs.write(reinterpret_cast<const char *>(bvh.nodes.data()), bvh.nodes.size() * sizeof(BVHNode));
+		}
+		ofs.write(padding, header.index_offset - node_end);
+		if (!bvh.indices.empty()) {
+			ofs.write(reinterpret_cast<const char *>(bvh.indices.data()), bvh.indices.size() * sizeof(unsigned int));
+		}
+		ofs.close();
+		if (!ofs.good()) {
+			std::remove(temporary.c_str());
+			return false;
+		}
+	}
+	return ReplaceFileAtomic(temporary, filename);
+}
+
+/** Checks every node addresses children and indices inside the arrays, so traversal can't run off them. */
+inline
+bool ValidBVHNodes(const BVHNode *nodes, unsigned int node_count, unsigned int index_count) {
+	for (unsigned int i = 0; i < node_count; ++i) {
+		const BVHNode &node = nodes[i];
+		if (node.leaf()) {
+			if (node.offset > index_count || node.count > index_count - node.offset) {
+				return false;
+			}
+		} else if (node.offset <= i || node.offset >= node_count - 1) {
+			return false; // Children always follow their parent, which also rules out cycles
+		}
+	}
+	return true;
+}
+
+/**
+ * Maps the cache at |filename| and points |bvh| at it, pages are read as traversal touches them.
+ * Fails if the file is missing, malformed or was built from input with a different |hash|.
+ * |file| must outlive |bvh|.
+ */
+inline
+bool LoadBVHCache(const std::string &filename, uint64_t hash, MappedFile *file, BVH *bvh) {
+	if (!IsLittleEndian() || !MapFile(filename, file)) {
+		return false;
+	}
+
+	BVHCacheHeader header;
+	bool valid = file->size >= sizeof(header);
+	if (valid) {
+		memcpy(&header, file->data, sizeof(header));
+		valid = header.magic == BVH_CACHE_MAGIC && header.version == BVH_CACHE_VERSION &&
+			header.hash == hash && header.node_size == sizeof(BVHNode) &&
+			header.node_offset % BVH_CACHE_ALIGNMENT == 0 && header.index_offset % BVH_CACHE_ALIGNMENT == 0 &&
+			header.node_offset <= file->size &&
+			header.node_count <= (file->size - header.node_offset) / sizeof(BVHNode) &&
+			header.index_offset <= file->size &&
+			header.index_count <= (file->size - header.index_offset) / sizeof(unsigned int) &&
+			ValidBVHNodes(reinterpret_cast<const BVHNode *>(file->data + header.node_offset),
+				header.node_count, header.index_count);
+	}
+	if (!valid) {
+		UnmapFile(file);
+		return false;
+	}
+
+	bvh->nodes.view(reinterpret_cast<const BVHNode *>(file->data + header.node_offset), header.node_count);
+	bvh->indices.view(reinterpret_cast<const unsigned int *>(file->data + header.index_offset), header.index_count);
+	bvh->settings.max_leaf_size = header.max_leaf_size;
+	bvh->settings.bin_count = header.bin_count;
+	bvh->settings.traversal_cost = header.traversal_cost;
+	bvh->settings.intersection_cost = header.intersection_cost;
+	return true;
+}
+
+/**
+ * Loads |bvh| from the cache at |filename| when it matches |primitives| and |settings|,
+ * otherwise builds it and rewrites the cache. Returns true on a cache hit.
+ */
+template <typename Primitives>
+bool BuildBVHCached(const Primitives &primitives, const BVHSettings &settings,
+		const std::string &filename, MappedFile *file, BVH *bvh) {
+	uint64_t hash = BVHContentHash(primitives, settings);
+	if (LoadBVHCache(filename, hash, file, bvh)) {
+		return true;
+	}
+	BuildBVH(primitives, settings, bvh);
+	SaveBVHCache(*bvh, hash, filename);
+	return false;
+}
+
+#endif
@@ -0,0 +1,241 @@
+/*
+* Copyright (c) 2015 Owen Glofcheski
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+*    1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+*    2. Altered source versions must be plainly marked as such, and must not
+*    be misrepresented as being the original software.
+*
+*    3. This notice may not be removed or altered from any source
+*    distribution.
+*/
+
+#ifndef _BVH_REFIT_HPP_
+#define _BVH_REFIT_HPP_
+
+#include <algorithm>
+#include <iostream>
+#include <limits>
+#include <vector>
+
+#include "bvh.hpp"
+#include "parallel.hpp"
+
+#define BVH_REFIT_DEPTH 6 // Subtrees below this depth are refit in parallel
+#define BVH_PARALLEL_REFIT_NODES 4096
+
+template <typename Primitives>
+BoundingBox RefitBVHNode(const Primitives &primitives, unsigned int node_index, BVH *bvh) {
+	BVHNode &node = bvh->nodes[node_index];
+	if (node.leaf()) {
+		BoundingBox bounds;
+		for (unsigned int i = node.offset; i < node.offset + node.count; ++i) {
+			bounds.extend(PrimitiveBounds(primitives[bvh->indices[i]]));
+		}
+		node.bounds = bounds;
+	} else {
+		BoundingBox bounds = RefitBVHNode(primitives, node.offset, bvh);
+		bounds.extend(RefitBVHNode(primitives, node.offset + 1, bvh));
+		node.bounds = bounds;
+	}
+	return node.bounds;
+}
+
+inline
+void GatherBVHSubtrees(const BVH &bvh, unsigned int node_index, unsigned int depth,
+		unsigned int *roots, unsigned int *root_count) {
+	const BVHNode &node = bvh.nodes[node_index];
+	if (depth == BVH_REFIT_DEPTH || node.leaf()) {
+		roots[(*root_count)++] = node_index;
+		return;
+	}
+	GatherBVHSubtrees(bvh, node.offset, depth + 1, roots, root_count);
+	GatherBVHSubtrees(bvh, node.offset + 1, depth + 1, roots, root_count);
+}
+
+inline
+void RefitBVHTop(unsigned int node_index, unsigned int depth, BVH *bvh) {
+	BVHNode &node = bvh->nodes[node_index];
+	if (depth == BVH_REFIT_DEPTH || node.leaf()) {
+		return;
+	}
+	RefitBVHTop(node.offset, depth + 1, bvh);
+	RefitBVHTop(node.offset + 1, depth + 1, bvh);
+	node.bounds = bvh->nodes[node.offset].bounds;
+	node.bounds.extend(bvh->nodes[node.offset + 1].bounds);
+}
+
+/**
+ * Update the bounds of |bvh| in place, bottom up, after |primitives| moved or deformed.
+ * The topology is kept so this is O(N), but quality degrades with large motion, see
+ * UpdateBVH. Trees of BVH_PARALLEL_REFIT_NODES or more are split across |workers|
+ * when given, otherwise everything runs on the calling thread. Neither allocates.
+ */
+template <typename Primitives>
+void RefitBVH(const Primitives &primitives, BVH *bvh, WorkerPool *workers = NULL) {
+	if (bvh->nodes.empty()) {
+		return;
+	}
+	if (workers == NULL || bvh->nodes.size() < BVH_PARALLEL_REFIT_NODES) {
+		RefitBVHNode(primitives, 0, bvh);
+		return;
+	}
+
+	unsigned int roots[1 << BVH_REFIT_DEPTH];
+	unsigned int root_count = 0;
+	GatherBVHSubtrees(*bvh, 0, 0, roots, &root_count);
+	ParallelFor(0, root_count, [&](unsigned int i) {
+		RefitBVHNode(primitives, roots[i], bvh);
+	}, workers);
+	RefitBVHTop(0, 0, bvh);
+}
+
+/**
+ * Computes the area weighted SAH cost of the subtree at |node_index| and stores
+ * the expected cost of a ray hitting each node (cost / area) in |relative_costs|.
+ */
+inline
+double ComputeBVHCosts(const BVH &bvh, unsigned int node_index, double *relative_costs) {
+	const BVHNode &node = bvh.nodes[node_index];
+	double area = node.bounds.area();
+	double cost;
+	if (node.leaf()) {
+		cost = area * node.count * bvh.settings.intersection_cost;
+	} else {
+		cost = area * bvh.settings.traversal_cost +
+			ComputeBVHCosts(bvh, node.offset, relative_costs) +
+			ComputeBVHCosts(bvh, node.offset + 1, relative_costs);
+	}
+	relative_costs[node_index] = cost / std::max(area, std::numeric_limits<double>::min());
+	return cost;
+}
+
+/** Finds the contiguous range of indices below |node_index| and the number of nodes in the subtree. */
+inline
+void BVHSubtreeRange(const BVH &bvh, unsigned int node_index,
+		unsigned int *first, unsigned int *count, unsigned int *node_count) {
+	const BVHNode &node = bvh.nodes[node_index];
+	++*node_count;
+	if (node.leaf()) {
+		*first = std::min(*first, node.offset);
+		*count += node.count;
+		return;
+	}
+	BVHSubtreeRange(bvh, node.offset, first, count, node_count);
+	BVHSubtreeRange(bvh, node.offset + 1, first, count, node_count);
+}
+
+/** Tracks the SAH cost of a refit BVH against its cost when built. */
+struct BVHMonitor
+{
+	BVHMonitor() : rebuild_threshold(1.3), dead_nodes(0) {}
+
+	double rebuild_threshold; // Ratio of current to built cost past which a subtree is rebuilt
+	std::vector<double> reference_costs; // Relative cost of each node when its subtree was built
+	std::vector<double> current_costs;
+	std::vector<BoundingBox> bounds; // Scratch for rebuilds, indexed by primitive
+	std::vector<Point3> centroids;
+	unsigned int dead_nodes; // Nodes orphaned by partial rebuilds, reclaimed by a full rebuild
+};
+
+/** Take the current state of |bvh| as the reference, call after every full build. */
+inline
+void ResetBVHMonitor(const BVH &bvh, BVHMonitor *monitor) {
+	monitor->reference_costs.resize(bvh.nodes.size());
+	monitor->current_costs.resize(bvh.nodes.size());
+	monitor->bounds.resize(bvh.indices.size());
+	monitor->centroids.resize(bvh.indices.size());
+	monitor->dead_nodes = 0;
+	if (!bvh.nodes.empty()) {
+		ComputeBVHCosts(bvh, 0, &monitor->reference_costs[0]);
+	}
+}
+
+template <typename Primitives>
+void RebuildBVHSubtree(const Primitives &primitives, unsigned int node_index, unsigned int depth,
+		BVHMonitor *monitor, BVH *bvh) {
+	unsigned int first = std::numeric_limits<unsigned int>::max();
+	unsigned int count = 0;
+	unsigned int node_count = 0;
+	BVHSubtreeRange(*bvh, node_index, &first, &count, &node_count);
+
+	for (unsigned int i = first; i < first + count; ++i) {
+		unsigned int index = bvh->indices[i];
+		monitor->bounds[index] = PrimitiveBounds(primitives[index]);
+		monitor->centroids[index] = monitor->bounds[index].center();
+	}
+
+	// The subtree root is rebuilt in place so its parent stays valid, the rest is appended
+	BuildBVHNode(monitor->bounds, monitor->centroids, node_index, first, count, depth, bvh);
+	monitor->dead_nodes += node_count - 1;
+
+	monitor->reference_costs.resize(bvh->nodes.size());
+	monitor->current_costs.resize(bvh->nodes.size());
+	ComputeBVHCosts(*bvh, node_index, &monitor->reference_costs[0]);
+}
+
+template <typename Primitives>
+unsigned int RebuildDegradedBVHNodes(const Primitives &primitives, unsigned int node_index, unsigned int depth,
+		BVHMonitor *monitor, BVH *bvh) {
+	const double threshold = monitor->rebuild_threshold;
+	if (monitor->current_costs[node_index] <= monitor->reference_costs[node_index] * threshold) {
+		return 0;
+	}
+
+	BVHNode node = bvh->nodes[node_index];
+	if (node.leaf()) {
+		return 0;
+	}
+
+	// Descend while the degradation can be pinned on a child, otherwise this node's split is at fault
+	unsigned int left = node.offset;
+	unsigned int right = node.offset + 1;
+	if (monitor->current_costs[left] > monitor->reference_costs[left] * threshold ||
+			monitor->current_costs[right] > monitor->reference_costs[right] * threshold) {
+		unsigned int rebuilt = RebuildDegradedBVHNodes(primitives, left, depth + 1, monitor, bvh);
+		return rebuilt + RebuildDegradedBVHNodes(primitives, right, depth + 1, monitor, bvh);
+	}
+
+	RebuildBVHSubtree(primitives, node_index, depth, monitor, bvh);
+	return 1;
+}
+
+/**
+ * Refit |bvh| to the moved |primitives| then rebuild the subtrees whose SAH cost
+ * has drifted past monitor->rebuild_threshold, returns the number of subtrees rebuilt.
+ * The whole tree is rebuilt once partial rebuilds have orphaned half of its nodes.
+ * The refit runs on |workers| as in RefitBVH.
+ */
+template <typename Primitives>
+unsigned int UpdateBVH(const Primitives &primitives, BVHMonitor *monitor, BVH *bvh,
+		WorkerPool *workers = NULL) {
+	RefitBVH(primitives, bvh, workers);
+	if (bvh->nodes.empty()) {
+		return 0;
+	}
+
+	ComputeBVHCosts(*bvh, 0, &monitor->current_costs[0]);
+	if (monitor->current_costs[0] <= monitor->reference_costs[0] * monitor->rebuild_threshold) {
+		return 0;
+	}
+
+	unsigned int rebuilt = RebuildDegradedBVHNodes(primitives, 0, 0, monitor, bvh);
+	if (monitor->dead_nodes > bvh->nodes.size() / 2) {
+		BuildBVH(primitives, bvh->settings, bvh);
+		ResetBVHMonitor(*bvh, monitor);
+	}
+	return rebuilt;
+}
+
+#endif
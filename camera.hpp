@@ -0,0 +1,67 @@
+/*
+* Copyright (c) 2015 Owen Glofcheski
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+*    1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+*    2. Altered source versions must be plainly marked as such, and must not
+*    be misrepresented as being the original software.
+*
+*    3. This notice may not be removed or altered from any source
+*    distribution.
+*/
+
+
+#ifndef _CAMERA_HPP_
+#define _CAMERA_HPP_
+
+#include <iostream>
+
+#include "algebra.hpp"
+#include "primitive.hpp"
+
+/** Pinhole camera, the basis is derived on construction. */
+struct Camera
+{
+	Camera() : fov(50) {}
+	Camera(const Point3 &eye, const Vector3 &view, const Vector3 &up, double fov)
+		: eye(eye), fov(fov) {
+		w = view;
+		w.normalize();
+		u = w.cross(up);
+		u.normalize();
+		v = u.cross(w);
+	}
+
+	Point3 eye;
+	double fov; // Vertical field of view in degrees
+
+	Vector3 u; // Right
+	Vector3 v; // Up
+	Vector3 w; // View
+};
+
+/** Ray through (x, y) in pixel space of an image of |size|, y increasing upwards as in Image. */
+inline
+Ray CameraRay(const Camera &camera, const Size &size, double x, double y) {
+	double half_height = tan(toRad(camera.fov) / 2);
+	double half_width = half_height * size.width / size.height;
+	double px = (2 * x / size.width - 1) * half_width;
+	double py = (2 * y / size.height - 1) * half_height;
+
+	Vector3 dir = camera.w + px * camera.u + py * camera.v;
+	dir.normalize();
+	return Ray(camera.eye, dir);
+}
+
+#endif
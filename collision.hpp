@@ -0,0 +1,339 @@
+/*
+* Copyright (c) 2015 Owen Glofcheski
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+*    1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+*    2. Altered source versions must be plainly marked as such, and must not
+*    be misrepresented as being the original software.
+*
+*    3. This notice may not be removed or altered from any source
+*    distribution.
+*/
+
+
+#ifndef _COLLISION_HPP_
+#define _COLLISION_HPP_
+
+#include <algorithm>
+#include <iostream>
+#include <utility>
+#include <vector>
+
+#include "algebra.hpp"
+#include "bvh.hpp"
+#include "instance.hpp"
+#include "parallel.hpp"
+#include "primitive.hpp"
+
+#define COLLISION_MAX_CONTACTS 16 // Per body pair, enough to resolve a resting contact
+#define COLLISION_AXIS_HYSTERESIS 1.5 // Variance ratio another axis needs before the sweep switches to it
+
+/** Where two bodies touch, |normal| is the world space face normal of body_a's triangle. */
+struct Contact
+{
+	unsigned int body_a;
+	unsigned int body_b;
+	Point3 pos;
+	Vector3 normal;
+};
+
+/**
+ * Sweep and prune over world bounds. The sort order is kept between updates so
+ * that with coherent motion the insertion sort is close to linear.
+ */
+struct CollisionBroadphase
+{
+	CollisionBroadphase() : axis(0) {}
+
+	int axis;
+	std::vector<unsigned int> order;
+	std::vector<BoundingBox> bounds;
+};
+
+inline
+bool BoundsOverlap(const BoundingBox &a, const BoundingBox &b) {
+	return a.min.x <= b.max.x && b.min.x <= a.max.x &&
+		a.min.y <= b.max.y && b.min.y <= a.max.y &&
+		a.min.z <= b.max.z && b.min.z <= a.max.z;
+}
+
+/**
+ * Sort along the axis the body centres vary most on, so the sweep rejects the most pairs.
+ * |current_axis| is kept until another varies COLLISION_AXIS_HYSTERESIS times more, as
+ * switching costs a full sort.
+ */
+inline
+int SweepAxis(const std::vector<BoundingBox> &bounds, int current_axis) {
+	double sum[3] = { 0, 0, 0 };
+	double sum2[3] = { 0, 0, 0 };
+	for (const BoundingBox &box : bounds) {
+		Point3 center = box.center();
+		for (int i = 0; i < 3; ++i) {
+			sum[i] += center[i];
+			sum2[i] += center[i] * center[i];
+		}
+	}
+	double variances[3];
+	int axis = 0;
+	for (int i = 0; i < 3; ++i) {
+		variances[i] = sum2[i] - sum[i] * sum[i] / bounds.size();
+		if (variances[i] > variances[axis]) {
+			axis = i;
+		}
+	}
+	return variances[axis] > COLLISION_AXIS_HYSTERESIS * variances[current_axis] ? axis : current_axis;
+}
+
+/** Find the pairs of |bodies| whose world bounds overlap, with the lower index first. */
+inline
+void UpdateCollisionBroadphase(const std::vector<Instance> &bodies, CollisionBroadphase *broadphase,
+		std::vector<std::pair<unsigned int, unsigned int> > *pairs) {
+	pairs->clear();
+	unsigned int body_count = bodies.size();
+	broadphase->bounds.resize(body_count);
+	for (unsigned int i = 0; i < body_count; ++i) {
+		broadphase->bounds[i] = PrimitiveBounds(bodies[i]);
+	}
+	bool sorted = broadphase->order.size() == body_count;
+	if (!sorted) {
+		broadphase->order.resize(body_count);
+		for (unsigned int i = 0; i < body_count; ++i) {
+			broadphase->order[i] = i;
+		}
+	}
+	if (body_count < 2) {
+		return;
+	}
+
+	const std::vector<BoundingBox> &bounds = broadphase->bounds;
+	int axis = SweepAxis(bounds, broadphase->axis);
+	sorted = sorted && axis == broadphase->axis;
+	broadphase->axis = axis;
+	std::vector<unsigned int> &order = broadphase->order;
+	if (!sorted) {
+		// The previous order says nothing about this axis, insertion sort would be quadratic
+		std::sort(order.begin(), order.end(), [&](unsigned int a, unsigned int b) {
+			return bounds[a].min[axis] < bounds[b].min[axis];
+		});
+	}
+	for (unsigned int i = 1; i < body_count; ++i) {
+		unsigned int body = order[i];
+		double key = bounds[body].min[axis];
+		unsigned int j = i;
+		for (; j > 0 && bounds[order[j - 1]].min[axis] > key; --j) {
+			order[j] = order[j - 1];
+		}
+		order[j] = body;
+	}
+
+	for (unsigned int i = 0; i < body_count; ++i) {
+		const BoundingBox &box = bounds[order[i]];
+		for (unsigned int j = i + 1; j < body_count && bounds[order[j]].min[axis] <= box.max[axis]; ++j) {
+			if (BoundsOverlap(box, bounds[order[j]])) {
+				pairs->push_back(std::make_pair(std::min(order[i], order[j]), std::max(order[i], order[j])));
+			}
+		}
+	}
+}
+
+/** TransformBounds without the eight corner transforms, by the absolute value of the matrix. */
+inline
+BoundingBox TransformBoundsAffine(const Matrix4x4 &transform, const BoundingBox &box) {
+	Point3 center = transform * box.center();
+	Vector3 half = 0.5 * box.extent();
+	BoundingBox transformed(center, center);
+	for (int i = 0; i < 3; ++i) {
+		const double *row = &transform.d[4 * i];
+		double radius = std::abs(row[0]) * half.x + std::abs(row[1]) * half.y + std::abs(row[2]) * half.z;
+		transformed.min[i] -= radius;
+		transformed.max[i] += radius;
+	}
+	return transformed;
+}
+
+/** Endpoints of the part of |triangle| lying on the plane its vertices are |distance| from. */
+inline
+unsigned int TrianglePlaneSegment(const Triangle &triangle, const double distance[3], Point3 points[2]) {
+	unsigned int count = 0;
+	for (int i = 0; i < 3 && count < 2; ++i) {
+		int j = (i + 1) % 3;
+		if (distance[i] == 0) {
+			points[count++] = triangle.vertices[i];
+		} else if ((distance[i] < 0) != (distance[j] < 0) && distance[j] != 0) {
+			double s = distance[i] / (distance[i] - distance[j]);
+			points[count++] = triangle.vertices[i] + s * (triangle.vertices[j] - triangle.vertices[i]);
+		}
+	}
+	if (count == 1) {
+		points[1] = points[0];
+	}
+	return count;
+}
+
+/**
+ * Intersect two triangles by clipping each against the other's plane and
+ * overlapping the two segments along the planes' common line. Writes the
+ * intersection segment to |p0|, |p1|. Coplanar triangles report no contact,
+ * their neighbouring faces will.
+ */
+inline
+bool TriangleTriangleIntersect(const Triangle &a, const Triangle &b, Point3 *p0, Point3 *p1) {
+	Vector3 normal_b = (b.vertices[1] - b.vertices[0]).cross(b.vertices[2] - b.vertices[0]);
+	double distance_a[3];
+	for (int i = 0; i < 3; ++i) {
+		distance_a[i] = normal_b.dot(a.vertices[i] - b.vertices[0]);
+	}
+	if ((distance_a[0] > 0 && distance_a[1] > 0 && distance_a[2] > 0) ||
+			(distance_a[0] < 0 && distance_a[1] < 0 && distance_a[2] < 0)) {
+		return false;
+	}
+
+	Vector3 normal_a = (a.vertices[1] - a.vertices[0]).cross(a.vertices[2] - a.vertices[0]);
+	double distance_b[3];
+	for (int i = 0; i < 3; ++i) {
+		distance_b[i] = normal_a.dot(b.vertices[i] - a.vertices[0]);
+	}
+	if ((distance_b[0] > 0 && distance_b[1] > 0 && distance_b[2] > 0) ||
+			(distance_b[0] < 0 && distance_b[1] < 0 && distance_b[2] < 0)) {
+		return false;
+	}
+
+	Vector3 line = normal_a.cross(normal_b);
+	if (line.dot(line) == 0) {
+		return false;
+	}
+
+	Point3 segment_a[2], segment_b[2];
+	if (TrianglePlaneSegment(a, distance_a, segment_a) == 0 ||
+			TrianglePlaneSegment(b, distance_b, segment_b) == 0) {
+		return false;
+	}
+
+	double ta[2] = { line.dot(segment_a[0] - a.vertices[0]), line.dot(segment_a[1] - a.vertices[0]) };
+	double tb[2] = { line.dot(segment_b[0] - a.vertices[0]), line.dot(segment_b[1] - a.vertices[0]) };
+	if (ta[0] > ta[1]) {
+		std::swap(ta[0], ta[1]);
+		std::swap(segment_a[0], segment_a[1]);
+	}
+	if (tb[0] > tb[1]) {
+		std::swap(tb[0], tb[1]);
+		std::swap(segment_b[0], segment_b[1]);
+	}
+	if (ta[1] < tb[0] || tb[1] < ta[0]) {
+		return false;
+	}
+
+	*p0 = ta[0] > tb[0] ? segment_a[0] : segment_b[0];
+	*p1 = ta[1] < tb[1] ? segment_a[1] : segment_b[1];
+	return true;
+}
+
+/**
+ * Narrowphase between two bodies, descending both hierarchies together in the
+ * object space of |a| and testing the triangles of overlapping leaves. Appends
+ * at most COLLISION_MAX_CONTACTS contacts, placed at the midpoint of each
+ * intersection segment, and returns the number appended.
+ */
+inline
+unsigned int CollideBodies(const Instance &a, const Instance &b, unsigned int body_a, unsigned int body_b,
+		std::vector<Contact> *contacts) {
+	const MeshGeometry &geometry_a = *a.geometry;
+	const MeshGeometry &geometry_b = *b.geometry;
+	if (geometry_a.bvh.nodes.empty() || geometry_b.bvh.nodes.empty()) {
+		return 0;
+	}
+
+	Matrix4x4 b_to_a = a.inv_transform * b.transform;
+	Matrix4x4 normal_transform = a.inv_transform.transpose();
+	unsigned int contact_count = 0;
+
+	std::pair<unsigned int, unsigned int> stack[2 * BVH_STACK_SIZE];
+	unsigned int stack_size = 0;
+	stack[stack_size++] = std::make_pair(0u, 0u);
+	while (stack_size > 0 && contact_count < COLLISION_MAX_CONTACTS) {
+		std::pair<unsigned int, unsigned int> top = stack[--stack_size];
+		const BVHNode &node_a = geometry_a.bvh.nodes[top.first];
+		const BVHNode &node_b = geometry_b.bvh.nodes[top.second];
+		if (!BoundsOverlap(node_a.bounds, TransformBoundsAffine(b_to_a, node_b.bounds))) {
+			continue;
+		}
+
+		if (node_a.leaf() && node_b.leaf()) {
+			for (unsigned int j = node_b.offset; j < node_b.offset + node_b.count; ++j) {
+				const Triangle &source = geometry_b.triangles[geometry_b.bvh.indices[j]];
+				Triangle triangle_b;
+				for (int k = 0; k < 3; ++k) {
+					triangle_b.vertices[k] = b_to_a * source.vertices[k];
+				}
+				BoundingBox bounds_b = PrimitiveBounds(triangle_b);
+				for (unsigned int i = node_a.offset; i < node_a.offset + node_a.count; ++i) {
+					const Triangle &triangle_a = geometry_a.triangles[geometry_a.bvh.indices[i]];
+					Point3 p0, p1;
+					if (!BoundsOverlap(PrimitiveBounds(triangle_a), bounds_b) ||
+							!TriangleTriangleIntersect(triangle_a, triangle_b, &p0, &p1)) {
+						continue;
+					}
+					Contact contact;
+					contact.body_a = body_a;
+					contact.body_b = body_b;
+					contact.pos = a.transform * (p0 + 0.5 * (p1 - p0));
+					contact.normal = normal_transform * (triangle_a.vertices[1] - triangle_a.vertices[0]).cross(
+						triangle_a.vertices[2] - triangle_a.vertices[0]);
+					contact.normal.normalize();
+					contacts->push_back(contact);
+					if (++contact_count == COLLISION_MAX_CONTACTS) {
+						return contact_count;
+					}
+				}
+			}
+			continue;
+		}
+
+		// Descend the larger node so both sides shrink at a similar rate
+		if (node_b.leaf() || (!node_a.leaf() && node_a.bounds.area() >= node_b.bounds.area())) {
+			stack[stack_size++] = std::make_pair(node_a.offset + 1, top.second);
+			stack[stack_size++] = std::make_pair(node_a.offset, top.second);
+		} else {
+			stack[stack_size++] = std::make_pair(top.first, node_b.offset + 1);
+			stack[stack_size++] = std::make_pair(top.first, node_b.offset);
+		}
+	}
+	return contact_count;
+}
+
+/**
+ * Find the contacts between every pair of |bodies|, the broadphase prunes the
+ * pairs and the overlapping ones are tested in parallel. Contacts are grouped
+ * by body pair in broadphase order.
+ */
+inline
+void CollideBodies(const std::vector<Instance> &bodies, CollisionBroadphase *broadphase,
+		std::vector<Contact> *contacts) {
+	std::vector<std::pair<unsigned int, unsigned int> > pairs;
+	UpdateCollisionBroadphase(bodies, broadphase, &pairs);
+
+	std::vector<std::vector<Contact> > pair_contacts(pairs.size());
+	ParallelFor(0, pairs.size(), [&](unsigned int i) {
+		unsigned int a = pairs[i].first;
+		unsigned int b = pairs[i].second;
+		CollideBodies(bodies[a], bodies[b], a, b, &pair_contacts[i]);
+	});
+
+	contacts->clear();
+	for (const std::vector<Contact> &pair : pair_contacts) {
+		contacts->insert(contacts->end(), pair.begin(), pair.end());
+	}
+}
+
+#endif
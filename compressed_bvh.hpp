@@ -0,0 +1,317 @@
+/*
+* Copyright (c) 2015 Owen Glofcheski
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+*    1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+*    2. Altered source versions must be plainly marked as such, and must not
+*    be misrepresented as being the original software.
+*
+*    3. This notice may not be removed or altered from any source
+*    distribution.
+*/
+
+
+#ifndef _COMPRESSED_BVH_HPP_
+#define _COMPRESSED_BVH_HPP_
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <limits>
+
+#include "bvh.hpp"
+#include "stats.hpp"
+
+#define COMPRESSED_BVH_WIDTH 4
+#define COMPRESSED_BVH_STACK_SIZE (BVH_STACK_SIZE * (COMPRESSED_BVH_WIDTH - 1))
+#define COMPRESSED_BVH_MAX_LEAF_SIZE 255 // Largest count CompressedBVHNode::leaf_count holds
+
+/**
+ * 4-wide node in a single cache line. Child bounds are stored as 8 bit offsets on a grid
+ * anchored at |origin| with a power of two cell size per axis, rounded outwards so the
+ * decoded boxes always contain the exact ones. Interior children are stored contiguously
+ * from |child_base| and the indices of leaf children from |index_base|, both in child order.
+ */
+struct alignas(64) CompressedBVHNode
+{
+	float origin[3];
+	signed char exponent[3];
+	unsigned char child_count;
+	unsigned char lo[3][COMPRESSED_BVH_WIDTH];
+	unsigned char hi[3][COMPRESSED_BVH_WIDTH];
+	unsigned char leaf_count[COMPRESSED_BVH_WIDTH]; // Primitives in a leaf child, 0 for interior children
+	unsigned int child_base;
+	unsigned int index_base;
+};
+
+static_assert(COMPRESSED_BVH_MAX_LEAF_SIZE <= std::numeric_limits<unsigned char>::max(),
+	"leaf_count must hold the largest leaf");
+
+/** Quantized wide BVH collapsed from a binary one, indices refer to the same primitives. */
+struct CompressedBVH
+{
+	Buffer<CompressedBVHNode> nodes;
+	Buffer<unsigned int> indices;
+};
+
+inline
+float ExponentScale(int exponent) {
+	// Exact 2^exponent for normal floats
+	unsigned int bits = static_cast<unsigned int>(exponent + 127) << 23;
+	float scale;
+	memcpy(&scale, &bits, sizeof(scale));
+	return scale;
+}
+
+inline
+void CompressBVHNode(const BVH &bvh, const unsigned int *children, unsigned int child_count,
+		unsigned int compressed_index, CompressedBVH *compressed) {
+	BoundingBox bounds;
+	for (unsigned int i = 0; i < child_count; ++i) {
+		bounds.extend(bvh.nodes[children[i]].bounds);
+	}
+
+	CompressedBVHNode node;
+	memset(&node, 0, sizeof(node));
+	node.child_count = child_count;
+	double origin[3];
+	double scale[3];
+	for (int axis = 0; axis < 3; ++axis) {
+		float base = static_cast<float>(bounds.min[axis]);
+		if (base > bounds.min[axis]) {
+			base = std::nextafter(base, -std::numeric_limits<float>::max());
+		}
+		double extent = bounds.max[axis] - base;
+		int exponent = extent > 0 ? static_cast<int>(std::ceil(std::log2(extent / 255))) : -126;
+		exponent = std::max(exponent, -126);
+		while (base + 255 * static_cast<double>(ExponentScale(exponent)) < bounds.max[axis]) {
+			++exponent;
+		}
+		node.origin[axis] = base;
+		node.exponent[axis] = exponent;
+		origin[axis] = base;
+		scale[axis] = ExponentScale(exponent);
+	}
+
+	unsigned int interior_count = 0;
+	unsigned int index_base = compressed->indices.size();
+	for (unsigned int i = 0; i < child_count; ++i) {
+		const BVHNode &child = bvh.nodes[children[i]];
+		for (int axis = 0; axis < 3; ++axis) {
+			double lo = std::floor((child.bounds.min[axis] - origin[axis]) / scale[axis]);
+			double hi = std::ceil((child.bounds.max[axis] - origin[axis]) / scale[axis]);
+			node.lo[axis][i] = static_cast<unsigned char>(std::min(std::max(lo, 0.0), 255.0));
+			node.hi[axis][i] = static_cast<unsigned char>(std::min(std::max(hi, 0.0), 255.0));
+		}
+		if (child.leaf()) {
+			node.leaf_count[i] = child.count;
+			for (unsigned int j = child.offset; j < child.offset + child.count; ++j) {
+				compressed->indices.push_back(bvh.indices[j]);
+			}
+		} else {
+			++interior_count;
+		}
+	}
+
+	node.child_base = compressed->nodes.size();
+	node.index_base = index_base;
+	compressed->nodes.resize(compressed->nodes.size() + interior_count);
+	compressed->nodes[compressed_index] = node;
+
+	unsigned int child_index = node.child_base;
+	for (unsigned int i = 0; i < child_count; ++i) {
+		const BVHNode &child = bvh.nodes[children[i]];
+		if (!child.leaf()) {
+			unsigned int grandchildren[COMPRESSED_BVH_WIDTH];
+			unsigned int grandchild_count = GatherBVHChildren(bvh, children[i], COMPRESSED_BVH_WIDTH, grandchildren);
+			CompressBVHNode(bvh, grandchildren, grandchild_count, child_index++, compressed);
+		}
+	}
+}
+
+/**
+ * Collapse and quantize a built |bvh|, the nodes take under a third of the memory of
+ * the binary ones. Fails, leaving |compressed| empty, if a leaf holds more than
+ * COMPRESSED_BVH_MAX_LEAF_SIZE primitives.
+ */
+inline
+bool BuildCompressedBVH(const BVH &bvh, CompressedBVH *compressed) {
+	compressed->nodes.clear();
+	compressed->indices.clear();
+	for (const BVHNode &node : bvh.nodes) {
+		if (node.leaf() && node.count > COMPRESSED_BVH_MAX_LEAF_SIZE) {
+			return false;
+		}
+	}
+	if (bvh.nodes.empty()) {
+		return true;
+	}
+
+	compressed->nodes.reserve(bvh.nodes.size() / 2 + 1);
+	compressed->indices.reserve(bvh.indices.size());
+	compressed->nodes.resize(1);
+	unsigned int children[COMPRESSED_BVH_WIDTH];
+	unsigned int child_count = 1;
+	children[0] = 0;
+	if (!bvh.nodes[0].leaf()) {
+		child_count = GatherBVHChildren(bvh, 0, COMPRESSED_BVH_WIDTH, children);
+	}
+	CompressBVHNode(bvh, children, child_count, 0, compressed);
+	return true;
+}
+
+struct CompressedBVHEntry
+{
+	unsigned int node;
+	float tnear;
+};
+
+/**
+ * Closest hit traversal decoding child bounds on the fly, calls leaf(offset, count) for the
+ * runs of compressed->indices the ray reaches, nearer children first. As for BVHTraverse
+ * leaf returns whether it found a hit and shrinks *tmax to it when it does.
+ */
+template <typename LeafFunc>
+bool CompressedBVHTraverse(const CompressedBVH &bvh, const Ray &ray, double *tmax, const LeafFunc &leaf) {
+	if (bvh.nodes.empty()) {
+		return false;
+	}
+
+	float origin[3];
+	float inv_dir[3];
+	for (int axis = 0; axis < 3; ++axis) {
+		origin[axis] = static_cast<float>(ray.origin[axis]);
+		inv_dir[axis] = static_cast<float>(1.0 / ray.dir[axis]);
+	}
+
+	bool has_intersection = false;
+	CompressedBVHEntry stack[COMPRESSED_BVH_STACK_SIZE];
+	unsigned int stack_size = 0;
+	stack[stack_size].node = 0;
+	stack[stack_size++].tnear = 0;
+	while (stack_size > 0) {
+		CompressedBVHEntry entry = stack[--stack_size];
+		if (entry.tnear > *tmax) {
+			continue;
+		}
+		const CompressedBVHNode &node = bvh.nodes[entry.node];
+		STAT_INC(STAT_NODE_VISITS);
+
+		// Widen the far distance slightly so float rounding never culls a box the ray grazes
+		float tfar = static_cast<float>(std::min(*tmax, static_cast<double>(std::numeric_limits<float>::max()))) * 1.0000004f;
+		float lower[3];
+		float scale[3];
+		for (int axis = 0; axis < 3; ++axis) {
+			scale[axis] = ExponentScale(node.exponent[axis]);
+			lower[axis] = (node.origin[axis] - origin[axis]) * inv_dir[axis];
+			scale[axis] *= inv_dir[axis];
+		}
+
+		CompressedBVHEntry hits[COMPRESSED_BVH_WIDTH];
+		unsigned int leaf_offsets[COMPRESSED_BVH_WIDTH];
+		unsigned int hit_count = 0;
+		unsigned int child_index = node.child_base;
+		unsigned int index_offset = node.index_base;
+		for (unsigned int i = 0; i < node.child_count; ++i) {
+			float t0 = 0;
+			float t1 = tfar;
+			for (int axis = 0; axis < 3; ++axis) {
+				float near_t = lower[axis] + node.lo[axis][i] * scale[axis];
+				float far_t = lower[axis] + node.hi[axis][i] * scale[axis];
+				if (near_t > far_t) {
+					std::swap(near_t, far_t);
+				}
+				t0 = near_t > t0 ? near_t : t0;
+				t1 = far_t < t1 ? far_t : t1;
+			}
+			if (t0 <= t1) {
+				// Insertion sort, there are at most COMPRESSED_BVH_WIDTH hits
+				unsigned int j = hit_count++;
+				for (; j > 0 && hits[j - 1].tnear > t0; --j) {
+					hits[j] = hits[j - 1];
+					leaf_offsets[j] = leaf_offsets[j - 1];
+				}
+				hits[j].tnear = t0;
+				hits[j].node = node.leaf_count[i] > 0 ? i : child_index;
+				leaf_offsets[j] = node.leaf_count[i] > 0 ? index_offset : std::numeric_limits<unsigned int>::max();
+			}
+			if (node.leaf_count[i] > 0) {
+				index_offset += node.leaf_count[i];
+			} else {
+				++child_index;
+			}
+		}
+
+		// Leaves are intersected now, nearest first, so interior children can be culled on pop
+		for (unsigned int j = 0; j < hit_count; ++j) {
+			if (leaf_offsets[j] != std::numeric_limits<unsigned int>::max() && hits[j].tnear <= *tmax) {
+				STAT_INC(STAT_LEAF_VISITS);
+				if (leaf(leaf_offsets[j], node.leaf_count[hits[j].node])) {
+					has_intersection = true;
+				}
+			}
+		}
+		for (unsigned int j = hit_count; j > 0; --j) {
+			if (leaf_offsets[j - 1] == std::numeric_limits<unsigned int>::max()) {
+				stack[stack_size++] = hits[j - 1];
+			}
+		}
+		STAT_MAX(STAT_MAX_TRAVERSAL_DEPTH, stack_size);
+	}
+	return has_intersection;
+}
+
+/** Any hit traversal, stops as soon as leaf(offset, count) reports a hit in (EPSILON, tmax). */
+template <typename LeafFunc>
+bool CompressedBVHTraverseAny(const CompressedBVH &bvh, const Ray &ray, double tmax, const LeafFunc &leaf) {
+	double t = tmax;
+	bool found = false;
+	CompressedBVHTraverse(bvh, ray, &t, [&](unsigned int offset, unsigned int count) {
+		if (!found && leaf(offset, count)) {
+			found = true;
+			t = -1; // Culls everything left on the stack
+		}
+		return false;
+	});
+	return found;
+}
+
+template <typename Primitives>
+bool CompressedBVHIntersect(const CompressedBVH &bvh, const Primitives &primitives, const Ray &ray,
+		Intersection *intersection) {
+	return CompressedBVHTraverse(bvh, ray, &intersection->t, [&](unsigned int offset, unsigned int count) {
+		bool has_intersection = false;
+		for (unsigned int i = offset; i < offset + count; ++i) {
+			if (PrimitiveIntersect(primitives[bvh.indices[i]], ray, intersection)) {
+				has_intersection = true;
+			}
+		}
+		return has_intersection;
+	});
+}
+
+template <typename Primitives>
+bool CompressedBVHOccluded(const CompressedBVH &bvh, const Primitives &primitives, const Ray &ray, double tmax) {
+	return CompressedBVHTraverseAny(bvh, ray, tmax, [&](unsigned int offset, unsigned int count) {
+		for (unsigned int i = offset; i < offset + count; ++i) {
+			if (PrimitiveOccluded(primitives[bvh.indices[i]], ray, tmax)) {
+				return true;
+			}
+		}
+		return false;
+	});
+}
+
+#endif
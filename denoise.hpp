@@ -0,0 +1,342 @@
+/*
+* Copyright (c) 2015 Owen Glofcheski
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+*    1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+*    2. Altered source versions must be plainly marked as such, and must not
+*    be misrepresented as being the original software.
+*
+*    3. This notice may not be removed or altered from any source
+*    distribution.
+*/
+
+
+#ifndef _DENOISE_HPP_
+#define _DENOISE_HPP_
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "algebra.hpp"
+#include "camera.hpp"
+#include "image.hpp"
+#include "parallel.hpp"
+#include "primitive.hpp"
+#include "scene.hpp"
+
+#define DENOISE_TILE_WIDTH 64
+#define DENOISE_TILE_HEIGHT 16
+#define DENOISE_ALBEDO_EPSILON 0.01f // Keeps demodulation invertible where there is no albedo
+
+struct DenoiseSettings
+{
+	DenoiseSettings()
+		: levels(5), sigma_colour(1.0f), sigma_normal(0.3f), sigma_depth(0.1f), sigma_albedo(0.1f) {}
+
+	unsigned int levels; // Filter passes, the tap spacing doubles each pass
+	float sigma_colour; // Halved each pass as the noise is filtered out
+	float sigma_normal;
+	float sigma_depth; // On the relative depth difference, scaled by the tap spacing
+	float sigma_albedo;
+};
+
+/**
+ * Guide buffers and working storage for DenoiseImage, all planar so the filter
+ * runs along rows. Kept between frames so filtering doesn't allocate.
+ */
+struct Denoiser
+{
+	Size size;
+	std::vector<float> normal[3];
+	std::vector<float> depth;
+	std::vector<float> albedo[3];
+	std::vector<float> colour[2][3]; // Ping-pong between passes
+};
+
+inline
+void ResizeDenoiser(const Size &size, Denoiser *denoiser) {
+	denoiser->size = size;
+	unsigned int pixel_count = size.area();
+	for (int c = 0; c < 3; ++c) {
+		denoiser->normal[c].resize(pixel_count);
+		denoiser->albedo[c].resize(pixel_count);
+		denoiser->colour[0][c].resize(pixel_count);
+		denoiser->colour[1][c].resize(pixel_count);
+	}
+	denoiser->depth.resize(pixel_count);
+}
+
+/**
+ * Fill the guides from the primary hit through each pixel centre. Pixels that
+ * see nothing get a zero normal and albedo and an infinite depth so they only
+ * blend with each other.
+ */
+inline
+void RenderDenoiseGuides(const Scene &scene, const Camera &camera, const Size &size, Denoiser *denoiser) {
+	ResizeDenoiser(size, denoiser);
+	ParallelFor(0, size.y, [&](unsigned int y) {
+		for (int x = 0; x < size.x; ++x) {
+			unsigned int i = y * size.x + x;
+			Intersection intersection;
+			intersection.t = std::numeric_limits<double>::max();
+			if (!SceneIntersect(scene, CameraRay(camera, size, x + 0.5, y + 0.5), &intersection)) {
+				for (int c = 0; c < 3; ++c) {
+					denoiser->normal[c][i] = 0;
+					denoiser->albedo[c][i] = 0;
+				}
+				denoiser->depth[i] = std::numeric_limits<float>::max();
+				continue;
+			}
+			for (int c = 0; c < 3; ++c) {
+				denoiser->normal[c][i] = intersection.normal[c];
+				denoiser->albedo[c][i] = intersection.material.diffuse[c];
+			}
+			denoiser->depth[i] = intersection.t;
+		}
+	});
+}
+
+/** e^x for x <= 0 to about 1e-4 relative, the same arithmetic as the vector version. */
+inline
+float DenoiseExp(float x) {
+	float t = std::max(x * 1.44269504f, -126.0f);
+	float whole = floor(t);
+	float f = t - whole;
+	float p = 1 + f * (0.693147f + f * (0.240227f + f * (0.0555041f + f * (0.00961813f + f * 0.00133336f))));
+	int32_t bits = (static_cast<int32_t>(whole) + 127) << 23;
+	float scale;
+	memcpy(&scale, &bits, sizeof(scale));
+	return p * scale;
+}
+
+#if defined(__AVX2__)
+inline
+__m256 DenoiseExp(__m256 x) {
+	__m256 t = _mm256_max_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504f)), _mm256_set1_ps(-126.0f));
+	__m256 whole = _mm256_floor_ps(t);
+	__m256 f = _mm256_sub_ps(t, whole);
+	__m256 p = _mm256_set1_ps(0.00133336f);
+	p = _mm256_add_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(0.00961813f));
+	p = _mm256_add_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(0.0555041f));
+	p = _mm256_add_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(0.240227f));
+	p = _mm256_add_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(0.693147f));
+	p = _mm256_add_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(1.0f));
+	__m256i bits = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvttps_epi32(whole), _mm256_set1_epi32(127)), 23);
+	return _mm256_mul_ps(p, _mm256_castsi256_ps(bits));
+}
+#endif
+
+/** Per pass constants, the reciprocal squared sigmas. */
+struct DenoisePass
+{
+	int step;
+	float inv_colour;
+	float inv_normal;
+	float inv_depth;
+	float inv_albedo;
+	const float *in[3];
+	float *out[3];
+};
+
+static const float kDenoiseKernel[5] = { 1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16 }; // B3 spline
+
+/** Filter the pixel at |x|, |y| over the 5x5 taps, skipping taps outside the image. */
+inline
+void DenoisePixel(const Denoiser &denoiser, const DenoisePass &pass, int x, int y) {
+	const Size &size = denoiser.size;
+	unsigned int p = y * size.x + x;
+
+	float sum[3] = { 0, 0, 0 };
+	float weight_sum = 0;
+	for (int ky = -2; ky <= 2; ++ky) {
+		int qy = y + ky * pass.step;
+		if (qy < 0 || qy >= size.y) {
+			continue;
+		}
+		for (int kx = -2; kx <= 2; ++kx) {
+			int qx = x + kx * pass.step;
+			if (qx < 0 || qx >= size.x) {
+				continue;
+			}
+			unsigned int q = qy * size.x + qx;
+			float colour = 0, normal = 0, albedo = 0;
+			for (int c = 0; c < 3; ++c) {
+				float dc = pass.in[c][q] - pass.in[c][p];
+				float dn = denoiser.normal[c][q] - denoiser.normal[c][p];
+				float da = denoiser.albedo[c][q] - denoiser.albedo[c][p];
+				colour += dc * dc;
+				normal += dn * dn;
+				albedo += da * da;
+			}
+			// Relative so it's independent of scale, and bounded against the infinite depth of misses
+			float depth = (denoiser.depth[q] - denoiser.depth[p]) /
+				std::max(std::max(denoiser.depth[q], denoiser.depth[p]), 1e-12f);
+			float exponent = colour * pass.inv_colour + normal * pass.inv_normal +
+				depth * depth * pass.inv_depth + albedo * pass.inv_albedo;
+			float weight = kDenoiseKernel[kx + 2] * kDenoiseKernel[ky + 2] * DenoiseExp(-exponent);
+			for (int c = 0; c < 3; ++c) {
+				sum[c] += weight * pass.in[c][q];
+			}
+			weight_sum += weight;
+		}
+	}
+	for (int c = 0; c < 3; ++c) {
+		pass.out[c][p] = sum[c] / weight_sum;
+	}
+}
+
+#if defined(__AVX2__)
+/** DenoisePixel for the 8 pixels from |x|, every horizontal tap must be inside the image. */
+inline
+void DenoisePixels8(const Denoiser &denoiser, const DenoisePass &pass, int x, int y) {
+	const Size &size = denoiser.size;
+	unsigned int p = y * size.x + x;
+	__m256 centre_colour[3], centre_normal[3], centre_albedo[3];
+	for (int c = 0; c < 3; ++c) {
+		centre_colour[c] = _mm256_loadu_ps(&pass.in[c][p]);
+		centre_normal[c] = _mm256_loadu_ps(&denoiser.normal[c][p]);
+		centre_albedo[c] = _mm256_loadu_ps(&denoiser.albedo[c][p]);
+	}
+	__m256 centre_depth = _mm256_loadu_ps(&denoiser.depth[p]);
+
+	__m256 sum[3] = { _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps() };
+	__m256 weight_sum = _mm256_setzero_ps();
+	for (int ky = -2; ky <= 2; ++ky) {
+		int qy = y + ky * pass.step;
+		if (qy < 0 || qy >= size.y) {
+			continue;
+		}
+		for (int kx = -2; kx <= 2; ++kx) {
+			unsigned int q = qy * size.x + x + kx * pass.step;
+			__m256 colour = _mm256_setzero_ps();
+			__m256 normal = _mm256_setzero_ps();
+			__m256 albedo = _mm256_setzero_ps();
+			__m256 tap[3];
+			for (int c = 0; c < 3; ++c) {
+				tap[c] = _mm256_loadu_ps(&pass.in[c][q]);
+				__m256 dc = _mm256_sub_ps(tap[c], centre_colour[c]);
+				__m256 dn = _mm256_sub_ps(_mm256_loadu_ps(&denoiser.normal[c][q]), centre_normal[c]);
+				__m256 da = _mm256_sub_ps(_mm256_loadu_ps(&denoiser.albedo[c][q]), centre_albedo[c]);
+				colour = _mm256_add_ps(colour, _mm256_mul_ps(dc, dc));
+				normal = _mm256_add_ps(normal, _mm256_mul_ps(dn, dn));
+				albedo = _mm256_add_ps(albedo, _mm256_mul_ps(da, da));
+			}
+			__m256 tap_depth = _mm256_loadu_ps(&denoiser.depth[q]);
+			__m256 depth = _mm256_div_ps(_mm256_sub_ps(tap_depth, centre_depth),
+				_mm256_max_ps(_mm256_max_ps(tap_depth, centre_depth), _mm256_set1_ps(1e-12f)));
+			__m256 exponent = _mm256_add_ps(
+				_mm256_add_ps(_mm256_mul_ps(colour, _mm256_set1_ps(pass.inv_colour)),
+					_mm256_mul_ps(normal, _mm256_set1_ps(pass.inv_normal))),
+				_mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(depth, depth), _mm256_set1_ps(pass.inv_depth)),
+					_mm256_mul_ps(albedo, _mm256_set1_ps(pass.inv_albedo))));
+			__m256 weight = _mm256_mul_ps(_mm256_set1_ps(kDenoiseKernel[kx + 2] * kDenoiseKernel[ky + 2]),
+				DenoiseExp(_mm256_sub_ps(_mm256_setzero_ps(), exponent)));
+			for (int c = 0; c < 3; ++c) {
+				sum[c] = _mm256_add_ps(sum[c], _mm256_mul_ps(weight, tap[c]));
+			}
+			weight_sum = _mm256_add_ps(weight_sum, weight);
+		}
+	}
+	for (int c = 0; c < 3; ++c) {
+		_mm256_storeu_ps(&pass.out[c][p], _mm256_div_ps(sum[c], weight_sum));
+	}
+}
+#endif
+
+inline
+void DenoiseTile(const Denoiser &denoiser, const DenoisePass &pass, int x0, int y0, int x1, int y1) {
+	int reach = 2 * pass.step;
+	for (int y = y0; y < y1; ++y) {
+		int x = x0;
+#if defined(__AVX2__)
+		// Vectors only where all of their horizontal taps are inside the image
+		int vector_begin = std::min(std::max(x0, reach), x1);
+		int vector_end = std::max(vector_begin, std::min(x1, denoiser.size.x - reach));
+		for (; x < vector_begin; ++x) {
+			DenoisePixel(denoiser, pass, x, y);
+		}
+		for (; x + 8 <= vector_end; x += 8) {
+			DenoisePixels8(denoiser, pass, x, y);
+		}
+#endif
+		for (; x < x1; ++x) {
+			DenoisePixel(denoiser, pass, x, y);
+		}
+	}
+}
+
+/**
+ * Edge avoiding a-trous wavelet filter (Dammertz et al. 2010) of |image| in place,
+ * guided by the normal, depth and albedo in |denoiser| which must match its size.
+ * The colour is divided by the albedo so texture isn't blurred, filtered over
+ * settings.levels passes of a 5x5 B3 spline with the taps spaced 1, 2, 4... pixels
+ * apart, and multiplied back. Passes ping-pong between the denoiser's buffers and
+ * run in parallel over tiles.
+ */
+inline
+void DenoiseImage(const DenoiseSettings &settings, Denoiser *denoiser, Image *image) {
+	const Size &size = denoiser->size;
+	assert(image->size.x == size.x && image->size.y == size.y && image->channels >= 3);
+	unsigned int pixel_count = size.area();
+	for (unsigned int i = 0; i < pixel_count; ++i) {
+		for (int c = 0; c < 3; ++c) {
+			denoiser->colour[0][c][i] = image->data[i * image->channels + c] /
+				(denoiser->albedo[c][i] + DENOISE_ALBEDO_EPSILON);
+		}
+	}
+
+	int tiles_x = (size.x + DENOISE_TILE_WIDTH - 1) / DENOISE_TILE_WIDTH;
+	int tiles_y = (size.y + DENOISE_TILE_HEIGHT - 1) / DENOISE_TILE_HEIGHT;
+	unsigned int source = 0;
+	float sigma_colour = settings.sigma_colour;
+	for (unsigned int level = 0; level < settings.levels; ++level) {
+		DenoisePass pass;
+		pass.step = 1 << level;
+		pass.inv_colour = 1 / (sigma_colour * sigma_colour);
+		pass.inv_normal = 1 / (settings.sigma_normal * settings.sigma_normal);
+		pass.inv_depth = 1 / (settings.sigma_depth * settings.sigma_depth * pass.step * pass.step);
+		pass.inv_albedo = 1 / (settings.sigma_albedo * settings.sigma_albedo);
+		for (int c = 0; c < 3; ++c) {
+			pass.in[c] = &denoiser->colour[source][c][0];
+			pass.out[c] = &denoiser->colour[1 - source][c][0];
+		}
+
+		ParallelFor(0, tiles_x * tiles_y, [&](unsigned int tile) {
+			int x0 = (tile % tiles_x) * DENOISE_TILE_WIDTH;
+			int y0 = (tile / tiles_x) * DENOISE_TILE_HEIGHT;
+			DenoiseTile(*denoiser, pass, x0, y0,
+				std::min(x0 + DENOISE_TILE_WIDTH, size.x), std::min(y0 + DENOISE_TILE_HEIGHT, size.y));
+		});
+		source = 1 - source;
+		sigma_colour *= 0.5f;
+	}
+
+	for (unsigned int i = 0; i < pixel_count; ++i) {
+		for (int c = 0; c < 3; ++c) {
+			image->data[i * image->channels + c] = denoiser->colour[source][c][i] *
+				(denoiser->albedo[c][i] + DENOISE_ALBEDO_EPSILON);
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,335 @@
+/*
+* Copyright (c) 2015 Owen Glofcheski
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+*    1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+*    2. Altered source versions must be plainly marked as such, and must not
+*    be misrepresented as being the original software.
+*
+*    3. This notice may not be removed or altered from any source
+*    distribution.
+*/
+
+
+#ifndef _DISTANCE_HPP_
+#define _DISTANCE_HPP_
+
+#include <algorithm>
+#include <iostream>
+#include <limits>
+#include <unordered_map>
+#include <vector>
+
+#include "algebra.hpp"
+#include "bvh.hpp"
+#include "parallel.hpp"
+#include "primitive.hpp"
+#include "triangulate.hpp"
+
+#define DISTANCE_BATCH_SIZE 64 // Query points per parallel task
+
+/** Which part of a triangle a closest point lies on, also the index into its pseudo-normals. */
+enum TriangleFeature
+{
+	FEATURE_VERTEX_0,
+	FEATURE_VERTEX_1,
+	FEATURE_VERTEX_2,
+	FEATURE_EDGE_01,
+	FEATURE_EDGE_12,
+	FEATURE_EDGE_20,
+	FEATURE_FACE,
+	FEATURE_COUNT
+};
+
+/** Closest point to |p| on |triangle| by Voronoi region, see Ericson's Real-Time Collision Detection 5.1.5. */
+inline
+Point3 ClosestPointOnTriangle(const Triangle &triangle, const Point3 &p, TriangleFeature *feature) {
+	const Point3 &a = triangle.vertices[0];
+	const Point3 &b = triangle.vertices[1];
+	const Point3 &c = triangle.vertices[2];
+	Vector3 ab = b - a;
+	Vector3 ac = c - a;
+
+	Vector3 ap = p - a;
+	double d1 = ab.dot(ap);
+	double d2 = ac.dot(ap);
+	if (d1 <= 0 && d2 <= 0) {
+		*feature = FEATURE_VERTEX_0;
+		return a;
+	}
+
+	Vector3 bp = p - b;
+	double d3 = ab.dot(bp);
+	double d4 = ac.dot(bp);
+	if (d3 >= 0 && d4 <= d3) {
+		*feature = FEATURE_VERTEX_1;
+		return b;
+	}
+
+	double vc = d1 * d4 - d3 * d2;
+	if (vc <= 0 && d1 >= 0 && d3 <= 0) {
+		*feature = FEATURE_EDGE_01;
+		return a + (d1 / (d1 - d3)) * ab;
+	}
+
+	Vector3 cp = p - c;
+	double d5 = ab.dot(cp);
+	double d6 = ac.dot(cp);
+	if (d6 >= 0 && d5 <= d6) {
+		*feature = FEATURE_VERTEX_2;
+		return c;
+	}
+
+	double vb = d5 * d2 - d1 * d6;
+	if (vb <= 0 && d2 >= 0 && d6 <= 0) {
+		*feature = FEATURE_EDGE_20;
+		return a + (d2 / (d2 - d6)) * ac;
+	}
+
+	double va = d3 * d6 - d5 * d4;
+	if (va <= 0 && (d4 - d3) >= 0 && (d5 - d6) >= 0) {
+		*feature = FEATURE_EDGE_12;
+		return b + ((d4 - d3) / ((d4 - d3) + (d5 - d6))) * (c - b);
+	}
+
+	double denom = 1 / (va + vb + vc);
+	*feature = FEATURE_FACE;
+	return a + (vb * denom) * ab + (vc * denom) * ac;
+}
+
+inline
+double BoxDistance2(const BoundingBox &box, const Point3 &p) {
+	double distance2 = 0;
+	for (int i = 0; i < 3; ++i) {
+		double d = std::max(std::max(box.min[i] - p[i], p[i] - box.max[i]), 0.0);
+		distance2 += d * d;
+	}
+	return distance2;
+}
+
+struct SurfacePoint
+{
+	SurfacePoint() : distance2(std::numeric_limits<double>::max()),
+		triangle(std::numeric_limits<unsigned int>::max()), feature(FEATURE_FACE) {}
+
+	Point3 pos;
+	double distance2;
+	unsigned int triangle;
+	TriangleFeature feature;
+};
+
+/**
+ * Branch and bound nearest point on |triangles| to |p|, nearer children are
+ * visited first and subtrees further than the best so far are skipped.
+ * Only surface within sqrt(nearest->distance2) is considered, so seeding it with
+ * a known upper bound prunes more. Returns whether a closer point was found.
+ * Not counted in the node and leaf statistics, those describe rays.
+ */
+template <typename Triangles>
+bool BVHNearestSurface(const BVH &bvh, const Triangles &triangles, const Point3 &p, SurfacePoint *nearest) {
+	if (bvh.nodes.empty() || BoxDistance2(bvh.nodes[0].bounds, p) >= nearest->distance2) {
+		return false;
+	}
+
+	bool found = false;
+	unsigned int stack[BVH_STACK_SIZE];
+	unsigned int stack_size = 0;
+	unsigned int node_index = 0;
+	while (true) {
+		const BVHNode &node = bvh.nodes[node_index];
+		if (node.leaf()) {
+			for (unsigned int i = node.offset; i < node.offset + node.count; ++i) {
+				unsigned int index = bvh.indices[i];
+				TriangleFeature feature;
+				Point3 closest = ClosestPointOnTriangle(triangles[index], p, &feature);
+				Vector3 offset = p - closest;
+				double distance2 = offset.dot(offset);
+				if (distance2 < nearest->distance2) {
+					nearest->pos = closest;
+					nearest->distance2 = distance2;
+					nearest->triangle = index;
+					nearest->feature = feature;
+					found = true;
+				}
+			}
+		} else {
+			double d_left = BoxDistance2(bvh.nodes[node.offset].bounds, p);
+			double d_right = BoxDistance2(bvh.nodes[node.offset + 1].bounds, p);
+			bool left_first = d_left <= d_right;
+			double d_near = left_first ? d_left : d_right;
+			double d_far = left_first ? d_right : d_left;
+			if (d_near < nearest->distance2) {
+				if (d_far < nearest->distance2) {
+					stack[stack_size++] = left_first ? node.offset + 1 : node.offset;
+				}
+				node_index = left_first ? node.offset : node.offset + 1;
+				continue;
+			}
+		}
+
+		// Entries pushed before the bound shrank may now be out of reach
+		do {
+			if (stack_size == 0) {
+				return found;
+			}
+			node_index = stack[--stack_size];
+		} while (BoxDistance2(bvh.nodes[node_index].bounds, p) >= nearest->distance2);
+	}
+}
+
+/**
+ * Triangles with their hierarchy and the angle weighted pseudo-normals of every
+ * vertex, edge and face, which give the sign of the distance to a closed,
+ * consistently wound mesh (Baerentzen and Aanaes 2005) regardless of which
+ * feature is nearest. Shared vertices and edges are found by position.
+ */
+struct DistanceMesh
+{
+	std::vector<Triangle> triangles;
+	BVH bvh;
+	std::vector<Vector3> pseudo_normals; // FEATURE_COUNT per triangle, indexed by TriangleFeature
+};
+
+inline
+double TriangleAngle(const Point3 &corner, const Point3 &b, const Point3 &c) {
+	Vector3 u = b - corner;
+	Vector3 v = c - corner;
+	return atan2(u.cross(v).length(), u.dot(v));
+}
+
+inline
+void BuildDistanceMesh(const BVHSettings &settings, DistanceMesh *mesh) {
+	BuildBVH(mesh->triangles, settings, &mesh->bvh);
+
+	unsigned int triangle_count = mesh->triangles.size();
+	std::vector<Point3> positions(3 * triangle_count);
+	for (unsigned int i = 0; i < triangle_count; ++i) {
+		for (int k = 0; k < 3; ++k) {
+			positions[3 * i + k] = mesh->triangles[i].vertices[k];
+		}
+	}
+	// Remapped by hand rather than through WeldVertices, every triangle keeps its entry
+	std::vector<unsigned int> remap;
+	WeldVertexPositions(&positions, &remap);
+	std::vector<TriIndex> indices(triangle_count);
+	for (unsigned int i = 0; i < triangle_count; ++i) {
+		indices[i] = { remap[3 * i], remap[3 * i + 1], remap[3 * i + 2] };
+	}
+
+	std::vector<Vector3> vertex_normals(positions.size(), Vector3(0, 0, 0));
+	std::unordered_map<unsigned long long, Vector3> edge_normals;
+	edge_normals.reserve(3 * triangle_count / 2);
+	std::vector<Vector3> face_normals(triangle_count);
+	for (unsigned int i = 0; i < triangle_count; ++i) {
+		const Triangle &triangle = mesh->triangles[i];
+		Vector3 normal = (triangle.vertices[1] - triangle.vertices[0]).cross(triangle.vertices[2] - triangle.vertices[0]);
+		normal.normalize();
+		face_normals[i] = normal;
+
+		unsigned int v[3] = { indices[i].i1, indices[i].i2, indices[i].i3 };
+		for (int k = 0; k < 3; ++k) {
+			const Point3 &corner = triangle.vertices[k];
+			double angle = TriangleAngle(corner, triangle.vertices[(k + 1) % 3], triangle.vertices[(k + 2) % 3]);
+			vertex_normals[v[k]] = vertex_normals[v[k]] + angle * normal;
+
+			unsigned long long key = ((unsigned long long)std::min(v[k], v[(k + 1) % 3]) << 32) | std::max(v[k], v[(k + 1) % 3]);
+			auto inserted = edge_normals.insert(std::make_pair(key, normal));
+			if (!inserted.second) {
+				inserted.first->second = inserted.first->second + normal;
+			}
+		}
+	}
+
+	mesh->pseudo_normals.resize(FEATURE_COUNT * triangle_count);
+	for (unsigned int i = 0; i < triangle_count; ++i) {
+		Vector3 *normals = &mesh->pseudo_normals[FEATURE_COUNT * i];
+		unsigned int v[3] = { indices[i].i1, indices[i].i2, indices[i].i3 };
+		for (int k = 0; k < 3; ++k) {
+			normals[FEATURE_VERTEX_0 + k] = vertex_normals[v[k]];
+			unsigned long long key = ((unsigned long long)std::min(v[k], v[(k + 1) % 3]) << 32) | std::max(v[k], v[(k + 1) % 3]);
+			normals[FEATURE_EDGE_01 + k] = edge_normals[key];
+		}
+		normals[FEATURE_FACE] = face_normals[i];
+	}
+}
+
+/** Distance from |p| to the surface of |mesh|, |bound| is a known upper bound on it if there is one. */
+inline
+double UnsignedDistance(const DistanceMesh &mesh, const Point3 &p, SurfacePoint *nearest,
+		double bound = std::numeric_limits<double>::max()) {
+	if (bound < std::numeric_limits<double>::max()) {
+		// Pad so a point exactly at the bound is still found
+		nearest->distance2 = bound * bound * (1 + 1e-9) + std::numeric_limits<double>::min();
+	}
+	BVHNearestSurface(mesh.bvh, mesh.triangles, p, nearest);
+	return sqrt(nearest->distance2);
+}
+
+/** As UnsignedDistance but negative inside the mesh, which must be closed and consistently wound. */
+inline
+double SignedDistance(const DistanceMesh &mesh, const Point3 &p, SurfacePoint *nearest,
+		double bound = std::numeric_limits<double>::max()) {
+	double distance = UnsignedDistance(mesh, p, nearest, bound);
+	if (nearest->triangle == std::numeric_limits<unsigned int>::max()) {
+		return distance;
+	}
+	const Vector3 &normal = mesh.pseudo_normals[FEATURE_COUNT * nearest->triangle + nearest->feature];
+	return normal.dot(p - nearest->pos) < 0 ? -distance : distance;
+}
+
+/** Signed or unsigned distances for many points, in parallel batches. */
+inline
+void DistanceBatch(const DistanceMesh &mesh, const std::vector<Point3> &points, bool is_signed,
+		std::vector<double> *distances) {
+	distances->resize(points.size());
+	unsigned int batch_count = (points.size() + DISTANCE_BATCH_SIZE - 1) / DISTANCE_BATCH_SIZE;
+	ParallelFor(0, batch_count, [&](unsigned int batch) {
+		unsigned int end = std::min((unsigned int)points.size(), (batch + 1) * DISTANCE_BATCH_SIZE);
+		for (unsigned int i = batch * DISTANCE_BATCH_SIZE; i < end; ++i) {
+			SurfacePoint nearest;
+			(*distances)[i] = is_signed ? SignedDistance(mesh, points[i], &nearest) :
+				UnsignedDistance(mesh, points[i], &nearest);
+		}
+	});
+}
+
+/**
+ * Bake the signed distance at the centres of a |resolution| grid of voxels over
+ * |bounds| into |distances|, x fastest. Rows are baked in parallel and along a row
+ * each query is bounded by the previous distance plus the voxel step, since the
+ * distance function is 1-Lipschitz, so far subtrees are skipped from the start.
+ */
+inline
+void BakeSignedDistanceGrid(const DistanceMesh &mesh, const BoundingBox &bounds, const unsigned int resolution[3],
+		std::vector<double> *distances) {
+	distances->resize((size_t)resolution[0] * resolution[1] * resolution[2]);
+	Vector3 extent = bounds.extent();
+	Vector3 step(extent.x / resolution[0], extent.y / resolution[1], extent.z / resolution[2]);
+
+	ParallelFor(0, resolution[1] * resolution[2], [&](unsigned int row) {
+		unsigned int y = row % resolution[1];
+		unsigned int z = row / resolution[1];
+		double *out = &(*distances)[(size_t)row * resolution[0]];
+		double bound = std::numeric_limits<double>::max();
+		for (unsigned int x = 0; x < resolution[0]; ++x) {
+			Point3 p(bounds.min.x + (x + 0.5) * step.x, bounds.min.y + (y + 0.5) * step.y,
+				bounds.min.z + (z + 0.5) * step.z);
+			SurfacePoint nearest;
+			out[x] = SignedDistance(mesh, p, &nearest, bound);
+			bound = std::abs(out[x]) + step.x;
+		}
+	});
+}
+
+#endif
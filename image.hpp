@@ -280,63 +280,131 @@ bool LoadPNG(const std::string &filename, Image *image) {
 	return true;
 }
 
-inline
-void WritePNG(const Image &image, const std::string &filename) {
-	FILE *fout = fopen(filename.c_str(), "wb");
-	png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-	png_infop info_ptr = png_create_info_struct(png_ptr);
-	setjmp(png_jmpbuf(png_ptr));
-
-	png_init_io(png_ptr, fout);
+/**
+ * Incremental PNG writer for images too large to hold, rows are converted and
+ * encoded as they arrive so only the caller's current band needs to be in memory.
+ */
+struct PNGStream
+{
+	PNGStream() : file(NULL), png_ptr(NULL), info_ptr(NULL), channels(0), rows_written(0) {}
 
-	png_set_filter(png_ptr, 0, PNG_FILTER_PAETH);
+	FILE *file;
+	png_structp png_ptr;
+	png_infop info_ptr;
+	Size size;
+	int channels;
+	int rows_written;
+	std::vector<png_byte> line;
+};
 
-	png_set_compression_level(png_ptr, Z_BEST_COMPRESSION);
+inline
+void ClosePNGStream(PNGStream *stream) {
+	if (stream->png_ptr) {
+		png_destroy_write_struct(&stream->png_ptr, &stream->info_ptr);
+	}
+	if (stream->file) {
+		fclose(stream->file);
+	}
+	*stream = PNGStream();
+}
 
-	int color_type;
-	switch (image.channels) {
-	case 1:
-		color_type = PNG_COLOR_TYPE_GRAY;
-		break;
-	case 2:
-		color_type = PNG_COLOR_TYPE_GRAY_ALPHA;
-		break;
-	case 3:
-		color_type = PNG_COLOR_TYPE_RGB;
-		break;
-	case 4:
-	default:
-		color_type = PNG_COLOR_TYPE_RGBA;
-		break;
+/** Open |filename| and write the header for an image of |size| with |channels| (1 to 4). */
+inline
+bool BeginPNGStream(const std::string &filename, const Size &size, int channels, PNGStream *stream) {
+	static const int kColourTypes[4] = {
+		PNG_COLOR_TYPE_GRAY, PNG_COLOR_TYPE_GRAY_ALPHA, PNG_COLOR_TYPE_RGB, PNG_COLOR_TYPE_RGBA
+	};
+	if (channels < 1 || channels > 4) {
+		return false;
+	}
+	stream->file = fopen(filename.c_str(), "wb");
+	if (!stream->file) {
+		printf("Unable to open %s\n", filename.c_str());
+		return false;
+	}
+	stream->png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	stream->info_ptr = stream->png_ptr ? png_create_info_struct(stream->png_ptr) : NULL;
+	if (!stream->info_ptr || setjmp(png_jmpbuf(stream->png_ptr))) {
+		ClosePNGStream(stream);
+		return false;
 	}
 
-	png_set_IHDR(png_ptr, info_ptr, image.size.x, image.size.y, 8,
-		color_type,
+	png_init_io(stream->png_ptr, stream->file);
+	png_set_filter(stream->png_ptr, 0, PNG_FILTER_PAETH);
+	png_set_compression_level(stream->png_ptr, Z_BEST_COMPRESSION);
+	png_set_IHDR(stream->png_ptr, stream->info_ptr, size.x, size.y, 8,
+		kColourTypes[channels - 1],
 		PNG_INTERLACE_NONE,
 		PNG_COMPRESSION_TYPE_DEFAULT,
 		PNG_FILTER_TYPE_DEFAULT);
-	png_write_info(png_ptr, info_ptr);
+	png_write_info(stream->png_ptr, stream->info_ptr);
 
-	png_byte *temp_line = new png_byte[image.size.x * image.channels];
-
-	for (int y = 0; y < image.size.y; ++y) {
-		for (int x = 0; x < image.size.x; ++x) {
-			for (int c = 0; c < image.channels; ++c) {
-				int index = dataIndex(image.size.x, image.size.y, image.channels, x, y, c);
-
-				double value = std::min(1.0f, std::max(0.0f, image.data[index]));
+	stream->size = size;
+	stream->channels = channels;
+	stream->rows_written = 0;
+	stream->line.resize(size.x * channels);
+	return true;
+}
 
-				temp_line[image.channels * x + c] = static_cast<png_byte>(value * 255.0);
-			}
+/**
+ * Encode the next |row_count| rows of |data|, top row first as they appear in the
+ * file, each size.x pixels of interleaved channels clamped to [0, 1].
+ * The caller can free or reuse |data| as soon as this returns.
+ */
+inline
+bool WritePNGRows(const float *data, int row_count, PNGStream *stream) {
+	if (!stream->png_ptr || stream->rows_written + row_count > stream->size.y) {
+		return false;
+	}
+	if (setjmp(png_jmpbuf(stream->png_ptr))) {
+		ClosePNGStream(stream);
+		return false;
+	}
+	int row_size = stream->size.x * stream->channels;
+	for (int y = 0; y < row_count; ++y) {
+		const float *row = data + y * row_size;
+		for (int i = 0; i < row_size; ++i) {
+			double value = std::min(1.0f, std::max(0.0f, row[i]));
+			stream->line[i] = static_cast<png_byte>(value * 255.0);
 		}
-		png_write_row(png_ptr, temp_line);
+		png_write_row(stream->png_ptr, &stream->line[0]);
 	}
+	stream->rows_written += row_count;
+	return true;
+}
 
-	delete temp_line;
+/** Finish the file, fails if fewer rows than the image height were written. */
+inline
+bool EndPNGStream(PNGStream *stream) {
+	if (!stream->png_ptr) {
+		return false;
+	}
+	bool complete = stream->rows_written == stream->size.y;
+	if (complete) {
+		if (setjmp(png_jmpbuf(stream->png_ptr))) {
+			ClosePNGStream(stream);
+			return false;
+		}
+		png_write_end(stream->png_ptr, stream->info_ptr);
+	}
+	ClosePNGStream(stream);
+	return complete;
+}
 
-	png_write_end(png_ptr, info_ptr);
-	png_destroy_write_struct(&png_ptr, &info_ptr);
-	fclose(fout);
+inline
+void WritePNG(const Image &image, const std::string &filename) {
+	PNGStream stream;
+	if (!BeginPNGStream(filename, image.size, image.channels, &stream)) {
+		printf("Failed to write %s\n", filename.c_str());
+		return;
+	}
+	// Image rows increase upwards, the file is written top down
+	for (int y = 0; y < image.size.y && stream.png_ptr; ++y) {
+		WritePNGRows(&image.data[dataIndex(image.size.x, image.size.y, image.channels, 0, y, 0)], 1, &stream);
+	}
+	if (!EndPNGStream(&stream)) {
+		printf("Failed to write %s\n", filename.c_str());
+	}
 }
 
 #endif
\ No newline at end of file
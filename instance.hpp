@@ -0,0 +1,129 @@
+/*
+* Copyright (c) 2015 Owen Glofcheski
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+*    1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+*    2. Altered source versions must be plainly marked as such, and must not
+*    be misrepresented as being the original software.
+*
+*    3. This notice may not be removed or altered from any source
+*    distribution.
+*/
+
+#ifndef _INSTANCE_HPP_
+#define _INSTANCE_HPP_
+
+#include <iostream>
+#include <vector>
+
+#include "algebra.hpp"
+#include "bvh.hpp"
+#include "primitive.hpp"
+#include "stats.hpp"
+
+/** Object space triangles and their bottom-level hierarchy, shared by every instance. */
+struct MeshGeometry
+{
+	std::vector<Triangle> triangles;
+	BVH bvh;
+};
+
+inline
+void BuildMeshGeometry(const BVHSettings &settings, MeshGeometry *geometry) {
+	BuildBVH(geometry->triangles, settings, &geometry->bvh);
+}
+
+struct Instance : Primitive
+{
+	Instance() : geometry(NULL) {}
+	Instance(const MeshGeometry *geometry, const Matrix4x4 &object_to_world) : geometry(geometry) {
+		transform = object_to_world;
+		inv_transform = object_to_world.invert();
+	}
+
+	const MeshGeometry *geometry;
+};
+
+inline
+BoundingBox PrimitiveBounds(const Instance &instance) {
+	if (instance.geometry->bvh.nodes.empty()) {
+		return BoundingBox();
+	}
+	return TransformBounds(instance.transform, instance.geometry->bvh.nodes[0].bounds);
+}
+
+inline
+Ray ObjectSpaceRay(const Instance &instance, const Ray &ray) {
+	// The direction is left unnormalized so t is the same in object and world space
+	return Ray(instance.inv_transform * ray.origin, instance.inv_transform * ray.dir);
+}
+
+inline
+bool PrimitiveIntersect(const Instance &instance, const Ray &ray, Intersection *intersection) {
+	const MeshGeometry &geometry = *instance.geometry;
+	if (!BVHIntersect(geometry.bvh, geometry.triangles, ObjectSpaceRay(instance, ray), intersection)) {
+		return false;
+	}
+
+	// Normals transform by the inverse transpose
+	intersection->pos = RayProjection(ray, intersection->t);
+	intersection->normal = instance.inv_transform.transpose() * intersection->normal;
+	intersection->normal.normalize();
+	intersection->material = instance.material;
+	return true;
+}
+
+inline
+bool PrimitiveOccluded(const Instance &instance, const Ray &ray, double tmax) {
+	const MeshGeometry &geometry = *instance.geometry;
+	return BVHOccluded(geometry.bvh, geometry.triangles, ObjectSpaceRay(instance, ray), tmax);
+}
+
+/**
+ * Two-level hierarchy, the top level is built over instance bounds in world space
+ * and each instance traverses the bottom-level hierarchy of its geometry.
+ * The geometry must outlive the instances referencing it.
+ */
+struct InstanceBVH
+{
+	std::vector<Instance> instances;
+	BVH bvh;
+};
+
+inline
+void BuildInstanceBVH(const BVHSettings &settings, InstanceBVH *scene) {
+	BuildBVH(scene->instances, settings, &scene->bvh);
+}
+
+inline
+bool InstanceBVHIntersect(const InstanceBVH &scene, const Ray &ray, Intersection *intersection) {
+	STAT_INC(STAT_RAYS);
+	if (!BVHIntersect(scene.bvh, scene.instances, ray, intersection)) {
+		return false;
+	}
+	STAT_INC(STAT_RAY_HITS);
+	return true;
+}
+
+inline
+bool InstanceBVHOccluded(const InstanceBVH &scene, const Ray &ray, double tmax) {
+	STAT_INC(STAT_SHADOW_RAYS);
+	if (!BVHOccluded(scene.bvh, scene.instances, ray, tmax)) {
+		return false;
+	}
+	STAT_INC(STAT_SHADOW_RAY_HITS);
+	return true;
+}
+
+#endif
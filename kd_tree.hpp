@@ -0,0 +1,396 @@
+/*
+* Copyright (c) 2015 Owen Glofcheski
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+*    1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+*    2. Altered source versions must be plainly marked as such, and must not
+*    be misrepresented as being the original software.
+*
+*    3. This notice may not be removed or altered from any source
+*    distribution.
+*/
+
+
+#ifndef _KD_TREE_HPP_
+#define _KD_TREE_HPP_
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <vector>
+
+#include "algebra.hpp"
+#include "parallel.hpp"
+
+#define KD_TREE_STACK_SIZE 64
+#define KD_TREE_PARALLEL_DEPTH 6 // Subtrees below this depth are built in parallel
+#define KD_TREE_PARALLEL_POINTS 65536
+#define KD_TREE_BATCH_SIZE 64 // Queries sharing one traversal in the batched queries
+#define KD_TREE_BATCH_SPLIT 4 // Batches down to this many active queries finish one query at a time
+
+template <typename T>
+struct KDTreeNode
+{
+	Point3 pos;
+	T data;
+	unsigned int axis; // Split axis, unused at leaves
+};
+
+/**
+ * Left-balanced k-d tree over points with a payload each, stored implicitly as a heap in a
+ * single array, the children of node i are 2i + 1 and 2i + 2. Left balancing fills the
+ * array without gaps so there are no pointers or padding nodes.
+ */
+template <typename T>
+struct KDTree
+{
+	std::vector<KDTreeNode<T>> nodes;
+};
+
+struct KDTreeNeighbour
+{
+	bool operator < (const KDTreeNeighbour &other) const {
+		return distance2 < other.distance2;
+	}
+
+	double distance2;
+	unsigned int index; // Node in the tree
+};
+
+/** Adds a point, BuildKDTree must be called before querying. */
+template <typename T>
+void AddKDTreePoint(const Point3 &pos, const T &data, KDTree<T> *tree) {
+	KDTreeNode<T> node;
+	node.pos = pos;
+	node.data = data;
+	node.axis = 0;
+	tree->nodes.push_back(node);
+}
+
+/** Size of the left subtree of a left-balanced tree with |count| nodes. */
+inline
+unsigned int KDTreeLeftSize(unsigned int count) {
+	if (count <= 1) {
+		return 0;
+	}
+	unsigned int height = 0;
+	while ((2u << height) - 1 <= count) {
+		++height;
+	}
+	unsigned int full = (1u << height) - 1; // Nodes in the complete levels
+	unsigned int last_level = count - full;
+	return (full - 1) / 2 + std::min(last_level, 1u << (height - 1));
+}
+
+struct KDTreeBuildTask
+{
+	unsigned int first;
+	unsigned int count;
+	unsigned int node;
+};
+
+/**
+ * Places the median of |points| [first, first + count) along the axis of largest extent at
+ * |node_index| of |nodes| and recurses. With |tasks| the subtrees at KD_TREE_PARALLEL_DEPTH
+ * are recorded instead of built, they touch disjoint ranges so they can be built concurrently.
+ */
+template <typename T>
+void BuildKDTreeNode(std::vector<KDTreeNode<T>> &points, unsigned int first, unsigned int count,
+		unsigned int node_index, unsigned int depth, std::vector<KDTreeNode<T>> *nodes,
+		std::vector<KDTreeBuildTask> *tasks) {
+	if (count == 0) {
+		return;
+	}
+	if (tasks != NULL && depth == KD_TREE_PARALLEL_DEPTH) {
+		KDTreeBuildTask task;
+		task.first = first;
+		task.count = count;
+		task.node = node_index;
+		tasks->push_back(task);
+		return;
+	}
+
+	Point3 min = points[first].pos;
+	Point3 max = points[first].pos;
+	for (unsigned int i = first + 1; i < first + count; ++i) {
+		for (int axis = 0; axis < 3; ++axis) {
+			min[axis] = std::min(min[axis], points[i].pos[axis]);
+			max[axis] = std::max(max[axis], points[i].pos[axis]);
+		}
+	}
+	Vector3 extent = max - min;
+	unsigned int axis = extent.x > extent.y && extent.x > extent.z ? 0 : (extent.y > extent.z ? 1 : 2);
+
+	unsigned int left_size = KDTreeLeftSize(count);
+	KDTreeNode<T> *begin = &points[first];
+	std::nth_element(begin, begin + left_size, begin + count, [axis](const KDTreeNode<T> &a, const KDTreeNode<T> &b) {
+		return a.pos[axis] < b.pos[axis];
+	});
+	(*nodes)[node_index] = begin[left_size];
+	(*nodes)[node_index].axis = axis;
+
+	BuildKDTreeNode(points, first, left_size, 2 * node_index + 1, depth + 1, nodes, tasks);
+	BuildKDTreeNode(points, first + left_size + 1, count - left_size - 1, 2 * node_index + 2, depth + 1, nodes, tasks);
+}
+
+/** Reorders the added points into the implicit layout, in parallel for large trees. */
+template <typename T>
+void BuildKDTree(KDTree<T> *tree) {
+	std::vector<KDTreeNode<T>> points;
+	points.swap(tree->nodes);
+	unsigned int count = points.size();
+	tree->nodes.resize(count);
+	if (count < KD_TREE_PARALLEL_POINTS) {
+		BuildKDTreeNode<T>(points, 0, count, 0, 0, &tree->nodes, NULL);
+		return;
+	}
+
+	std::vector<KDTreeBuildTask> tasks;
+	BuildKDTreeNode(points, 0, count, 0, 0, &tree->nodes, &tasks);
+	ParallelFor(0, tasks.size(), [&](unsigned int i) {
+		BuildKDTreeNode<T>(points, tasks[i].first, tasks[i].count, tasks[i].node, KD_TREE_PARALLEL_DEPTH, &tree->nodes, NULL);
+	});
+}
+
+/** Offers a point to the max-heap of the |k| nearest found so far, returns the new search radius squared. */
+inline
+double OfferKDTreeNeighbour(unsigned int index, double distance2, unsigned int k, double max_distance2,
+		KDTreeNeighbour *neighbours, unsigned int *found) {
+	if (*found < k) {
+		neighbours[*found].distance2 = distance2;
+		neighbours[*found].index = index;
+		std::push_heap(neighbours, neighbours + ++*found);
+	} else {
+		std::pop_heap(neighbours, neighbours + k);
+		neighbours[k - 1].distance2 = distance2;
+		neighbours[k - 1].index = index;
+		std::push_heap(neighbours, neighbours + k);
+	}
+	return *found < k ? max_distance2 : neighbours[0].distance2;
+}
+
+/**
+ * Depth first search from |node_index| visiting the side of each split containing |point| first.
+ * visit(index, distance2) is called for every point within the search radius and returns the
+ * search radius squared from then on, starting from |radius2|.
+ */
+template <typename T, typename VisitFunc>
+void KDTreeTraverse(const KDTree<T> &tree, const Point3 &point, unsigned int node_index, double radius2,
+		const VisitFunc &visit) {
+	unsigned int count = tree.nodes.size();
+	unsigned int stack[KD_TREE_STACK_SIZE];
+	double stack_distance2[KD_TREE_STACK_SIZE];
+	unsigned int stack_size = 0;
+	stack[stack_size] = node_index;
+	stack_distance2[stack_size++] = 0;
+	while (stack_size > 0) {
+		--stack_size;
+		if (stack_distance2[stack_size] > radius2) {
+			continue;
+		}
+		node_index = stack[stack_size];
+		while (node_index < count) {
+			const KDTreeNode<T> &node = tree.nodes[node_index];
+			Vector3 offset = node.pos - point;
+			double distance2 = offset.dot(offset);
+			if (distance2 <= radius2) {
+				radius2 = visit(node_index, distance2);
+			}
+
+			// The other side is revisited if the search ball still crosses the plane
+			double split = point[node.axis] - node.pos[node.axis];
+			unsigned int near_child = split < 0 ? 2 * node_index + 1 : 2 * node_index + 2;
+			unsigned int far_child = split < 0 ? 2 * node_index + 2 : 2 * node_index + 1;
+			if (far_child < count && split * split <= radius2) {
+				stack[stack_size] = far_child;
+				stack_distance2[stack_size++] = split * split;
+			}
+			node_index = near_child;
+		}
+	}
+}
+
+/**
+ * The up to |k| points nearest to |point| within |max_distance|, written to |neighbours|
+ * nearest first. Returns how many were found.
+ */
+template <typename T>
+unsigned int KDTreeNearest(const KDTree<T> &tree, const Point3 &point, unsigned int k, double max_distance,
+		KDTreeNeighbour *neighbours) {
+	unsigned int found = 0;
+	if (tree.nodes.empty() || k == 0) {
+		return 0;
+	}
+	double max_distance2 = max_distance * max_distance;
+	KDTreeTraverse(tree, point, 0, max_distance2, [&](unsigned int index, double distance2) {
+		double radius2 = found < k ? max_distance2 : neighbours[0].distance2;
+		if (distance2 < radius2) {
+			radius2 = OfferKDTreeNeighbour(index, distance2, k, max_distance2, neighbours, &found);
+		}
+		return radius2;
+	});
+	std::sort_heap(neighbours, neighbours + found);
+	return found;
+}
+
+/** Calls func(index, distance2) for every point within |radius| of |point|, in no particular order. */
+template <typename T, typename Func>
+void KDTreeRadius(const KDTree<T> &tree, const Point3 &point, double radius, const Func &func) {
+	if (tree.nodes.empty()) {
+		return;
+	}
+	double radius2 = radius * radius;
+	KDTreeTraverse(tree, point, 0, radius2, [&](unsigned int index, double distance2) {
+		func(index, distance2);
+		return radius2;
+	});
+}
+
+/**
+ * Shared traversal for a batch of queries, |active| holds the queries whose search ball reaches
+ * |node_index|. Each node is fetched once for the batch, queries split off to KDTreeTraverse once
+ * they're alone. visit(query, index, distance2) behaves as for KDTreeTraverse.
+ */
+template <typename T, typename VisitFunc>
+void KDTreeBatchNode(const KDTree<T> &tree, const Point3 *points, double *radius2, unsigned int node_index,
+		unsigned int *active, unsigned int active_count, const VisitFunc &visit) {
+	if (active_count <= KD_TREE_BATCH_SPLIT) {
+		for (unsigned int i = 0; i < active_count; ++i) {
+			unsigned int query = active[i];
+			KDTreeTraverse(tree, points[query], node_index, radius2[query], [&](unsigned int index, double distance2) {
+				return radius2[query] = visit(query, index, distance2);
+			});
+		}
+		return;
+	}
+
+	const KDTreeNode<T> &node = tree.nodes[node_index];
+	unsigned int left = 2 * node_index + 1;
+	unsigned int *sides = active + active_count; // Queries left of the split then those right of it
+	unsigned int left_count = 0;
+	unsigned int right_count = 0;
+	for (unsigned int i = 0; i < active_count; ++i) {
+		unsigned int query = active[i];
+		Vector3 offset = node.pos - points[query];
+		double distance2 = offset.dot(offset);
+		if (distance2 <= radius2[query]) {
+			radius2[query] = visit(query, node_index, distance2);
+		}
+		if (points[query][node.axis] < node.pos[node.axis]) {
+			sides[left_count++] = query;
+		} else {
+			sides[active_count - ++right_count] = query;
+		}
+	}
+	if (left >= tree.nodes.size()) {
+		return;
+	}
+
+	// Each query visits its own side first, as in KDTreeTraverse, then the other if still in reach
+	unsigned int *child_active = sides + active_count;
+	for (int side = 0; side < 2; ++side) {
+		unsigned int child = left + side;
+		unsigned int *near = side == 0 ? sides : sides + left_count;
+		unsigned int near_count = side == 0 ? left_count : right_count;
+		if (child < tree.nodes.size() && near_count > 0) {
+			std::copy(near, near + near_count, child_active);
+			KDTreeBatchNode(tree, points, radius2, child, child_active, near_count, visit);
+		}
+	}
+	for (int side = 0; side < 2; ++side) {
+		unsigned int child = left + side;
+		unsigned int *far = side == 0 ? sides + left_count : sides;
+		unsigned int far_count = side == 0 ? right_count : left_count;
+		unsigned int child_count = 0;
+		for (unsigned int i = 0; i < far_count && child < tree.nodes.size(); ++i) {
+			double split = points[far[i]][node.axis] - node.pos[node.axis];
+			if (split * split <= radius2[far[i]]) {
+				child_active[child_count++] = far[i];
+			}
+		}
+		if (child_count > 0) {
+			KDTreeBatchNode(tree, points, radius2, child, child_active, child_count, visit);
+		}
+	}
+}
+
+template <typename T, typename VisitFunc>
+void KDTreeBatch(const KDTree<T> &tree, const Point3 *points, unsigned int count, double radius2,
+		const VisitFunc &visit) {
+	if (tree.nodes.empty()) {
+		return;
+	}
+
+	unsigned int batch_count = (count + KD_TREE_BATCH_SIZE - 1) / KD_TREE_BATCH_SIZE;
+	ParallelFor(0, batch_count, [&](unsigned int batch) {
+		unsigned int first = batch * KD_TREE_BATCH_SIZE;
+		unsigned int batch_size = std::min(count - first, static_cast<unsigned int>(KD_TREE_BATCH_SIZE));
+
+		// Each level of the recursion keeps its own active list on top of the previous ones
+		unsigned int active[2 * KD_TREE_BATCH_SIZE * KD_TREE_STACK_SIZE];
+		double query_radius2[KD_TREE_BATCH_SIZE];
+		for (unsigned int i = 0; i < batch_size; ++i) {
+			active[i] = i;
+			query_radius2[i] = radius2;
+		}
+		KDTreeBatchNode(tree, points + first, query_radius2, 0, active, batch_size,
+			[&](unsigned int query, unsigned int node_index, double distance2) {
+				return visit(first + query, node_index, distance2);
+			});
+	});
+}
+
+/**
+ * KDTreeNearest for |count| queries at once, in parallel. Batches of nearby queries share
+ * one traversal so it pays to order |points| coherently, e.g. along the path that produced them.
+ * |neighbours| holds |k| entries per query and |found| the number found for each.
+ */
+template <typename T>
+void KDTreeNearestBatch(const KDTree<T> &tree, const Point3 *points, unsigned int count, unsigned int k,
+		double max_distance, KDTreeNeighbour *neighbours, unsigned int *found) {
+	std::fill(found, found + count, 0);
+	if (k == 0) {
+		return;
+	}
+	double max_distance2 = max_distance * max_distance;
+	KDTreeBatch(tree, points, count, max_distance2, [&](unsigned int query, unsigned int node_index, double distance2) {
+		KDTreeNeighbour *query_neighbours = neighbours + static_cast<size_t>(query) * k;
+		double radius2 = found[query] < k ? max_distance2 : query_neighbours[0].distance2;
+		if (distance2 < radius2) {
+			radius2 = OfferKDTreeNeighbour(node_index, distance2, k, max_distance2, query_neighbours, &found[query]);
+		}
+		return radius2;
+	});
+	ParallelFor(0, count, [&](unsigned int query) {
+		KDTreeNeighbour *query_neighbours = neighbours + static_cast<size_t>(query) * k;
+		std::sort_heap(query_neighbours, query_neighbours + found[query]);
+	});
+}
+
+/**
+ * KDTreeRadius for |count| queries at once, in parallel, calling func(query, index, distance2).
+ * Calls for different queries may run concurrently.
+ */
+template <typename T, typename Func>
+void KDTreeRadiusBatch(const KDTree<T> &tree, const Point3 *points, unsigned int count, double radius,
+		const Func &func) {
+	double radius2 = radius * radius;
+	KDTreeBatch(tree, points, count, radius2, [&](unsigned int query, unsigned int node_index, double distance2) {
+		func(query, node_index, distance2);
+		return radius2;
+	});
+}
+
+#endif
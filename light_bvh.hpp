@@ -0,0 +1,321 @@
+/*
+* Copyright (c) 2015 Owen Glofcheski
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+*    1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+*    2. Altered source versions must be plainly marked as such, and must not
+*    be misrepresented as being the original software.
+*
+*    3. This notice may not be removed or altered from any source
+*    distribution.
+*/
+
+
+#ifndef _LIGHT_BVH_HPP_
+#define _LIGHT_BVH_HPP_
+
+#include <algorithm>
+#include <iostream>
+#include <limits>
+#include <vector>
+
+#include "algebra.hpp"
+#include "bvh.hpp"
+#include "colour.hpp"
+
+#define LIGHT_BVH_BINS 12
+#define LIGHT_THETA_E (PI / 2) // Emitters are diffuse, they emit over a hemisphere about each normal
+
+inline
+float Luminance(const Colour &colour) {
+	return 0.2126f * colour.r + 0.7152f * colour.g + 0.0722f * colour.b;
+}
+
+/** Bounds on the emission normals, every normal is within |theta| of |axis|. */
+struct LightCone
+{
+	LightCone() : axis(0, 0, 1), theta(0) {}
+	LightCone(const Vector3 &axis, double theta) : axis(axis), theta(theta) {}
+
+	Vector3 axis;
+	double theta;
+};
+
+/** Smallest cone bounding both, see Conty Estevez and Kulla 2018. */
+inline
+LightCone MergeLightCones(const LightCone &a, const LightCone &b) {
+	if (b.theta > a.theta) {
+		return MergeLightCones(b, a);
+	}
+	double theta_d = acos(std::max(-1.0, std::min(1.0, a.axis.dot(b.axis))));
+	if (std::min(theta_d + b.theta, PI) <= a.theta) {
+		return a;
+	}
+	double theta = (a.theta + theta_d + b.theta) / 2;
+	if (theta >= PI) {
+		return LightCone(a.axis, PI);
+	}
+
+	// Rotate a's axis towards b's by the growth of the cone
+	Vector3 perpendicular = b.axis - a.axis.dot(b.axis) * a.axis;
+	if (perpendicular.dot(perpendicular) < 1e-12) {
+		return LightCone(a.axis, PI);
+	}
+	perpendicular.normalize();
+	double theta_r = theta - a.theta;
+	return LightCone(cos(theta_r) * a.axis + sin(theta_r) * perpendicular, theta);
+}
+
+/** Solid angle measure of a cone's emission, larger cones are likelier to face a point. */
+inline
+double LightConeMeasure(const LightCone &cone) {
+	double theta_o = cone.theta;
+	double theta_w = std::min(theta_o + LIGHT_THETA_E, PI);
+	return 2 * PI * (1 - cos(theta_o)) + PI / 2 * (2 * theta_w * sin(theta_o) -
+		cos(theta_o - 2 * theta_w) - 2 * theta_o * sin(theta_o) + cos(theta_o));
+}
+
+/** An emissive primitive, |primitive| is a scene primitive id. */
+struct EmissiveLight
+{
+	unsigned int primitive;
+	float power;
+	BoundingBox bounds;
+	LightCone cone;
+};
+
+struct LightBVHNode
+{
+	bool leaf() const {
+		return count > 0;
+	}
+
+	BoundingBox bounds;
+	LightCone cone;
+	float power;
+	unsigned int offset; // Left child for interior nodes (right is offset + 1), the light for leaves
+	unsigned int count; // 1 for leaves, 0 for interior nodes
+};
+
+/**
+ * Hierarchy over the emitters bounding their power, extent and orientation so
+ * one light can be importance sampled per shading point in O(log N). Leaves hold
+ * a single light so the sampling probability is exact down to the emitter.
+ */
+struct LightBVH
+{
+	std::vector<LightBVHNode> nodes;
+	std::vector<EmissiveLight> lights;
+};
+
+struct LightBin
+{
+	LightBin() : power(0), count(0) {}
+
+	BoundingBox bounds;
+	LightCone cone;
+	float power;
+	unsigned int count;
+};
+
+inline
+void AddToLightBin(const EmissiveLight &light, LightBin *bin) {
+	bin->cone = bin->count == 0 ? light.cone : MergeLightCones(bin->cone, light.cone);
+	bin->bounds.extend(light.bounds);
+	bin->power += light.power;
+	++bin->count;
+}
+
+inline
+double LightBinCost(const LightBin &bin) {
+	return bin.count == 0 ? 0 : bin.power * bin.bounds.area() * LightConeMeasure(bin.cone);
+}
+
+/** Surface area orientation heuristic split over binned centroids, see Conty Estevez and Kulla 2018. */
+inline
+void BuildLightBVHNode(unsigned int node_index, unsigned int first, unsigned int count, LightBVH *bvh) {
+	std::vector<EmissiveLight> &lights = bvh->lights;
+	LightBin all;
+	BoundingBox centroids;
+	for (unsigned int i = first; i < first + count; ++i) {
+		AddToLightBin(lights[i], &all);
+		centroids.extend(lights[i].bounds.center());
+	}
+	LightBVHNode &node = bvh->nodes[node_index];
+	node.bounds = all.bounds;
+	node.cone = all.cone;
+	node.power = all.power;
+	if (count == 1) {
+		node.offset = first;
+		node.count = 1;
+		return;
+	}
+
+	double best_cost = std::numeric_limits<double>::max();
+	int best_axis = -1;
+	unsigned int best_split = 0;
+	Vector3 extent = all.bounds.extent();
+	double max_extent = std::max(extent.x, std::max(extent.y, extent.z));
+	for (int axis = 0; axis < 3; ++axis) {
+		double lo = centroids.min[axis];
+		double width = centroids.max[axis] - lo;
+		if (width <= 0) {
+			continue;
+		}
+		LightBin bins[LIGHT_BVH_BINS];
+		for (unsigned int i = first; i < first + count; ++i) {
+			int b = std::min(LIGHT_BVH_BINS - 1, (int)(LIGHT_BVH_BINS * (lights[i].bounds.center()[axis] - lo) / width));
+			AddToLightBin(lights[i], &bins[b]);
+		}
+
+		// Regularize so thin boxes aren't split along their short axes
+		double regularizer = max_extent / std::max(extent[axis], 1e-12);
+		LightBin right[LIGHT_BVH_BINS];
+		for (int b = LIGHT_BVH_BINS - 1; b > 0; --b) {
+			right[b] = bins[b];
+			if (b + 1 < LIGHT_BVH_BINS && right[b + 1].count > 0) {
+				right[b].bounds.extend(right[b + 1].bounds);
+				right[b].cone = right[b].count == 0 ? right[b + 1].cone : MergeLightCones(right[b].cone, right[b + 1].cone);
+				right[b].power += right[b + 1].power;
+				right[b].count += right[b + 1].count;
+			}
+		}
+		LightBin left;
+		for (int b = 0; b < LIGHT_BVH_BINS - 1; ++b) {
+			if (bins[b].count > 0) {
+				left.bounds.extend(bins[b].bounds);
+				left.cone = left.count == 0 ? bins[b].cone : MergeLightCones(left.cone, bins[b].cone);
+				left.power += bins[b].power;
+				left.count += bins[b].count;
+			}
+			if (left.count == 0 || right[b + 1].count == 0) {
+				continue;
+			}
+			double cost = regularizer * (LightBinCost(left) + LightBinCost(right[b + 1]));
+			if (cost < best_cost) {
+				best_cost = cost;
+				best_axis = axis;
+				best_split = b;
+			}
+		}
+	}
+
+	unsigned int mid;
+	if (best_axis < 0) {
+		// Coincident centroids, any split is as good
+		mid = first + count / 2;
+	} else {
+		double lo = centroids.min[best_axis];
+		double width = centroids.max[best_axis] - lo;
+		EmissiveLight *split = std::partition(&lights[first], &lights[first] + count, [&](const EmissiveLight &light) {
+			int b = std::min(LIGHT_BVH_BINS - 1, (int)(LIGHT_BVH_BINS * (light.bounds.center()[best_axis] - lo) / width));
+			return b <= (int)best_split;
+		});
+		mid = split - &lights[0];
+	}
+
+	unsigned int left_index = bvh->nodes.size();
+	bvh->nodes[node_index].offset = left_index;
+	bvh->nodes[node_index].count = 0;
+	bvh->nodes.resize(left_index + 2);
+	BuildLightBVHNode(left_index, first, mid - first, bvh);
+	BuildLightBVHNode(left_index + 1, mid, first + count - mid, bvh);
+}
+
+/** Build over bvh->lights, which is reordered, lights without power should be left out. */
+inline
+void BuildLightBVH(LightBVH *bvh) {
+	bvh->nodes.clear();
+	if (bvh->lights.empty()) {
+		return;
+	}
+	bvh->nodes.reserve(2 * bvh->lights.size() - 1);
+	bvh->nodes.resize(1);
+	BuildLightBVHNode(0, 0, bvh->lights.size(), bvh);
+}
+
+/**
+ * Conservative estimate of the light |node| delivers to a point at |pos| with
+ * shading normal |normal|: its power over the squared distance, scaled by the
+ * best emission and incidence cosines any point in the node could achieve.
+ */
+inline
+double LightNodeImportance(const LightBVHNode &node, const Point3 &pos, const Vector3 &normal) {
+	Point3 center = node.bounds.center();
+	Vector3 to_center = center - pos;
+	double radius2 = 0.25 * node.bounds.extent().dot(node.bounds.extent());
+	double distance2 = to_center.dot(to_center);
+	double distance = sqrt(distance2);
+	if (distance == 0) {
+		return node.power / std::max(radius2, 1e-12);
+	}
+	to_center /= distance;
+
+	// The node's bounding sphere spans theta_u as seen from |pos|, nothing bounds it from inside
+	double theta_u = distance2 > radius2 ? asin(sqrt(radius2 / distance2)) : PI;
+
+	double cos_emit = -to_center.dot(node.cone.axis);
+	double theta = acos(std::max(-1.0, std::min(1.0, cos_emit)));
+	double theta_emit = std::max(0.0, theta - node.cone.theta - theta_u);
+	if (theta_emit >= LIGHT_THETA_E) {
+		return 0;
+	}
+
+	double theta_i = acos(std::max(-1.0, std::min(1.0, normal.dot(to_center))));
+	double theta_incident = std::max(0.0, theta_i - theta_u);
+	if (theta_incident >= PI / 2) {
+		return 0;
+	}
+
+	return node.power * cos(theta_emit) * cos(theta_incident) / std::max(distance2, radius2);
+}
+
+/**
+ * Stochastically descend from the root choosing each child in proportion to its
+ * importance at |pos|, |u| in [0, 1) is rescaled at each level so one number
+ * drives the whole walk. Writes the chosen light's index into bvh.lights and the
+ * probability it was chosen, false when no light can reach |pos|.
+ */
+inline
+bool SampleLightBVH(const LightBVH &bvh, const Point3 &pos, const Vector3 &normal, double u,
+		unsigned int *light, double *pmf) {
+	if (bvh.nodes.empty()) {
+		return false;
+	}
+	*pmf = 1;
+	const LightBVHNode *node = &bvh.nodes[0];
+	while (!node->leaf()) {
+		const LightBVHNode &left = bvh.nodes[node->offset];
+		const LightBVHNode &right = bvh.nodes[node->offset + 1];
+		double w_left = LightNodeImportance(left, pos, normal);
+		double w_right = LightNodeImportance(right, pos, normal);
+		if (w_left + w_right <= 0) {
+			return false;
+		}
+		double p_left = w_left / (w_left + w_right);
+		if (u < p_left) {
+			u = std::min(u / p_left, 1.0 - 1e-12);
+			*pmf *= p_left;
+			node = &left;
+		} else {
+			u = std::min((u - p_left) / (1 - p_left), 1.0 - 1e-12);
+			*pmf *= 1 - p_left;
+			node = &right;
+		}
+	}
+	*light = node->offset;
+	return true;
+}
+
+#endif
@@ -0,0 +1,163 @@
+/*
+* Copyright (c) 2015 Owen Glofcheski
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+*    1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+*    2. Altered source versions must be plainly marked as such, and must not
+*    be misrepresented as being the original software.
+*
+*    3. This notice may not be removed or altered from any source
+*    distribution.
+*/
+
+
+#ifndef _MAPPED_FILE_HPP_
+#define _MAPPED_FILE_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/**
+ * Read only file mapped copy-on-write, pages are faulted in lazily as they're touched
+ * so opening is independent of the file size. Writes through |data| never reach the file.
+ */
+struct MappedFile
+{
+	MappedFile() : data(NULL), size(0) {}
+
+	char *data;
+	size_t size;
+};
+
+/** Binary files are written little-endian and used in place, so other hosts refuse them. */
+inline
+bool IsLittleEndian() {
+	const uint32_t value = 1;
+	unsigned char first;
+	memcpy(&first, &value, 1);
+	return first == 1;
+}
+
+inline
+void UnmapFile(MappedFile *file) {
+	if (file->data != NULL) {
+#if defined(_WIN32)
+		UnmapViewOfFile(file->data);
+#else
+		munmap(file->data, file->size);
+#endif
+	}
+	file->data = NULL;
+	file->size = 0;
+}
+
+inline
+bool MapFile(const std::string &filename, MappedFile *file) {
+	UnmapFile(file);
+#if defined(_WIN32)
+	HANDLE handle = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (handle == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(handle, &size) || size.QuadPart == 0) {
+		CloseHandle(handle);
+		return false;
+	}
+	HANDLE mapping = CreateFileMappingA(handle, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+	CloseHandle(handle);
+	if (mapping == NULL) {
+		return false;
+	}
+	void *data = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+	CloseHandle(mapping); // The view keeps the mapping alive
+	if (data == NULL) {
+		return false;
+	}
+	file->data = static_cast<char *>(data);
+	file->size = static_cast<size_t>(size.QuadPart);
+#else
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size == 0) {
+		close(fd);
+		return false;
+	}
+	void *data = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd); // The mapping keeps the file open
+	if (data == MAP_FAILED) {
+		return false;
+	}
+	file->data = static_cast<char *>(data);
+	file->size = static_cast<size_t>(info.st_size);
+#endif
+	return true;
+}
+
+/**
+ * Name for a temporary next to |filename| that no other writer, in this or another
+ * process, will pick. Files are written there and moved over |filename| with
+ * ReplaceFileAtomic so concurrent loaders only ever map complete files.
+ */
+inline
+std::string TemporaryFilename(const std::string &filename) {
+#if defined(_WIN32)
+	unsigned long pid = GetCurrentProcessId();
+#else
+	unsigned long pid = getpid();
+#endif
+	static thread_local std::mt19937_64 rng(std::random_device{}());
+	char suffix[64];
+	snprintf(suffix, sizeof(suffix), ".%lu.%016llx.tmp", pid, static_cast<unsigned long long>(rng()));
+	return filename + suffix;
+}
+
+/** Atomically replaces |filename| with |temporary|, the temporary is removed on failure. */
+inline
+bool ReplaceFileAtomic(const std::string &temporary, const std::string &filename) {
+#if defined(_WIN32)
+	bool replaced = MoveFileExA(temporary.c_str(), filename.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	bool replaced = std::rename(temporary.c_str(), filename.c_str()) == 0;
+#endif
+	if (!replaced) {
+		std::remove(temporary.c_str());
+	}
+	return replaced;
+}
+
+#endif
@@ -1,10 +1,21 @@
 #include "mesh.hpp"
 
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 #include <iostream>
-#include <set>
+#include <limits>
 #include <vector>
 
+#include <sys/stat.h>
+
 #include "algebra.hpp"
+#include "mapped_file.hpp"
+#include "mesh_optimize.hpp"
+#include "obj.hpp"
+#include "triangulate.hpp"
 #include "util.hpp"
 
 using namespace std;
@@ -57,167 +68,431 @@ has_intersection = true;
 return has_intersection;
 }*/
 
-struct VertexIndex {
-	int pos;
-	int texture;
-	int normal;
+// Interleaved layout uploaded to the vertex buffer, see RenderMesh
+struct MeshVertex {
+	float pos[3];
+	float normal[3];
+	float texture[2];
 };
 
-struct Face {
-	std::vector<VertexIndex> vertices;
-};
+#define VERTEX_TABLE_EMPTY 0xffffffffu
 
-struct TriIndex {
-	unsigned int i1, i2, i3;
+struct VertexTableSlot {
+	VertexIndex key;
+	unsigned int vertex;
 };
 
-struct MeshVertex {
-	Point3 pos;
-	Point2 texture;
-	Vector3 normal;
+inline
+unsigned int HashVertexIndex(const VertexIndex &index) {
+	// Distinct multipliers so the usual i/i/i triples don't cancel
+	uint64_t hash = static_cast<uint32_t>(index.pos) * 0x9e3779b97f4a7c15ULL ^
+		static_cast<uint32_t>(index.texture) * 0xbf58476d1ce4e5b9ULL ^
+		static_cast<uint32_t>(index.normal) * 0x94d049bb133111ebULL;
+	return static_cast<unsigned int>(hash >> 29 ^ hash);
+}
 
-	bool operator < (const MeshVertex &other) const {
-		return false; // TODO(orglofch):
+inline
+bool operator == (const VertexIndex &a, const VertexIndex &b) {
+	return a.pos == b.pos && a.texture == b.texture && a.normal == b.normal;
+}
+
+/** Returns the slot holding |key| or the empty slot it belongs in, the table size is a power of two. */
+inline
+unsigned int FindVertexSlot(const std::vector<VertexTableSlot> &table, const VertexIndex &key) {
+	unsigned int mask = table.size() - 1;
+	unsigned int slot = HashVertexIndex(key) & mask;
+	while (table[slot].vertex != VERTEX_TABLE_EMPTY && !(table[slot].key == key)) {
+		slot = (slot + 1) & mask;
 	}
-};
+	return slot;
+}
 
-void ExtractUniqueVertices(const std::vector<Point3> &positions,
-		const std::vector<Point2> &textures,
-		const std::vector<Vector3> &normals,
-		const std::vector<Face> &faces,
-		std::vector<MeshVertex> *vertices,
-		std::vector<int> *face_indices) {
-	std::set<MeshVertex> unique_vertices;
-	for (const Face &face : faces) {
-		for (const VertexIndex &index : face.vertices) {
-			/*MeshVertex mesh_vertex;
-			mesh_vertex.pos = positions.at(index.pos);
-			mesh_vertex.texture = textures.at(index.texture);
-			mesh_vertex.normal = normals.at(index.normal);
-			unique_vertices.insert(mesh_vertex);*/
+void ResizeVertexTable(unsigned int capacity, std::vector<VertexTableSlot> *table) {
+	VertexTableSlot empty;
+	empty.vertex = VERTEX_TABLE_EMPTY;
+	std::vector<VertexTableSlot> resized(capacity, empty);
+	for (const VertexTableSlot &slot : *table) {
+		if (slot.vertex != VERTEX_TABLE_EMPTY) {
+			resized[FindVertexSlot(resized, slot.key)] = slot;
 		}
 	}
+	table->swap(resized);
 }
 
-Mesh LoadMesh(const std::vector<Point3> &positions,
-		const std::vector<Point2> &textures,
-		const std::vector<Vector3> &normals,
-		const std::vector<Face> &faces) {
-	Mesh mesh;
-	mesh.face_count = faces.size();
+inline
+bool ValidIndex(int index, size_t count) {
+	return index >= 0 && index < static_cast<int>(count);
+}
 
-	unsigned int face_count = faces.size();
-	TriIndex *indices = new TriIndex[face_count];
-	for (unsigned int i = 0; i < face_count; ++i) {
-		const Face &face = faces.at(i);
+MeshVertex MakeMeshVertex(const OBJ &obj, const VertexIndex &index) {
+	MeshVertex vertex;
+	for (unsigned int i = 0; i < 3; ++i) {
+		vertex.pos[i] = obj.positions[index.pos].d[i];
+		vertex.normal[i] = index.normal >= 0 ? obj.normals[index.normal].d[i] : 0;
+	}
+	vertex.texture[0] = index.texture >= 0 ? obj.textures[index.texture].x : 0;
+	vertex.texture[1] = index.texture >= 0 ? obj.textures[index.texture].y : 0;
+	return vertex;
+}
 
-		indices[i].i1 = face.vertices.at(0).pos;
-		indices[i].i2 = face.vertices.at(1).pos;
-		indices[i].i3 = face.vertices.at(2).pos;
+/**
+ * Gives every distinct (position, texture, normal) triple referenced by the faces
+ * of |obj| one interleaved vertex and fans the faces into triangles over them.
+ * Triples are looked up in a linearly probed table kept at most half full, so
+ * this is linear in the corners. Faces referencing missing elements are skipped,
+ * vertices without a normal get the area weighted normal of the faces using them.
+ */
+void ExtractUniqueVertices(const OBJ &obj,
+		std::vector<MeshVertex> *vertices,
+		std::vector<TriIndex> *indices) {
+	// Most meshes have about one vertex per position, seams add a few more
+	unsigned int capacity = 16;
+	while (capacity < 2 * obj.positions.size()) {
+		capacity *= 2;
+	}
+	std::vector<VertexTableSlot> table;
+	ResizeVertexTable(capacity, &table);
+
+	vertices->clear();
+	indices->clear();
+	indices->reserve(obj.face_vertices.size());
+	bool missing_normals = false;
+	std::vector<unsigned int> corners;
+	for (unsigned int f = 0; f < OBJFaceCount(obj); ++f) {
+		const VertexIndex *face = OBJFace(obj, f);
+		unsigned int size = OBJFaceSize(obj, f);
+		bool valid = true;
+		for (unsigned int i = 0; i < size; ++i) {
+			valid = valid && ValidIndex(face[i].pos, obj.positions.size()) &&
+				(face[i].texture == -1 || ValidIndex(face[i].texture, obj.textures.size())) &&
+				(face[i].normal == -1 || ValidIndex(face[i].normal, obj.normals.size()));
+		}
+		if (!valid) {
+			continue;
+		}
+
+		corners.resize(size);
+		for (unsigned int i = 0; i < size; ++i) {
+			unsigned int slot = FindVertexSlot(table, face[i]);
+			if (table[slot].vertex == VERTEX_TABLE_EMPTY) {
+				if (2 * (vertices->size() + 1) > table.size()) {
+					ResizeVertexTable(2 * table.size(), &table);
+					slot = FindVertexSlot(table, face[i]);
+				}
+				table[slot].key = face[i];
+				table[slot].vertex = vertices->size();
+				vertices->push_back(MakeMeshVertex(obj, face[i]));
+				missing_normals = missing_normals || face[i].normal == -1;
+			}
+			corners[i] = table[slot].vertex;
+		}
+		for (unsigned int i = 1; i + 1 < size; ++i) {
+			TriIndex triangle;
+			triangle.i1 = corners[0];
+			triangle.i2 = corners[i];
+			triangle.i3 = corners[i + 1];
+			indices->push_back(triangle);
+		}
+	}
+
+	if (!missing_normals) {
+		return;
+	}
+	// Vertices without a normal share the key (pos, texture, -1) so summing over faces smooths them
+	std::vector<Vector3> normals(vertices->size(), Vector3(0, 0, 0));
+	for (const TriIndex &triangle : *indices) {
+		const MeshVertex &a = (*vertices)[triangle.i1];
+		const MeshVertex &b = (*vertices)[triangle.i2];
+		const MeshVertex &c = (*vertices)[triangle.i3];
+		Vector3 ab(b.pos[0] - a.pos[0], b.pos[1] - a.pos[1], b.pos[2] - a.pos[2]);
+		Vector3 ac(c.pos[0] - a.pos[0], c.pos[1] - a.pos[1], c.pos[2] - a.pos[2]);
+		Vector3 normal = ab.cross(ac);
+		normals[triangle.i1] += normal;
+		normals[triangle.i2] += normal;
+		normals[triangle.i3] += normal;
+	}
+	for (unsigned int i = 0; i < vertices->size(); ++i) {
+		MeshVertex &vertex = (*vertices)[i];
+		if (vertex.normal[0] != 0 || vertex.normal[1] != 0 || vertex.normal[2] != 0) {
+			continue;
+		}
+		if (normals[i].normalize() > 0) {
+			vertex.normal[0] = normals[i].x;
+			vertex.normal[1] = normals[i].y;
+			vertex.normal[2] = normals[i].z;
+		}
+	}
+}
+
+Mesh UploadMesh(const MeshVertex *vertices, unsigned int vertex_count,
+		const TriIndex *indices, unsigned int triangle_count,
+		const float bounds_min[3], const float bounds_max[3]) {
+	Mesh mesh;
+	mesh.face_count = triangle_count;
+	mesh.bounds_min = Point3(bounds_min[0], bounds_min[1], bounds_min[2]);
+	mesh.bounds_max = Point3(bounds_max[0], bounds_max[1], bounds_max[2]);
+	if (triangle_count == 0) {
+		return mesh;
 	}
 
 	glGenBuffers(1, &mesh.vertexVBO);
 	glBindBuffer(GL_ARRAY_BUFFER, mesh.vertexVBO);
-	glBufferData(GL_ARRAY_BUFFER, positions.size() * sizeof(Point3), &positions[0], GL_STATIC_DRAW);
+	glBufferData(GL_ARRAY_BUFFER, vertex_count * sizeof(MeshVertex), vertices, GL_STATIC_DRAW);
 
 	glGenBuffers(1, &mesh.indexVBO);
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.indexVBO);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, face_count*sizeof(TriIndex), indices, GL_STATIC_DRAW);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, triangle_count * sizeof(TriIndex), indices, GL_STATIC_DRAW);
 
 	return mesh;
 }
 
-// TODO(orglofch): Possibly remove or optimize instead of connecting last vertex to all other vertices
-void TriangulateFaces(const std::vector<Face> &faces, std::vector<Face> *triangulated_faces) {
-	/*for (const Face &face : faces) {
-		int vertices = face.size();
-		if (vertices > 3) {
-			int last_vertex = face.at(vertices - 1);
-			for (int i = 0; i < vertices - 2; ++i) {
-				Face triangle;
+void MeshVertexBounds(const std::vector<MeshVertex> &vertices, float bounds_min[3], float bounds_max[3]) {
+	for (unsigned int i = 0; i < 3; ++i) {
+		bounds_min[i] = vertices.empty() ? 0 : std::numeric_limits<float>::max();
+		bounds_max[i] = vertices.empty() ? 0 : -std::numeric_limits<float>::max();
+	}
+	for (const MeshVertex &vertex : vertices) {
+		for (unsigned int i = 0; i < 3; ++i) {
+			bounds_min[i] = std::min(bounds_min[i], vertex.pos[i]);
+			bounds_max[i] = std::max(bounds_max[i], vertex.pos[i]);
+		}
+	}
+}
 
-				triangle.push_back(face[i]);
-				triangle.push_back(face[i + 1]);
-				triangle.push_back(last_vertex);
+Mesh LoadMesh(const OBJ &obj) {
+	std::vector<MeshVertex> vertices;
+	std::vector<TriIndex> indices;
+	ExtractUniqueVertices(obj, &vertices, &indices);
+	OptimizeMesh(&indices, &vertices);
 
-				triangulated_faces->push_back(triangle);
-			}
+	float bounds_min[3], bounds_max[3];
+	MeshVertexBounds(vertices, bounds_min, bounds_max);
+	return UploadMesh(vertices.data(), vertices.size(), indices.data(), indices.size(), bounds_min, bounds_max);
+}
+
+Mesh LoadOBJ(const std::string &filename, unsigned int max_threads) {
+	OBJ obj;
+	if (!ReadOBJ(filename, &obj, max_threads)) {
+		// printf("Failed to open %s\n", filename.c_str());
+		return Mesh();
+	}
+	return LoadMesh(obj);
+}
+
+/**
+ * Mesh cache files hold the deduplicated and optimized vertex and index buffers exactly
+ * as they're uploaded, so loading is a mapping handed to glBufferData. The vertex layout is
+ * described in the header for tools, loading requires it to match MeshVertex.
+ * Files are keyed by the size and nanosecond modification time of the OBJ they were made from.
+ */
+#define MESH_CACHE_MAGIC 0x48534d43 // "CMSH"
+#define MESH_CACHE_VERSION 4
+#define MESH_CACHE_ALIGNMENT 64
+#define MESH_CACHE_MAX_ATTRIBUTES 4
+
+enum MeshAttribute {
+	MESH_ATTRIBUTE_POSITION,
+	MESH_ATTRIBUTE_NORMAL,
+	MESH_ATTRIBUTE_TEXTURE,
+};
+
+struct MeshCacheAttribute {
+	uint32_t semantic; // MeshAttribute
+	uint32_t components;
+	uint32_t type; // GL type of each component
+	uint32_t offset; // Bytes from the start of the vertex
+};
+
+struct MeshCacheHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t source_size;
+	int64_t source_time;
+	uint32_t vertex_stride;
+	uint32_t attribute_count;
+	MeshCacheAttribute attributes[MESH_CACHE_MAX_ATTRIBUTES];
+	uint32_t vertex_count;
+	uint32_t triangle_count;
+	float bounds_min[3];
+	float bounds_max[3];
+	uint64_t vertex_offset;
+	uint64_t index_offset;
+};
+
+inline
+uint64_t AlignMeshCache(uint64_t offset) {
+	return (offset + MESH_CACHE_ALIGNMENT - 1) / MESH_CACHE_ALIGNMENT * MESH_CACHE_ALIGNMENT;
+}
+
+inline
+bool MeshCacheSource(const std::string &filename, uint64_t *size, int64_t *time) {
+	struct stat info;
+	if (stat(filename.c_str(), &info) != 0) {
+		return false;
+	}
+	*size = info.st_size;
+	// Nanoseconds where the platform has them, seconds alone miss rewrites within the same second
+#if defined(__APPLE__)
+	*time = static_cast<int64_t>(info.st_mtimespec.tv_sec) * 1000000000 + info.st_mtimespec.tv_nsec;
+#elif defined(_WIN32)
+	*time = static_cast<int64_t>(info.st_mtime) * 1000000000;
+#else
+	*time = static_cast<int64_t>(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+#endif
+	return true;
+}
+
+/** Fills the layout and source fields of |header| for the current MeshVertex. */
+void InitMeshCacheHeader(uint64_t source_size, int64_t source_time, MeshCacheHeader *header) {
+	memset(header, 0, sizeof(*header));
+	header->magic = MESH_CACHE_MAGIC;
+	header->version = MESH_CACHE_VERSION;
+	header->source_size = source_size;
+	header->source_time = source_time;
+	header->vertex_stride = sizeof(MeshVertex);
+	header->attribute_count = 3;
+	MeshCacheAttribute attributes[3] = {
+		{ MESH_ATTRIBUTE_POSITION, 3, GL_FLOAT, offsetof(MeshVertex, pos) },
+		{ MESH_ATTRIBUTE_NORMAL, 3, GL_FLOAT, offsetof(MeshVertex, normal) },
+		{ MESH_ATTRIBUTE_TEXTURE, 2, GL_FLOAT, offsetof(MeshVertex, texture) },
+	};
+	memcpy(header->attributes, attributes, sizeof(attributes));
+}
+
+bool SaveMeshCache(const std::vector<MeshVertex> &vertices, const std::vector<TriIndex> &indices,
+		uint64_t source_size, int64_t source_time, const std::string &filename) {
+	if (!IsLittleEndian()) {
+		return false;
+	}
+
+	MeshCacheHeader header;
+	InitMeshCacheHeader(source_size, source_time, &header);
+	header.vertex_count = vertices.size();
+	header.triangle_count = indices.size();
+	MeshVertexBounds(vertices, header.bounds_min, header.bounds_max);
+	header.vertex_offset = AlignMeshCache(sizeof(header));
+	uint64_t vertex_end = header.vertex_offset + vertices.size() * sizeof(MeshVertex);
+	header.index_offset = AlignMeshCache(vertex_end);
+
+	// Write to a temporary of our own and rename so concurrent loaders never map a partial file
+	std::string temporary = TemporaryFilename(filename);
+	{
+		std::ofstream ofs(temporary, std::ios::binary);
+		if (!ofs.is_open()) {
+			std::remove(temporary.c_str());
+			return false;
 		}
-	}*/
-}
-
-Face ReadFace(std::istringstream &iss) {
-	Face face;
-	int pos, texture, normal;
-	while (iss >> pos) {
-		VertexIndex index;
-		index.pos = pos - 1;
-		if (iss.peek() == '/') {
-			iss >> texture;
-			index.texture = texture - 1;
-			if (iss.peek() == '/') {
-				iss >> normal;
-				index.normal = normal - 1;
-			}
+		const char padding[MESH_CACHE_ALIGNMENT] = {};
+		ofs.write(reinterpret_cast<const char *>(&header), sizeof(header));
+		ofs.write(padding, header.vertex_offset - sizeof(header));
+		if (!vertices.empty()) {
+			ofs.write(reinterpret_cast<const char *>(vertices.data()), vertices.size() * sizeof(MeshVertex));
+		}
+		ofs.write(padding, header.index_offset - vertex_end);
+		if (!indices.empty()) {
+			ofs.write(reinterpret_cast<const char *>(indices.data()), indices.size() * sizeof(TriIndex));
+		}
+		ofs.close();
+		if (!ofs.good()) {
+			std::remove(temporary.c_str());
+			return false;
 		}
-		face.vertices.push_back(index);
 	}
-	return face;
+	return ReplaceFileAtomic(temporary, filename);
 }
 
-Mesh LoadOBJ(const std::string &filename) {
-	std::vector<Point3> positions;
-	std::vector<Point2> textures;
-	std::vector<Vector3> normals;
-	std::vector<Face> faces;
+/** Checks every index addresses a vertex, so a corrupt cache can't make the GPU read out of bounds. */
+bool ValidMeshIndices(const TriIndex *indices, unsigned int triangle_count, unsigned int vertex_count) {
+	for (unsigned int i = 0; i < triangle_count; ++i) {
+		if (indices[i].i1 >= vertex_count || indices[i].i2 >= vertex_count || indices[i].i3 >= vertex_count) {
+			return false;
+		}
+	}
+	return true;
+}
 
-	std::ifstream ifs(filename);
-	if (!ifs.is_open()) {
-		// printf("Failed to open %s\n", filename.c_str());
+/**
+ * Maps the cache at |filename| and uploads its buffers straight from the mapping.
+ * Fails if the file is missing, malformed, has another vertex layout or was made
+ * from a different version of the source.
+ */
+bool LoadMeshCache(const std::string &filename, uint64_t source_size, int64_t source_time, Mesh *mesh) {
+	MappedFile file;
+	if (!IsLittleEndian() || !MapFile(filename, &file)) {
+		return false;
+	}
+
+	MeshCacheHeader expected;
+	InitMeshCacheHeader(source_size, source_time, &expected);
+	MeshCacheHeader header;
+	bool valid = file.size >= sizeof(header);
+	if (valid) {
+		memcpy(&header, file.data, sizeof(header));
+		valid = header.magic == expected.magic && header.version == expected.version &&
+			header.source_size == expected.source_size && header.source_time == expected.source_time &&
+			header.vertex_stride == expected.vertex_stride && header.attribute_count == expected.attribute_count &&
+			memcmp(header.attributes, expected.attributes, sizeof(header.attributes)) == 0 &&
+			header.vertex_offset % MESH_CACHE_ALIGNMENT == 0 && header.index_offset % MESH_CACHE_ALIGNMENT == 0 &&
+			header.vertex_offset <= file.size &&
+			header.vertex_count <= (file.size - header.vertex_offset) / sizeof(MeshVertex) &&
+			header.index_offset <= file.size &&
+			header.triangle_count <= (file.size - header.index_offset) / sizeof(TriIndex) &&
+			ValidMeshIndices(reinterpret_cast<const TriIndex *>(file.data + header.index_offset),
+				header.triangle_count, header.vertex_count);
+	}
+	if (valid) {
+		*mesh = UploadMesh(reinterpret_cast<const MeshVertex *>(file.data + header.vertex_offset), header.vertex_count,
+			reinterpret_cast<const TriIndex *>(file.data + header.index_offset), header.triangle_count,
+			header.bounds_min, header.bounds_max);
+	}
+	UnmapFile(&file);
+	return valid;
+}
+
+Mesh LoadOBJCached(const std::string &filename, const std::string &cache_filename, unsigned int max_threads) {
+	uint64_t source_size;
+	int64_t source_time;
+	if (!MeshCacheSource(filename, &source_size, &source_time)) {
 		return Mesh();
 	}
+	Mesh mesh;
+	if (LoadMeshCache(cache_filename, source_size, source_time, &mesh)) {
+		return mesh;
+	}
 
-	std::string lineHeader;
-	while (ifs >> lineHeader) {
-		if (lineHeader.compare("v") == 0) { // Vertex
-			Point3 vertex;
-			ifs >> vertex.x >> vertex.y >> vertex.z;
-			positions.push_back(vertex);
-		} else if (lineHeader.compare("vt") == 0) { // Texture
-			Point2 texture;
-			ifs >> texture.x >> texture.y;
-			textures.push_back(texture);
-		} else if (lineHeader.compare("vn") == 0) { // Normal
-			Vector3 normal;
-			ifs >> normal.x >> normal.y >> normal.z;
-			normals.push_back(normal);
-		} else if (lineHeader.compare("f") == 0) { // Face
-			char line[256];
-			ifs.getline(line, 256);
-			std::istringstream iss(line);
-			faces.push_back(ReadFace(iss));
-		}
+	OBJ obj;
+	if (!ReadOBJ(filename, &obj, max_threads)) {
+		return Mesh();
 	}
-	return LoadMesh(positions, textures, normals, faces);
+	std::vector<MeshVertex> vertices;
+	std::vector<TriIndex> indices;
+	ExtractUniqueVertices(obj, &vertices, &indices);
+	OptimizeMesh(&indices, &vertices);
+	SaveMeshCache(vertices, indices, source_size, source_time, cache_filename);
+
+	float bounds_min[3], bounds_max[3];
+	MeshVertexBounds(vertices, bounds_min, bounds_max);
+	return UploadMesh(vertices.data(), vertices.size(), indices.data(), indices.size(), bounds_min, bounds_max);
 }
 
 void RenderMesh(const Mesh &mesh) {
 	glEnableClientState(GL_VERTEX_ARRAY);
 	glBindBuffer(GL_ARRAY_BUFFER, mesh.vertexVBO);
-	glVertexPointer(3, GL_DOUBLE, sizeof(Point3), (char*)NULL + 0);
+	glVertexPointer(3, GL_FLOAT, sizeof(MeshVertex), (char*)NULL + offsetof(MeshVertex, pos));
 
 	glEnableClientState(GL_NORMAL_ARRAY);
-	glNormalPointer(GL_FLOAT, sizeof(Point3), (char*)NULL + 12);
+	glNormalPointer(GL_FLOAT, sizeof(MeshVertex), (char*)NULL + offsetof(MeshVertex, normal));
 	glClientActiveTexture(GL_TEXTURE0);
 
 	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
-	glTexCoordPointer(2, GL_FLOAT, sizeof(Point3), (char*)NULL + 24);
+	glTexCoordPointer(2, GL_FLOAT, sizeof(MeshVertex), (char*)NULL + offsetof(MeshVertex, texture));
 
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.indexVBO);
 	glDrawElements(GL_TRIANGLES, 3 * mesh.face_count, GL_UNSIGNED_INT, (char*)NULL + 0);
 
 	glDisableClientState(GL_VERTEX_ARRAY);
 	glDisableClientState(GL_NORMAL_ARRAY);
+	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
 
 	glBindTexture(GL_TEXTURE_2D, 0);
 }
\ No newline at end of file
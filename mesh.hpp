@@ -24,9 +24,13 @@
 #ifndef _MESH_HPP_
 #define _MESH_HPP_
 
+#include <iostream>
+#include <string>
+
+#include "algebra.hpp"
 #include "gl.hpp"
 
-// TODO(orglofch): Store vertices and faces so we can perform collision detection as well as rendering
+// GPU buffers only, collision runs on the CPU side MeshGeometry, see collision.hpp
 struct Mesh
 {
 	Mesh() : vertexVBO(0), indexVBO(0), face_count(0) {}
@@ -34,9 +38,19 @@ struct Mesh
 	GLuint vertexVBO;
 	GLuint indexVBO;
 	unsigned int face_count;
+	Point3 bounds_min;
+	Point3 bounds_max;
 };
 
-Mesh LoadOBJ(const std::string &filename);
+/** |max_threads| is passed on to ReadOBJ, 0 uses every hardware thread. */
+Mesh LoadOBJ(const std::string &filename, unsigned int max_threads = 0);
+
+/**
+ * Like LoadOBJ but keeps the deduplicated buffers in a binary cache at |cache_filename|,
+ * later loads upload them from a mapping of the cache without parsing |filename|.
+ * The cache is rewritten whenever |filename| changes size or modification time.
+ */
+Mesh LoadOBJCached(const std::string &filename, const std::string &cache_filename, unsigned int max_threads = 0);
 void RenderMesh(const Mesh &mesh);
 
 #endif
\ No newline at end of file
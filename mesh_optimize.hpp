@@ -0,0 +1,372 @@
+/*
+* Copyright (c) 2015 Owen Glofcheski
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+*    1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+*    2. Altered source versions must be plainly marked as such, and must not
+*    be misrepresented as being the original software.
+*
+*    3. This notice may not be removed or altered from any source
+*    distribution.
+*/
+
+
+#ifndef _MESH_OPTIMIZE_HPP_
+#define _MESH_OPTIMIZE_HPP_
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include "algebra.hpp"
+#include "triangulate.hpp"
+
+/**
+ * Index buffer reordering for the GPU, following Sander et al. "Fast Triangle Reordering
+ * for Vertex Locality and Reduced Overdraw". Triangles are ordered for the post-transform
+ * cache with Tipsify, the resulting clusters are sorted to draw occluders first and
+ * vertices are renumbered in first use order for the pre-transform fetch.
+ */
+#define MESH_VERTEX_CACHE_SIZE 16 // Post-transform FIFO entries assumed when ordering and reporting
+#define MESH_OVERDRAW_THRESHOLD 1.05 // Largest ACMR increase accepted to split clusters for overdraw
+
+/** Average cache miss ratio per triangle and per vertex, 0.5 to 3 and 1 upwards, lower is better. */
+struct VertexCacheStats
+{
+	VertexCacheStats() : acmr(0), atvr(0) {}
+
+	double acmr;
+	double atvr;
+};
+
+struct MeshOptimizeReport
+{
+	VertexCacheStats before;
+	VertexCacheStats after;
+};
+
+/** Small FIFO of vertex indices, timestamps make hits O(1). */
+struct VertexCacheFIFO
+{
+	VertexCacheFIFO(unsigned int vertex_count, unsigned int size) : size(size), time(size + 1),
+		timestamps(vertex_count, 0) {}
+
+	bool Touch(unsigned int vertex) {
+		if (time - timestamps[vertex] <= size) {
+			return false;
+		}
+		timestamps[vertex] = time++;
+		return true;
+	}
+
+	void Reset() {
+		time += size + 1;
+	}
+
+	unsigned int size;
+	unsigned int time;
+	std::vector<unsigned int> timestamps;
+};
+
+inline
+unsigned int TouchTriangle(const TriIndex &triangle, VertexCacheFIFO *cache) {
+	return cache->Touch(triangle.i1) + cache->Touch(triangle.i2) + cache->Touch(triangle.i3);
+}
+
+/** Simulates a FIFO post-transform cache of |cache_size| entries over |indices| in order. */
+inline
+VertexCacheStats AnalyzeVertexCache(const std::vector<TriIndex> &indices, unsigned int vertex_count,
+		unsigned int cache_size = MESH_VERTEX_CACHE_SIZE) {
+	VertexCacheStats stats;
+	if (indices.empty() || vertex_count == 0) {
+		return stats;
+	}
+	VertexCacheFIFO cache(vertex_count, cache_size);
+	unsigned int misses = 0;
+	for (const TriIndex &triangle : indices) {
+		misses += TouchTriangle(triangle, &cache);
+	}
+	stats.acmr = static_cast<double>(misses) / indices.size();
+	stats.atvr = static_cast<double>(misses) / vertex_count;
+	return stats;
+}
+
+/** Triangles using each vertex, triangles of vertex v are triangles[offsets[v]] up to triangles[offsets[v + 1]]. */
+struct VertexAdjacency
+{
+	std::vector<unsigned int> offsets;
+	std::vector<unsigned int> triangles;
+};
+
+inline
+void BuildVertexAdjacency(const std::vector<TriIndex> &indices, unsigned int vertex_count,
+		VertexAdjacency *adjacency) {
+	adjacency->offsets.assign(vertex_count + 1, 0);
+	for (const TriIndex &triangle : indices) {
+		++adjacency->offsets[triangle.i1 + 1];
+		++adjacency->offsets[triangle.i2 + 1];
+		++adjacency->offsets[triangle.i3 + 1];
+	}
+	for (unsigned int i = 0; i < vertex_count; ++i) {
+		adjacency->offsets[i + 1] += adjacency->offsets[i];
+	}
+	std::vector<unsigned int> next(adjacency->offsets.begin(), adjacency->offsets.end() - 1);
+	adjacency->triangles.resize(3 * indices.size());
+	for (unsigned int i = 0; i < indices.size(); ++i) {
+		adjacency->triangles[next[indices[i].i1]++] = i;
+		adjacency->triangles[next[indices[i].i2]++] = i;
+		adjacency->triangles[next[indices[i].i3]++] = i;
+	}
+}
+
+/**
+ * Picks the next fanning vertex among the vertices of the last triangles emitted: the one
+ * that will still be in the cache after its remaining triangles are emitted and has been
+ * there longest. When none would, falls back to the dead-end stack of recently used
+ * vertices and then to the input order, as in Sander et al. Sets *cache_break when the
+ * vertex picked has already left the cache.
+ */
+inline
+int TipsifyNextVertex(const std::vector<unsigned int> &candidates, const std::vector<unsigned int> &live,
+		const std::vector<unsigned int> &timestamps, unsigned int time, unsigned int cache_size,
+		std::vector<unsigned int> *dead_end, unsigned int *cursor, bool *cache_break) {
+	int best = -1;
+	unsigned int best_priority = 0;
+	for (unsigned int vertex : candidates) {
+		if (live[vertex] == 0 || time - timestamps[vertex] + 2 * live[vertex] > cache_size) {
+			continue;
+		}
+		unsigned int priority = time - timestamps[vertex];
+		if (priority > best_priority) {
+			best = vertex;
+			best_priority = priority;
+		}
+	}
+
+	while (best == -1 && !dead_end->empty()) {
+		unsigned int vertex = dead_end->back();
+		dead_end->pop_back();
+		if (live[vertex] > 0) {
+			best = vertex;
+		}
+	}
+	for (; best == -1 && *cursor < live.size(); ++*cursor) {
+		if (live[*cursor] > 0) {
+			best = *cursor;
+		}
+	}
+	*cache_break = best != -1 && time - timestamps[best] > cache_size;
+	return best;
+}
+
+/**
+ * Reorders |indices| for a post-transform cache of |cache_size| entries in linear time.
+ * The start of every cluster, where the order had to jump to a vertex no longer in
+ * the cache, is appended to |clusters| when given.
+ */
+inline
+void TipsifyIndices(unsigned int vertex_count, unsigned int cache_size, std::vector<TriIndex> *indices,
+		std::vector<unsigned int> *clusters = NULL) {
+	if (indices->empty()) {
+		return;
+	}
+	VertexAdjacency adjacency;
+	BuildVertexAdjacency(*indices, vertex_count, &adjacency);
+
+	std::vector<unsigned int> live(vertex_count);
+	for (unsigned int i = 0; i < vertex_count; ++i) {
+		live[i] = adjacency.offsets[i + 1] - adjacency.offsets[i];
+	}
+	std::vector<unsigned int> timestamps(vertex_count, 0);
+	std::vector<bool> emitted(indices->size(), false);
+	std::vector<unsigned int> dead_end;
+	std::vector<unsigned int> candidates;
+	std::vector<TriIndex> ordered;
+	ordered.reserve(indices->size());
+
+	unsigned int time = cache_size + 1;
+	unsigned int cursor = 0;
+	bool cache_break = true;
+	int fanning = TipsifyNextVertex(candidates, live, timestamps, time, cache_size, &dead_end, &cursor, &cache_break);
+	while (fanning >= 0) {
+		if (cache_break && clusters) {
+			clusters->push_back(ordered.size());
+		}
+		candidates.clear();
+		for (unsigned int i = adjacency.offsets[fanning]; i < adjacency.offsets[fanning + 1]; ++i) {
+			unsigned int t = adjacency.triangles[i];
+			if (emitted[t]) {
+				continue;
+			}
+			emitted[t] = true;
+			const TriIndex &triangle = (*indices)[t];
+			ordered.push_back(triangle);
+			unsigned int vertices[3] = { triangle.i1, triangle.i2, triangle.i3 };
+			for (unsigned int vertex : vertices) {
+				dead_end.push_back(vertex);
+				candidates.push_back(vertex);
+				--live[vertex];
+				if (time - timestamps[vertex] > cache_size) {
+					timestamps[vertex] = time++;
+				}
+			}
+		}
+		fanning = TipsifyNextVertex(candidates, live, timestamps, time, cache_size, &dead_end, &cursor, &cache_break);
+	}
+	indices->swap(ordered);
+}
+
+/**
+ * Splits the clusters starting at |clusters| further wherever the cache misses of the
+ * cluster so far stay within |threshold| times the ACMR of the whole order, so the
+ * extra cold starts cost at most that much.
+ */
+inline
+void SplitOverdrawClusters(const std::vector<TriIndex> &indices, unsigned int vertex_count,
+		unsigned int cache_size, double threshold, std::vector<unsigned int> *clusters) {
+	double limit = threshold * AnalyzeVertexCache(indices, vertex_count, cache_size).acmr;
+	VertexCacheFIFO cache(vertex_count, cache_size);
+	std::vector<unsigned int> split;
+	for (unsigned int c = 0; c < clusters->size(); ++c) {
+		unsigned int end = c + 1 < clusters->size() ? (*clusters)[c + 1] : indices.size();
+		unsigned int start = (*clusters)[c];
+		unsigned int misses = 0;
+		cache.Reset();
+		split.push_back(start);
+		for (unsigned int i = start; i < end; ++i) {
+			misses += TouchTriangle(indices[i], &cache);
+			if (i + 1 < end && misses <= limit * (i + 1 - start)) {
+				split.push_back(i + 1);
+				start = i + 1;
+				misses = 0;
+				cache.Reset();
+			}
+		}
+	}
+	clusters->swap(split);
+}
+
+/**
+ * Sorts the clusters of |indices| so those facing away from the centre of the mesh
+ * are drawn first, they're the likeliest to occlude the rest from any view.
+ * |positions| points at the first position, |stride| is in bytes between vertices.
+ */
+inline
+void SortOverdrawClusters(const float *positions, size_t stride, const std::vector<unsigned int> &clusters,
+		std::vector<TriIndex> *indices) {
+	const char *base = reinterpret_cast<const char *>(positions);
+	auto position = [&](unsigned int vertex) {
+		const float *p = reinterpret_cast<const float *>(base + vertex * stride);
+		return Point3(p[0], p[1], p[2]);
+	};
+
+	struct Cluster
+	{
+		unsigned int start, end;
+		Vector3 centroid; // Area weighted, relative to the origin
+		Vector3 normal;
+		double area;
+		double sort_key;
+	};
+	std::vector<Cluster> sorted(clusters.size());
+	Vector3 mesh_centroid(0, 0, 0);
+	double mesh_area = 0;
+	for (unsigned int c = 0; c < clusters.size(); ++c) {
+		Cluster &cluster = sorted[c];
+		cluster.start = clusters[c];
+		cluster.end = c + 1 < clusters.size() ? clusters[c + 1] : indices->size();
+		cluster.centroid = Vector3(0, 0, 0);
+		cluster.normal = Vector3(0, 0, 0);
+		cluster.area = 0;
+		for (unsigned int i = cluster.start; i < cluster.end; ++i) {
+			const TriIndex &triangle = (*indices)[i];
+			Point3 a = position(triangle.i1), b = position(triangle.i2), c = position(triangle.i3);
+			Vector3 normal = (b - a).cross(c - a);
+			double area = normal.length() * 0.5;
+			Vector3 centre((a.x + b.x + c.x) / 3, (a.y + b.y + c.y) / 3, (a.z + b.z + c.z) / 3);
+			cluster.centroid += centre * area;
+			cluster.normal += normal;
+			cluster.area += area;
+		}
+		mesh_centroid += cluster.centroid;
+		mesh_area += cluster.area;
+		if (cluster.area > 0) {
+			cluster.centroid = cluster.centroid * (1.0 / cluster.area);
+		}
+		cluster.normal.normalize();
+	}
+	if (mesh_area > 0) {
+		mesh_centroid = mesh_centroid * (1.0 / mesh_area);
+	}
+	for (Cluster &cluster : sorted) {
+		cluster.sort_key = (cluster.centroid - mesh_centroid).dot(cluster.normal);
+	}
+	std::stable_sort(sorted.begin(), sorted.end(), [](const Cluster &a, const Cluster &b) {
+		return a.sort_key > b.sort_key;
+	});
+
+	std::vector<TriIndex> ordered;
+	ordered.reserve(indices->size());
+	for (const Cluster &cluster : sorted) {
+		ordered.insert(ordered.end(), indices->begin() + cluster.start, indices->begin() + cluster.end);
+	}
+	indices->swap(ordered);
+}
+
+/** Renumbers vertices in the order |indices| first uses them and drops unused ones. */
+template <typename Vertex>
+void ReorderVertexFetch(std::vector<TriIndex> *indices, std::vector<Vertex> *vertices) {
+	const unsigned int unused = 0xffffffffu;
+	std::vector<unsigned int> remap(vertices->size(), unused);
+	std::vector<Vertex> ordered;
+	ordered.reserve(vertices->size());
+	auto fetch = [&](unsigned int *vertex) {
+		if (remap[*vertex] == unused) {
+			remap[*vertex] = ordered.size();
+			ordered.push_back((*vertices)[*vertex]);
+		}
+		*vertex = remap[*vertex];
+	};
+	for (TriIndex &triangle : *indices) {
+		fetch(&triangle.i1);
+		fetch(&triangle.i2);
+		fetch(&triangle.i3);
+	}
+	vertices->swap(ordered);
+}
+
+/**
+ * Runs every stage on an indexed mesh whose vertices start with three float positions.
+ * The cache statistics before and after are stored in |report| when given.
+ */
+template <typename Vertex>
+void OptimizeMesh(std::vector<TriIndex> *indices, std::vector<Vertex> *vertices,
+		MeshOptimizeReport *report = NULL) {
+	if (report) {
+		report->before = AnalyzeVertexCache(*indices, vertices->size());
+	}
+	if (!indices->empty()) {
+		std::vector<unsigned int> clusters;
+		TipsifyIndices(vertices->size(), MESH_VERTEX_CACHE_SIZE, indices, &clusters);
+		SplitOverdrawClusters(*indices, vertices->size(), MESH_VERTEX_CACHE_SIZE, MESH_OVERDRAW_THRESHOLD, &clusters);
+		SortOverdrawClusters(reinterpret_cast<const float *>(vertices->data()), sizeof(Vertex), clusters, indices);
+		ReorderVertexFetch(indices, vertices);
+	}
+	if (report) {
+		report->after = AnalyzeVertexCache(*indices, vertices->size());
+	}
+}
+
+#endif
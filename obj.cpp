@@ -0,0 +1,349 @@
+#include "obj.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include <sys/stat.h>
+
+#include "mapped_file.hpp"
+#include "parallel.hpp"
+
+#define OBJ_PARALLEL_BYTES (4 << 20) // Smaller files are parsed on the calling thread
+#define OBJ_CHUNKS_PER_THREAD 4
+
+// Chunks don't know how many elements precede them so relative indices are parsed
+// against this bias and rebased when merging, positive indices must stay below half of it
+#define OBJ_RELATIVE_INDEX_BIAS (1 << 30)
+#define OBJ_MAX_INDEX (OBJ_RELATIVE_INDEX_BIAS / 2 - 1)
+
+static const double kPowersOf10[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+inline
+bool IsSpace(char c) {
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+inline
+const char *SkipSpace(const char *p, const char *end) {
+	while (p < end && IsSpace(*p)) {
+		++p;
+	}
+	return p;
+}
+
+inline
+bool IsDigit(char c) {
+	return static_cast<unsigned char>(c - '0') < 10;
+}
+
+/**
+ * Parses a decimal float at |p|. Up to 19 digits with a mantissa below 2^53 and a
+ * power of ten within 10^22 are converted exactly by a single multiply or divide,
+ * the rare remaining cases (long mantissas, huge exponents, inf, nan) go through strtod.
+ */
+const char *ParseDouble(const char *p, const char *end, double *value) {
+	const char *start = p;
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+')) {
+		negative = *p == '-';
+		++p;
+	}
+
+	// Digits past 19 overflow the mantissa, those numbers are caught by the digit count
+	uint64_t mantissa = 0;
+	const char *digits_start = p;
+	for (; p < end && IsDigit(*p); ++p) {
+		mantissa = mantissa * 10 + (*p - '0');
+	}
+	int digits = p - digits_start;
+	int exponent = 0;
+	if (p < end && *p == '.') {
+		const char *fraction_start = ++p;
+		for (; p < end && IsDigit(*p); ++p) {
+			mantissa = mantissa * 10 + (*p - '0');
+		}
+		exponent = fraction_start - p;
+		digits -= exponent;
+	}
+	if (digits > 0 && p < end && (*p == 'e' || *p == 'E')) {
+		const char *q = p + 1;
+		bool negative_exponent = false;
+		if (q < end && (*q == '-' || *q == '+')) {
+			negative_exponent = *q == '-';
+			++q;
+		}
+		if (q < end && IsDigit(*q)) {
+			int e = 0;
+			for (; q < end && IsDigit(*q); ++q) {
+				e = std::min(e * 10 + (*q - '0'), 100000);
+			}
+			exponent += negative_exponent ? -e : e;
+			p = q;
+		}
+	}
+
+	if (digits > 0 && digits <= 19 && mantissa <= (1ull << 53) && exponent >= -22 && exponent <= 22) {
+		double result = static_cast<double>(mantissa);
+		result = exponent < 0 ? result / kPowersOf10[-exponent] : result * kPowersOf10[exponent];
+		*value = negative ? -result : result;
+		return p;
+	}
+
+	// strtod needs a terminated string and the mapping isn't
+	char buffer[128];
+	const char *token_end = start;
+	while (token_end < end && !IsSpace(*token_end) && *token_end != '\n' && *token_end != '/' &&
+			token_end - start < static_cast<ptrdiff_t>(sizeof(buffer)) - 1) {
+		++token_end;
+	}
+	memcpy(buffer, start, token_end - start);
+	buffer[token_end - start] = '\0';
+	char *parsed_end;
+	*value = strtod(buffer, &parsed_end);
+	return start + (parsed_end - buffer);
+}
+
+/**
+ * Parses an OBJ index, 1 based or negative relative to |count| elements so far, as a 0 based index.
+ * Indices past OBJ_MAX_INDEX in either direction are read as -1 like an empty slot.
+ */
+const char *ParseIndex(const char *p, const char *end, int count, int *index) {
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+')) {
+		negative = *p == '-';
+		++p;
+	}
+	const char *digits_start = p;
+	int64_t value = 0;
+	for (; p < end && IsDigit(*p); ++p) {
+		// Stops growing once out of range so it can't overflow, the remaining digits are still consumed
+		if (value <= OBJ_MAX_INDEX) {
+			value = value * 10 + (*p - '0');
+		}
+	}
+	if (p == digits_start) {
+		return NULL;
+	}
+	if (value > OBJ_MAX_INDEX) {
+		*index = -1;
+	} else {
+		*index = negative ? count - static_cast<int>(value) : static_cast<int>(value) - 1;
+	}
+	return p;
+}
+
+/**
+ * Parses the corners of a face line, v, v/t, v//n or v/t/n. Like the stream reader this
+ * replaced, parsing stops at the first token that isn't a corner (e.g. a trailing comment)
+ * keeping the corners so far and empty texture or normal slots (1/ or 1//) are left at -1.
+ * Faces with fewer than three corners are dropped.
+ */
+void ParseFace(const char *p, const char *end, int relative_base, OBJ *obj) {
+	unsigned int first = obj->face_vertices.size();
+	int position_count = relative_base + obj->positions.size();
+	int texture_count = relative_base + obj->textures.size();
+	int normal_count = relative_base + obj->normals.size();
+	for (p = SkipSpace(p, end); p < end; p = SkipSpace(p, end)) {
+		VertexIndex index;
+		const char *next = ParseIndex(p, end, position_count, &index.pos);
+		if (!next) {
+			break;
+		}
+		p = next;
+		if (p < end && *p == '/') {
+			++p;
+			next = ParseIndex(p, end, texture_count, &index.texture);
+			p = next ? next : p;
+			if (p < end && *p == '/') {
+				++p;
+				next = ParseIndex(p, end, normal_count, &index.normal);
+				p = next ? next : p;
+			}
+		}
+		obj->face_vertices.push_back(index);
+		if (p < end && !IsSpace(*p)) {
+			break;
+		}
+	}
+	if (obj->face_vertices.size() - first < 3) {
+		obj->face_vertices.resize(first);
+		return;
+	}
+	obj->face_offsets.push_back(obj->face_vertices.size());
+}
+
+const char *ParseDoubles(const char *p, const char *end, unsigned int count, double *values) {
+	for (unsigned int i = 0; i < count; ++i) {
+		p = ParseDouble(SkipSpace(p, end), end, &values[i]);
+	}
+	return p;
+}
+
+/**
+ * Parses the OBJ statements in [p, end), which must start at a line. Relative indices
+ * resolve to |relative_base| plus the element they refer to in |obj|.
+ */
+void ParseOBJ(const char *p, const char *end, int relative_base, OBJ *obj) {
+	while (p < end) {
+		const char *eol = static_cast<const char *>(memchr(p, '\n', end - p));
+		if (!eol) {
+			eol = end;
+		}
+		const char *line = SkipSpace(p, eol);
+		p = eol + 1;
+		// Every statement read is a one or two letter keyword followed by a space
+		ptrdiff_t keyword = line + 1 < eol && !IsSpace(line[1]) ? 2 : 1;
+		if (eol - line <= keyword || !IsSpace(line[keyword])) {
+			continue;
+		}
+
+		if (line[0] == 'v') {
+			if (IsSpace(line[1])) { // Vertex
+				Point3 vertex;
+				ParseDoubles(line + 1, eol, 3, vertex.d);
+				obj->positions.push_back(vertex);
+			} else if (line[1] == 't') { // Texture
+				Point2 texture;
+				double uv[2] = { 0, 0 };
+				ParseDoubles(line + 2, eol, 2, uv);
+				texture.x = uv[0];
+				texture.y = uv[1];
+				obj->textures.push_back(texture);
+			} else if (line[1] == 'n') { // Normal
+				Vector3 normal;
+				ParseDoubles(line + 2, eol, 3, normal.d);
+				obj->normals.push_back(normal);
+			}
+		} else if (line[0] == 'f') { // Face
+			ParseFace(line + 1, eol, relative_base, obj);
+		}
+	}
+}
+
+/**
+ * Reserves |obj| for the statements in [p, end), counted by their first letters.
+ * This is a fraction of the cost of parsing and saves regrowing the arrays.
+ */
+void ReserveOBJ(const char *p, const char *end, OBJ *obj) {
+	size_t positions = 0, textures = 0, normals = 0, faces = 0;
+	while (p < end) {
+		const char *eol = static_cast<const char *>(memchr(p, '\n', end - p));
+		if (!eol) {
+			eol = end;
+		}
+		if (eol - p >= 2) {
+			if (p[0] == 'v') {
+				positions += p[1] == ' ';
+				textures += p[1] == 't';
+				normals += p[1] == 'n';
+			} else {
+				faces += p[0] == 'f';
+			}
+		}
+		p = eol + 1;
+	}
+	obj->positions.reserve(obj->positions.size() + positions);
+	obj->textures.reserve(obj->textures.size() + textures);
+	obj->normals.reserve(obj->normals.size() + normals);
+	obj->face_vertices.reserve(obj->face_vertices.size() + 3 * faces);
+	obj->face_offsets.reserve(obj->face_offsets.size() + faces);
+}
+
+/** Returns the start of the first line at or after |p|. */
+const char *NextLineStart(const char *begin, const char *p, const char *end) {
+	if (p == begin || p[-1] == '\n') {
+		return p;
+	}
+	const char *eol = static_cast<const char *>(memchr(p, '\n', end - p));
+	return eol ? eol + 1 : end;
+}
+
+inline
+int RebaseIndex(int index, int base) {
+	return index >= OBJ_RELATIVE_INDEX_BIAS / 2 ? index - OBJ_RELATIVE_INDEX_BIAS + base : index;
+}
+
+/**
+ * Splits [begin, end) into chunks at line boundaries and parses them in parallel,
+ * then appends them to |obj| in file order. Element counts are prefix summed so
+ * every chunk knows where its elements land and relative indices can be rebased.
+ */
+void ParseOBJChunks(const char *begin, const char *end, unsigned int max_threads, OBJ *obj) {
+	unsigned int thread_count = max_threads == 0 ? ThreadCount() : max_threads;
+	unsigned int chunk_count = thread_count * OBJ_CHUNKS_PER_THREAD;
+	std::vector<const char *> bounds(chunk_count + 1);
+	for (unsigned int i = 0; i < chunk_count; ++i) {
+		bounds[i] = NextLineStart(begin, begin + (end - begin) * i / chunk_count, end);
+	}
+	bounds[chunk_count] = end;
+
+	std::vector<OBJ> chunks(chunk_count);
+	ParallelFor(0, chunk_count, [&](unsigned int i) {
+		// Chunks are empty when a line is longer than them
+		ReserveOBJ(bounds[i], bounds[i + 1], &chunks[i]);
+		ParseOBJ(bounds[i], bounds[i + 1], OBJ_RELATIVE_INDEX_BIAS, &chunks[i]);
+	}, max_threads);
+
+	// The first entry of each is where the chunk starts in the merged arrays
+	std::vector<size_t> positions(chunk_count + 1, obj->positions.size());
+	std::vector<size_t> textures(chunk_count + 1, obj->textures.size());
+	std::vector<size_t> normals(chunk_count + 1, obj->normals.size());
+	std::vector<size_t> face_vertices(chunk_count + 1, obj->face_vertices.size());
+	std::vector<size_t> faces(chunk_count + 1, OBJFaceCount(*obj));
+	for (unsigned int i = 0; i < chunk_count; ++i) {
+		positions[i + 1] = positions[i] + chunks[i].positions.size();
+		textures[i + 1] = textures[i] + chunks[i].textures.size();
+		normals[i + 1] = normals[i] + chunks[i].normals.size();
+		face_vertices[i + 1] = face_vertices[i] + chunks[i].face_vertices.size();
+		faces[i + 1] = faces[i] + OBJFaceCount(chunks[i]);
+	}
+	obj->positions.resize(positions[chunk_count]);
+	obj->textures.resize(textures[chunk_count]);
+	obj->normals.resize(normals[chunk_count]);
+	obj->face_vertices.resize(face_vertices[chunk_count]);
+	obj->face_offsets.resize(faces[chunk_count] + 1);
+
+	ParallelFor(0, chunk_count, [&](unsigned int i) {
+		const OBJ &chunk = chunks[i];
+		std::copy(chunk.positions.begin(), chunk.positions.end(), obj->positions.begin() + positions[i]);
+		std::copy(chunk.textures.begin(), chunk.textures.end(), obj->textures.begin() + textures[i]);
+		std::copy(chunk.normals.begin(), chunk.normals.end(), obj->normals.begin() + normals[i]);
+		for (size_t j = 0; j < chunk.face_vertices.size(); ++j) {
+			VertexIndex index = chunk.face_vertices[j];
+			index.pos = RebaseIndex(index.pos, positions[i]);
+			index.texture = RebaseIndex(index.texture, textures[i]);
+			index.normal = RebaseIndex(index.normal, normals[i]);
+			obj->face_vertices[face_vertices[i] + j] = index;
+		}
+		for (size_t j = 1; j < chunk.face_offsets.size(); ++j) {
+			obj->face_offsets[faces[i] + j] = face_vertices[i] + chunk.face_offsets[j];
+		}
+	}, max_threads);
+}
+
+bool ReadOBJ(const std::string &filename, OBJ *obj, unsigned int max_threads) {
+	// Empty files can't be mapped but are valid, empty OBJs
+	struct stat info;
+	if (stat(filename.c_str(), &info) == 0 && info.st_size == 0) {
+		return true;
+	}
+
+	MappedFile file;
+	if (!MapFile(filename, &file)) {
+		return false;
+	}
+	const char *end = file.data + file.size;
+	if (max_threads != 1 && file.size >= OBJ_PARALLEL_BYTES) {
+		ParseOBJChunks(file.data, end, max_threads, obj);
+	} else {
+		ReserveOBJ(file.data, end, obj);
+		ParseOBJ(file.data, end, 0, obj);
+	}
+	UnmapFile(&file);
+	return true;
+}
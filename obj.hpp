@@ -0,0 +1,83 @@
+/*
+* Copyright (c) 2015 Owen Glofcheski
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+*    1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+*    2. Altered source versions must be plainly marked as such, and must not
+*    be misrepresented as being the original software.
+*
+*    3. This notice may not be removed or altered from any source
+*    distribution.
+*/
+
+
+#ifndef _OBJ_HPP_
+#define _OBJ_HPP_
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "algebra.hpp"
+
+// Indices are zero based, -1 when the face doesn't reference the attribute
+struct VertexIndex {
+	VertexIndex() : pos(-1), texture(-1), normal(-1) {}
+
+	int pos;
+	int texture;
+	int normal;
+};
+
+/**
+ * Raw contents of an OBJ file, independent of GL so offline tools can use it.
+ * Faces are stored back to back so reading doesn't allocate per face, face i has
+ * the corners face_vertices[face_offsets[i]] up to face_vertices[face_offsets[i + 1]].
+ */
+struct OBJ
+{
+	OBJ() : face_offsets(1, 0) {}
+
+	std::vector<Point3> positions;
+	std::vector<Point2> textures;
+	std::vector<Vector3> normals;
+	std::vector<VertexIndex> face_vertices;
+	std::vector<unsigned int> face_offsets; // One more than the number of faces
+};
+
+inline
+unsigned int OBJFaceCount(const OBJ &obj) {
+	return obj.face_offsets.size() - 1;
+}
+
+inline
+unsigned int OBJFaceSize(const OBJ &obj, unsigned int face) {
+	return obj.face_offsets[face + 1] - obj.face_offsets[face];
+}
+
+inline
+const VertexIndex *OBJFace(const OBJ &obj, unsigned int face) {
+	return &obj.face_vertices[obj.face_offsets[face]];
+}
+
+/**
+ * Parse |filename| from a memory mapping, lines are found with memchr and numbers
+ * parsed in place so nothing is allocated per line. Negative indices count back
+ * from the latest element and are resolved to absolute ones. Indices aren't checked.
+ * Large files are split into chunks parsed on up to |max_threads| threads (0 uses
+ * every hardware thread), the result is the same as parsing on one.
+ */
+bool ReadOBJ(const std::string &filename, OBJ *obj, unsigned int max_threads = 0);
+
+#endif
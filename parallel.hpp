@@ -0,0 +1,188 @@
+/*
+* Copyright (c) 2015 Owen Glofcheski
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+*    1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+*    2. Altered source versions must be plainly marked as such, and must not
+*    be misrepresented as being the original software.
+*
+*    3. This notice may not be removed or altered from any source
+*    distribution.
+*/
+
+#ifndef _PARALLEL_HPP_
+#define _PARALLEL_HPP_
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+inline
+unsigned int ThreadCount() {
+	return std::max(1u, std::thread::hardware_concurrency());
+}
+
+/**
+ * Call func(i) for every i in [begin, end) across up to |max_threads| threads
+ * (0 uses every hardware thread), the calling thread takes part and this blocks
+ * until all iterations complete. Iterations are handed out dynamically so uneven
+ * work balances itself.
+ */
+template <typename F>
+void ParallelFor(unsigned int begin, unsigned int end, const F &func, unsigned int max_threads = 0) {
+	if (begin >= end) {
+		return;
+	}
+	unsigned int thread_count = std::min(end - begin, max_threads == 0 ? ThreadCount() : max_threads);
+	if (thread_count <= 1) {
+		for (unsigned int i = begin; i < end; ++i) {
+			func(i);
+		}
+		return;
+	}
+
+	std::atomic<unsigned int> next(begin);
+	auto worker = [&]() {
+		for (unsigned int i = next++; i < end; i = next++) {
+			func(i);
+		}
+	};
+
+	std::vector<std::thread> threads;
+	threads.reserve(thread_count - 1);
+	for (unsigned int i = 0; i < thread_count - 1; ++i) {
+		threads.push_back(std::thread(worker));
+	}
+	worker();
+	for (std::thread &thread : threads) {
+		thread.join();
+	}
+}
+
+/**
+ * Threads kept alive between ParallelFor calls, for callers that run every frame
+ * and can't afford to spawn threads or allocate. The calling thread takes part in
+ * each job so a pool of |thread_count| starts one fewer thread (0 uses every
+ * hardware thread). One job runs at a time, a pool must not be shared by threads
+ * that call ParallelFor concurrently.
+ */
+struct WorkerPool
+{
+	explicit WorkerPool(unsigned int thread_count = 0);
+	~WorkerPool();
+
+	std::mutex mutex;
+	std::condition_variable start;
+	std::condition_variable done;
+	std::vector<std::thread> threads;
+	void (*call)(const void *func, unsigned int i); // Current job, valid while busy > 0
+	const void *func;
+	std::atomic<unsigned int> next;
+	unsigned int end;
+	unsigned int generation; // Bumped for every job
+	unsigned int busy; // Workers yet to finish the current job
+	bool stop;
+
+private:
+	WorkerPool(const WorkerPool &);
+	WorkerPool &operator = (const WorkerPool &);
+};
+
+template <typename F>
+void CallWorkerPoolFunc(const void *func, unsigned int i) {
+	(*static_cast<const F *>(func))(i);
+}
+
+inline
+void RunWorkerPoolJob(WorkerPool *pool) {
+	for (unsigned int i = pool->next++; i < pool->end; i = pool->next++) {
+		pool->call(pool->func, i);
+	}
+}
+
+inline
+void RunWorkerPool(WorkerPool *pool) {
+	unsigned int generation = 0;
+	std::unique_lock<std::mutex> lock(pool->mutex);
+	for (;;) {
+		pool->start.wait(lock, [&]() { return pool->stop || pool->generation != generation; });
+		if (pool->stop) {
+			return;
+		}
+		generation = pool->generation;
+		lock.unlock();
+		RunWorkerPoolJob(pool);
+		lock.lock();
+		if (--pool->busy == 0) {
+			pool->done.notify_one();
+		}
+	}
+}
+
+inline
+WorkerPool::WorkerPool(unsigned int thread_count)
+	: call(NULL), func(NULL), next(0), end(0), generation(0), busy(0), stop(false) {
+	thread_count = thread_count == 0 ? ThreadCount() : thread_count;
+	threads.reserve(thread_count - 1);
+	for (unsigned int i = 0; i < thread_count - 1; ++i) {
+		threads.push_back(std::thread(RunWorkerPool, this));
+	}
+}
+
+inline
+WorkerPool::~WorkerPool() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stop = true;
+	}
+	start.notify_all();
+	for (std::thread &thread : threads) {
+		thread.join();
+	}
+}
+
+/** ParallelFor on the threads of |pool|, doesn't allocate. */
+template <typename F>
+void ParallelFor(unsigned int begin, unsigned int end, const F &func, WorkerPool *pool) {
+	if (begin >= end) {
+		return;
+	}
+	if (pool->threads.empty() || end - begin == 1) {
+		for (unsigned int i = begin; i < end; ++i) {
+			func(i);
+		}
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(pool->mutex);
+		pool->call = CallWorkerPoolFunc<F>;
+		pool->func = &func;
+		pool->next = begin;
+		pool->end = end;
+		pool->busy = pool->threads.size();
+		++pool->generation;
+	}
+	pool->start.notify_all();
+	RunWorkerPoolJob(pool);
+
+	// Workers may still be calling func, which lives on this stack
+	std::unique_lock<std::mutex> lock(pool->mutex);
+	pool->done.wait(lock, [&]() { return pool->busy == 0; });
+}
+
+#endif
@@ -24,12 +24,14 @@
 #ifndef _PRIMITIVE_HPP_
 #define _PRIMITIVE_HPP_
 
+#include <algorithm>
 #include <iostream>
 #include <limits>
 #include <vector>
 
 #include "algebra.hpp"
 #include "colour.hpp"
+#include "stats.hpp"
 
 struct Material
 {
@@ -38,6 +40,7 @@ struct Material
 	Colour diffuse;
 	Colour specular;
 	float shininess;
+	Colour emission; // Emitted radiance, emissive primitives are sampled as lights
 };
 
 struct Intersection
@@ -57,10 +60,56 @@ struct Ray
 	Vector3 dir;
 };
 
-Point3 RayProjection(const Ray &ray, float t) {
+inline
+Point3 RayProjection(const Ray &ray, double t) {
 	return ray.origin + t * (ray.dir);
 }
 
+// Precision of the ray-primitive kernels, define RAY_FLOAT for single precision.
+// Scenes stay in double, the kernels convert on entry, and the double path
+// remains available as the reference through the kernel templates.
+#ifdef RAY_FLOAT
+typedef float RayScalar;
+#else
+typedef double RayScalar;
+#endif
+
+#define RAY_ORIGIN_OFFSET_ULPS 64
+
+/**
+ * Move a spawned ray's origin off the surface at |pos| along |normal|, which must
+ * face the side the ray leaves through. The offset scales with the magnitude of
+ * |pos| in units of the kernel precision so secondary rays clear their own
+ * surface in either kernel mode.
+ */
+inline
+Point3 OffsetRayOrigin(const Point3 &pos, const Vector3 &normal) {
+	const double scale = RAY_ORIGIN_OFFSET_ULPS * std::numeric_limits<RayScalar>::epsilon();
+	Point3 origin;
+	for (int i = 0; i < 3; ++i) {
+		origin[i] = pos[i] + normal[i] * scale * std::max(std::abs(pos[i]), 1.0);
+	}
+	return origin;
+}
+
+template <typename T>
+void KernelCross(const T a[3], const T b[3], T out[3]) {
+	out[0] = a[1] * b[2] - a[2] * b[1];
+	out[1] = a[2] * b[0] - a[0] * b[2];
+	out[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+template <typename T>
+T KernelDot(const T a[3], const T b[3]) {
+	return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+/** The largest finite T no greater than |t|, so unbounded double distances survive the conversion. */
+template <typename T>
+T KernelDistance(double t) {
+	return static_cast<T>(std::min(t, static_cast<double>(std::numeric_limits<T>::max())));
+}
+
 struct Plane
 {
 	Point3 point;
@@ -69,10 +118,28 @@ struct Plane
 
 inline
 bool PlaneIntersect(const Plane &plane, const Ray &ray, Intersection *intersection) {
-	float denom = plane.normal.dot(ray.dir);
+	STAT_INC(STAT_PLANE_TESTS);
+	double denom = plane.normal.dot(ray.dir);
 	if (denom > EPSILON) {
 		intersection->t = plane.normal.dot(plane.point - ray.origin) / denom;
 		if (intersection->t > EPSILON) {
+			STAT_INC(STAT_PLANE_HITS);
+			return true;
+		}
+	}
+	return false;
+}
+
+// The *Occluded variants answer any-hit queries in (EPSILON, tmax) for shadow rays,
+// they exit on the first hit and compute no hit attributes.
+inline
+bool PlaneOccluded(const Plane &plane, const Ray &ray, double tmax) {
+	STAT_INC(STAT_PLANE_TESTS);
+	double denom = plane.normal.dot(ray.dir);
+	if (denom > EPSILON) {
+		double t = plane.normal.dot(plane.point - ray.origin) / denom;
+		if (t > EPSILON && t < tmax) {
+			STAT_INC(STAT_PLANE_HITS);
 			return true;
 		}
 	}
@@ -96,51 +163,62 @@ struct Sphere : Primitive
 	double radius;
 };
 
+/**
+ * Nearest root of the ray and sphere in (EPSILON, tmax) computed in precision T,
+ * falling back to the far root when the origin is inside.
+ */
+template <typename T>
+bool SphereKernel(const Sphere &sphere, const Ray &ray, T tmax, T *t) {
+	T origin[3], dir[3];
+	for (int i = 0; i < 3; ++i) {
+		origin[i] = static_cast<T>(ray.origin[i] - sphere.pos[i]);
+		dir[i] = static_cast<T>(ray.dir[i]);
+	}
+	T A = KernelDot(dir, dir);
+	T B = KernelDot(dir, origin);
+	T C = KernelDot(origin, origin) - static_cast<T>(sphere.radius * sphere.radius);
+
+	// Half-B form of the discriminant, computed once
+	T disc = B * B - A * C;
+	if (disc < 0 || A == 0) {
+		return false;
+	}
+
+	T root = std::sqrt(disc);
+	T t_hit = (-B - root) / A;
+	if (t_hit <= static_cast<T>(EPSILON)) {
+		t_hit = (-B + root) / A;
+	}
+	if (t_hit > static_cast<T>(EPSILON) && t_hit < tmax) {
+		*t = t_hit;
+		return true;
+	}
+	return false;
+}
+
 inline
 bool SphereIntersect(const Sphere &sphere, const Ray &ray, Intersection *intersection) {
-	double A = ray.dir.dot(ray.dir);
-	Vector3 origin = ray.origin - sphere.pos;
-	double B = 2 * (ray.dir.dot(origin));
-	double C = origin.dot(origin) - sphere.radius * sphere.radius;
-
-	float disc = B*B - 4 * A * C;
-	if (disc < 0) {
+	STAT_INC(STAT_SPHERE_TESTS);
+	RayScalar t;
+	if (!SphereKernel(sphere, ray, std::numeric_limits<RayScalar>::max(), &t)) {
 		return false;
 	}
+	intersection->pos = RayProjection(ray, t);
+	intersection->normal = intersection->pos - sphere.pos;
+	intersection->normal.normalize();
+	intersection->t = t;
+	intersection->material = sphere.material;
+	STAT_INC(STAT_SPHERE_HITS);
+	return true;
+}
 
-	double roots[2];
-	unsigned int num_roots = quadraticRoots(A, B, C, roots);
-
-	if (num_roots == 1) {
-		intersection->pos = RayProjection(ray, roots[0]);
-		intersection->normal = intersection->pos - sphere.pos;
-		intersection->normal.normalize();
-		intersection->t = roots[0];
-		intersection->material = sphere.material;
-	} else if (num_roots == 2) {
-		if (roots[0] > roots[1]) {
-			double tmp = roots[0];
-			roots[0] = roots[1];
-			roots[1] = tmp;
-		}
-		if (roots[1] < EPSILON) {
-			return false;
-		}
-		if (roots[0] < 0 && roots[1] > EPSILON) {
-			intersection->pos = RayProjection(ray, roots[1]);
-			intersection->normal = intersection->pos - sphere.pos;
-			intersection->normal.normalize();
-			intersection->t = roots[1];
-			intersection->material = sphere.material;
-			return true;
-		} else if (roots[0] > EPSILON) {
-			intersection->pos = RayProjection(ray, roots[0]);
-			intersection->normal = intersection->pos - sphere.pos;
-			intersection->normal.normalize();
-			intersection->t = roots[0];
-			intersection->material = sphere.material;
-			return true;
-		}
+inline
+bool SphereOccluded(const Sphere &sphere, const Ray &ray, double tmax) {
+	STAT_INC(STAT_SPHERE_TESTS);
+	RayScalar t;
+	if (SphereKernel(sphere, ray, KernelDistance<RayScalar>(tmax), &t)) {
+		STAT_INC(STAT_SPHERE_HITS);
+		return true;
 	}
 	return false;
 }
@@ -169,63 +247,81 @@ struct Triangle
 	Point3 vertices[3];
 };
 
-inline
-void TriangulatePolygons(const std::vector<Polygon> &polygons, std::vector<Triangle> *triangles) { // TODO(orglofch): Possibly optimize instead of connecting last vertex to all other vertices
-	for (const Polygon &polygon : polygons) {
-		int vertex_count = polygons.size();
-		Point3 last_vertex = polygon.vertices[vertex_count - 1];
-		for (int i = 0; i < vertex_count - 2; ++i) {
-			Triangle triangle;
-
-			triangle.vertices[0] = polygon.vertices[i];
-			triangle.vertices[1] = polygon.vertices[i + 1];
-			triangle.vertices[2] = last_vertex;
-
-			triangles->push_back(triangle);
-		}
+/** Moller-Trumbore in precision T, finds a hit in (EPSILON, tmax) and writes its distance to *t. */
+template <typename T>
+bool TriangleKernel(const Triangle &triangle, const Ray &ray, T tmax, T *t) {
+	T edge_1[3], edge_2[3], origin[3], dir[3];
+	for (int i = 0; i < 3; ++i) {
+		double vertex_0 = triangle.vertices[0][i];
+		edge_1[i] = static_cast<T>(triangle.vertices[1][i] - vertex_0);
+		edge_2[i] = static_cast<T>(triangle.vertices[2][i] - vertex_0);
+		origin[i] = static_cast<T>(ray.origin[i] - vertex_0);
+		dir[i] = static_cast<T>(ray.dir[i]);
 	}
-}
 
-inline
-bool TriangleIntersect(const Triangle &triangle, const Ray &ray, Intersection *intersection) {
-	Point3 vertex_0 = triangle.vertices[0];
+	T P[3];
+	KernelCross(dir, edge_2, P);
+	T det = KernelDot(edge_1, P);
+	if (det > -static_cast<T>(EPSILON) && det < static_cast<T>(EPSILON)) {
+		return false;
+	}
+	T inv_det = 1 / det;
 
-	Vector3 edge_1 = triangle.vertices[1] - vertex_0;
-	Vector3 edge_2 = triangle.vertices[2] - vertex_0;
+	T u = KernelDot(origin, P) * inv_det;
+	if (u < 0 || u > 1) {
+		return false;
+	}
 
-	Vector3 P = ray.dir.cross(edge_2);
-	double det = edge_1.dot(P);
-	if (det > -EPSILON && det < EPSILON) {
+	T Q[3];
+	KernelCross(origin, edge_1, Q);
+	T v = KernelDot(dir, Q) * inv_det;
+	if (v < 0 || u + v > 1) {
 		return false;
 	}
-	double inv_det = 1.0f / det;
 
-	Vector3 T = ray.origin - vertex_0;
+	T t_hit = KernelDot(edge_2, Q) * inv_det;
+	if (t_hit > static_cast<T>(EPSILON) && t_hit < tmax) {
+		*t = t_hit;
+		return true;
+	}
+	return false;
+}
 
-	double u = T.dot(P) * inv_det;
-	if (u < 0.0f || u > 1.0f) {
+inline
+bool TriangleIntersect(const Triangle &triangle, const Ray &ray, Intersection *intersection) {
+	STAT_INC(STAT_TRIANGLE_TESTS);
+	RayScalar t;
+	if (!TriangleKernel(triangle, ray, KernelDistance<RayScalar>(intersection->t), &t)) {
 		return false;
 	}
 
-	Vector3 Q = T.cross(edge_1);
+	// Hit attributes stay in double, they are only computed for hits
+	Vector3 normal = (triangle.vertices[1] - triangle.vertices[0]).cross(triangle.vertices[2] - triangle.vertices[0]);
+	intersection->pos = RayProjection(ray, t);
+	intersection->normal = normal.dot(ray.dir) < 0 ? normal : -1 * normal;
+	intersection->normal.normalize();
+	intersection->t = t;
+	// TODO(orglofch): intersection->material = mesh.material;
+	STAT_INC(STAT_TRIANGLE_HITS);
+	return true;
+}
 
-	double v = ray.dir.dot(Q) * inv_det;
-	if (v < 0.0f || u + v > 1.0f) {
+/** Distance only closest hit, shrinks *t when the triangle is hit in (EPSILON, *t). */
+inline
+bool TriangleIntersectDistance(const Triangle &triangle, const Ray &ray, double *t) {
+	STAT_INC(STAT_TRIANGLE_TESTS);
+	RayScalar t_hit;
+	if (!TriangleKernel(triangle, ray, KernelDistance<RayScalar>(*t), &t_hit)) {
 		return false;
 	}
+	*t = t_hit;
+	STAT_INC(STAT_TRIANGLE_HITS);
+	return true;
+}
 
-	double t = edge_2.dot(Q) * inv_det;
-	if (t > EPSILON && t < intersection->t) {
-		Point3 point = RayProjection(ray, t);
-		Vector3 normal = edge_1.cross(edge_2);
-		intersection->pos = point;
-		intersection->normal = normal.dot(ray.dir) < 0 ? normal : -1 * normal;
-		intersection->normal.normalize();
-		intersection->t = t;
-		// TODO(orglofch): intersection->material = mesh.material;
-		return true;
-	}
-	return false;
+inline
+bool TriangleOccluded(const Triangle &triangle, const Ray &ray, double tmax) {
+	return TriangleIntersectDistance(triangle, ray, &tmax);
 }
 
 #endif
\ No newline at end of file
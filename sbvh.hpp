@@ -0,0 +1,347 @@
+/*
+* Copyright (c) 2015 Owen Glofcheski
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+*    1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+*    2. Altered source versions must be plainly marked as such, and must not
+*    be misrepresented as being the original software.
+*
+*    3. This notice may not be removed or altered from any source
+*    distribution.
+*/
+
+
+#ifndef _SBVH_HPP_
+#define _SBVH_HPP_
+
+#include <algorithm>
+#include <iostream>
+#include <limits>
+#include <vector>
+
+#include "bvh.hpp"
+
+/**
+ * Spatial split BVH (Stich et al. 2009) for triangles. Besides object splits a node may be split
+ * by a plane that clips the triangles crossing it, each side referencing the clipped part, which
+ * removes most of the overlap long thin triangles cause. A triangle can then appear in several
+ * leaves, the result is an ordinary BVH whose indices repeat.
+ */
+struct SBVHSettings
+{
+	SBVHSettings() : memory_budget(1.5), overlap_threshold(1e-5) {}
+
+	double memory_budget; // Maximum number of references as a multiple of the triangle count
+	double overlap_threshold; // Spatial splits are only tried where children overlap by this fraction of the root area
+};
+
+struct SBVHReference
+{
+	BoundingBox bounds; // Bounds of the part of the triangle this reference covers
+	unsigned int index;
+};
+
+/** Splits |reference| at |position| on |axis| into the bounds of the triangle's parts on either side. */
+inline
+void SplitSBVHReference(const Triangle &triangle, const SBVHReference &reference, int axis, double position,
+		SBVHReference *left, SBVHReference *right) {
+	left->index = right->index = reference.index;
+	left->bounds = BoundingBox();
+	right->bounds = BoundingBox();
+	for (int i = 0; i < 3; ++i) {
+		const Point3 &v0 = triangle.vertices[i];
+		const Point3 &v1 = triangle.vertices[(i + 1) % 3];
+		double p0 = v0[axis];
+		double p1 = v1[axis];
+		if (p0 <= position) {
+			left->bounds.extend(v0);
+		}
+		if (p0 >= position) {
+			right->bounds.extend(v0);
+		}
+		if ((p0 < position && p1 > position) || (p0 > position && p1 < position)) {
+			Point3 crossing = v0 + ((position - p0) / (p1 - p0)) * (v1 - v0);
+			crossing[axis] = position;
+			left->bounds.extend(crossing);
+			right->bounds.extend(crossing);
+		}
+	}
+
+	// The reference may already be clipped, stay within it
+	for (int i = 0; i < 3; ++i) {
+		left->bounds.min[i] = std::max(left->bounds.min[i], reference.bounds.min[i]);
+		left->bounds.max[i] = std::min(left->bounds.max[i], reference.bounds.max[i]);
+		right->bounds.min[i] = std::max(right->bounds.min[i], reference.bounds.min[i]);
+		right->bounds.max[i] = std::min(right->bounds.max[i], reference.bounds.max[i]);
+	}
+	left->bounds.max[axis] = std::min(left->bounds.max[axis], position);
+	right->bounds.min[axis] = std::max(right->bounds.min[axis], position);
+}
+
+struct SBVHBuilder
+{
+	BVHSettings settings;
+	SBVHSettings split_settings;
+	double root_area;
+	unsigned int remaining_references; // Spatial splits stop once the budget is spent
+};
+
+template <typename Triangles>
+void BuildSBVHNode(const Triangles &triangles, std::vector<SBVHReference> &references,
+		unsigned int node_index, unsigned int depth, SBVHBuilder *builder, BVH *bvh) {
+	const BVHSettings &settings = builder->settings;
+	const unsigned int count = references.size();
+
+	BoundingBox node_bounds;
+	BoundingBox centroid_bounds;
+	for (const SBVHReference &reference : references) {
+		node_bounds.extend(reference.bounds);
+		centroid_bounds.extend(reference.bounds.center());
+	}
+	bvh->nodes[node_index].bounds = node_bounds;
+
+	int best_axis = -1;
+	unsigned int best_split = 0;
+	bool best_spatial = false;
+	double best_cost = count > settings.max_leaf_size ?
+		std::numeric_limits<double>::max() : settings.intersection_cost * count;
+	unsigned int bin_count = std::max(2u, std::min(settings.bin_count, static_cast<unsigned int>(BVH_MAX_BINS)));
+	double inv_area = 1.0 / std::max(node_bounds.area(), std::numeric_limits<double>::min());
+
+	if (count > 1 && depth < BVH_MAX_SAH_DEPTH) {
+		BoundingBox bin_bounds[BVH_MAX_BINS];
+		unsigned int entries[BVH_MAX_BINS];
+		unsigned int exits[BVH_MAX_BINS];
+		double right_areas[BVH_MAX_BINS];
+		unsigned int right_counts[BVH_MAX_BINS];
+
+		// Object splits, binned on centroids as in BuildBVHNode
+		BoundingBox best_left;
+		BoundingBox best_right;
+		for (int axis = 0; axis < 3; ++axis) {
+			double extent = centroid_bounds.max[axis] - centroid_bounds.min[axis];
+			if (extent <= 0) {
+				continue;
+			}
+			std::fill(bin_bounds, bin_bounds + bin_count, BoundingBox());
+			std::fill(entries, entries + bin_count, 0);
+			double scale = bin_count / extent;
+			for (const SBVHReference &reference : references) {
+				unsigned int bin = std::min(bin_count - 1,
+					static_cast<unsigned int>((reference.bounds.center()[axis] - centroid_bounds.min[axis]) * scale));
+				bin_bounds[bin].extend(reference.bounds);
+				++entries[bin];
+			}
+
+			BoundingBox right;
+			unsigned int right_count = 0;
+			BoundingBox right_bounds[BVH_MAX_BINS];
+			for (unsigned int bin = bin_count - 1; bin > 0; --bin) {
+				right.extend(bin_bounds[bin]);
+				right_count += entries[bin];
+				right_bounds[bin] = right;
+				right_counts[bin] = right_count;
+			}
+
+			BoundingBox left;
+			unsigned int left_count = 0;
+			for (unsigned int split = 1; split < bin_count; ++split) {
+				left.extend(bin_bounds[split - 1]);
+				left_count += entries[split - 1];
+				if (left_count == 0 || right_counts[split] == 0) {
+					continue;
+				}
+				double cost = settings.traversal_cost + settings.intersection_cost * inv_area *
+					(left.area() * left_count + right_bounds[split].area() * right_counts[split]);
+				if (cost < best_cost) {
+					best_cost = cost;
+					best_axis = axis;
+					best_split = split;
+					best_left = left;
+					best_right = right_bounds[split];
+				}
+			}
+		}
+
+		// Spatial splits, only worth trying where the best object split leaves a large overlap
+		BoundingBox overlap;
+		for (int i = 0; i < 3; ++i) {
+			overlap.min[i] = std::max(best_left.min[i], best_right.min[i]);
+			overlap.max[i] = std::min(best_left.max[i], best_right.max[i]);
+		}
+		bool try_spatial = builder->remaining_references > 0 &&
+			(best_axis < 0 || overlap.area() > builder->split_settings.overlap_threshold * builder->root_area);
+		for (int axis = 0; try_spatial && axis < 3; ++axis) {
+			double extent = node_bounds.max[axis] - node_bounds.min[axis];
+			if (extent <= 0) {
+				continue;
+			}
+			std::fill(bin_bounds, bin_bounds + bin_count, BoundingBox());
+			std::fill(entries, entries + bin_count, 0);
+			std::fill(exits, exits + bin_count, 0);
+			double bin_size = extent / bin_count;
+			double scale = bin_count / extent;
+			for (const SBVHReference &reference : references) {
+				unsigned int first_bin = std::min(bin_count - 1,
+					static_cast<unsigned int>(std::max(0.0, (reference.bounds.min[axis] - node_bounds.min[axis]) * scale)));
+				unsigned int last_bin = std::min(bin_count - 1,
+					static_cast<unsigned int>(std::max(0.0, (reference.bounds.max[axis] - node_bounds.min[axis]) * scale)));
+				last_bin = std::max(first_bin, last_bin);
+
+				// Chop the reference at every bin boundary it crosses
+				SBVHReference remainder = reference;
+				for (unsigned int bin = first_bin; bin < last_bin; ++bin) {
+					SBVHReference left_part, right_part;
+					SplitSBVHReference(triangles[reference.index], remainder, axis,
+						node_bounds.min[axis] + bin_size * (bin + 1), &left_part, &right_part);
+					bin_bounds[bin].extend(left_part.bounds);
+					remainder = right_part;
+				}
+				bin_bounds[last_bin].extend(remainder.bounds);
+				++entries[first_bin];
+				++exits[last_bin];
+			}
+
+			BoundingBox right;
+			unsigned int right_count = 0;
+			for (unsigned int bin = bin_count - 1; bin > 0; --bin) {
+				right.extend(bin_bounds[bin]);
+				right_count += exits[bin];
+				right_areas[bin] = right.area();
+				right_counts[bin] = right_count;
+			}
+
+			BoundingBox left;
+			unsigned int left_count = 0;
+			for (unsigned int split = 1; split < bin_count; ++split) {
+				left.extend(bin_bounds[split - 1]);
+				left_count += entries[split - 1];
+				if (left_count == 0 || right_counts[split] == 0 ||
+						left_count + right_counts[split] - count > builder->remaining_references) {
+					continue;
+				}
+				double cost = settings.traversal_cost + settings.intersection_cost * inv_area *
+					(left.area() * left_count + right_areas[split] * right_counts[split]);
+				if (cost < best_cost) {
+					best_cost = cost;
+					best_axis = axis;
+					best_split = split;
+					best_spatial = true;
+				}
+			}
+		}
+	}
+
+	std::vector<SBVHReference> left_references;
+	std::vector<SBVHReference> right_references;
+	if (best_axis >= 0 && best_spatial) {
+		double position = node_bounds.min[best_axis] +
+			(node_bounds.max[best_axis] - node_bounds.min[best_axis]) * best_split / bin_count;
+		for (const SBVHReference &reference : references) {
+			if (reference.bounds.max[best_axis] <= position) {
+				left_references.push_back(reference);
+			} else if (reference.bounds.min[best_axis] >= position) {
+				right_references.push_back(reference);
+			} else {
+				SBVHReference left_part, right_part;
+				SplitSBVHReference(triangles[reference.index], reference, best_axis, position, &left_part, &right_part);
+				// A triangle only touching the plane clips to nothing on that side
+				if (!left_part.bounds.empty()) {
+					left_references.push_back(left_part);
+				}
+				if (!right_part.bounds.empty()) {
+					right_references.push_back(right_part);
+				}
+			}
+		}
+	} else if (best_axis >= 0) {
+		double extent = centroid_bounds.max[best_axis] - centroid_bounds.min[best_axis];
+		double scale = bin_count / extent;
+		for (const SBVHReference &reference : references) {
+			unsigned int bin = std::min(bin_count - 1,
+				static_cast<unsigned int>((reference.bounds.center()[best_axis] - centroid_bounds.min[best_axis]) * scale));
+			(bin < best_split ? left_references : right_references).push_back(reference);
+		}
+	}
+
+	// A spatial split leaves a side empty when its triangles only touch the plane, fall back
+	// to a median split as BuildBVHNode does rather than exceed the leaf size
+	if ((left_references.empty() || right_references.empty()) && count > settings.max_leaf_size) {
+		left_references.clear();
+		right_references.clear();
+		int axis = centroid_bounds.longestAxis();
+		std::nth_element(references.begin(), references.begin() + count / 2, references.end(),
+			[&](const SBVHReference &a, const SBVHReference &b) {
+				return a.bounds.center()[axis] < b.bounds.center()[axis];
+			});
+		left_references.assign(references.begin(), references.begin() + count / 2);
+		right_references.assign(references.begin() + count / 2, references.end());
+	}
+
+	if (left_references.empty() || right_references.empty()) {
+		bvh->nodes[node_index].offset = bvh->indices.size();
+		bvh->nodes[node_index].count = count;
+		for (const SBVHReference &reference : references) {
+			bvh->indices.push_back(reference.index);
+		}
+		return;
+	}
+
+	unsigned int added = left_references.size() + right_references.size() - count;
+	builder->remaining_references -= std::min(added, builder->remaining_references);
+	std::vector<SBVHReference>().swap(references); // Free this level before descending
+	unsigned int left_index = bvh->nodes.size();
+	bvh->nodes.resize(left_index + 2);
+	bvh->nodes[node_index].offset = left_index;
+	bvh->nodes[node_index].count = 0;
+	BuildSBVHNode(triangles, left_references, left_index, depth + 1, builder, bvh);
+	BuildSBVHNode(triangles, right_references, left_index + 1, depth + 1, builder, bvh);
+}
+
+/**
+ * Build |bvh| over |triangles| with spatial splits. Leaves may repeat a triangle so
+ * bvh->indices can be up to split_settings.memory_budget times the triangle count.
+ * Refitting keeps the whole triangle bounds in the leaves, conservative but no longer tight.
+ */
+template <typename Triangles>
+void BuildSBVH(const Triangles &triangles, const BVHSettings &settings, const SBVHSettings &split_settings, BVH *bvh) {
+	bvh->settings = settings;
+	bvh->nodes.clear();
+	bvh->indices.clear();
+	if (triangles.size() == 0) {
+		return;
+	}
+
+	std::vector<SBVHReference> references(triangles.size());
+	BoundingBox bounds;
+	for (unsigned int i = 0; i < triangles.size(); ++i) {
+		references[i].bounds = PrimitiveBounds(triangles[i]);
+		references[i].index = i;
+		bounds.extend(references[i].bounds);
+	}
+
+	SBVHBuilder builder;
+	builder.settings = settings;
+	builder.split_settings = split_settings;
+	builder.root_area = bounds.area();
+	builder.remaining_references = static_cast<unsigned int>(
+		std::max(0.0, split_settings.memory_budget - 1) * triangles.size());
+
+	bvh->indices.reserve(triangles.size() + builder.remaining_references);
+	bvh->nodes.reserve(2 * (triangles.size() + builder.remaining_references));
+	bvh->nodes.resize(1);
+	BuildSBVHNode(triangles, references, 0, 0, &builder, bvh);
+}
+
+#endif
@@ -0,0 +1,353 @@
+/*
+* Copyright (c) 2015 Owen Glofcheski
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+*    1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+*    2. Altered source versions must be plainly marked as such, and must not
+*    be misrepresented as being the original software.
+*
+*    3. This notice may not be removed or altered from any source
+*    distribution.
+*/
+
+
+#ifndef _SCENE_HPP_
+#define _SCENE_HPP_
+
+#include <iostream>
+#include <limits>
+#include <vector>
+
+#include "algebra.hpp"
+#include "buffer.hpp"
+#include "bvh.hpp"
+#include "colour.hpp"
+#include "light_bvh.hpp"
+#include "primitive.hpp"
+#include "sphere_set.hpp"
+#include "stats.hpp"
+#include "triangle_set.hpp"
+#include "wide_bvh.hpp"
+
+struct PointLight
+{
+	Point3 pos;
+	Colour colour;
+};
+
+/**
+ * Renderable scene, primitives reference materials by id so hits can be
+ * passed around as compact (t, primitive) records. Primitive ids number the
+ * spheres first, in set order, followed by the triangles.
+ */
+struct Scene
+{
+	std::vector<Material> materials;
+
+	SphereSet spheres; // Material ids index Scene::materials
+	Buffer<Triangle> triangles;
+	Buffer<unsigned int> triangle_materials;
+	BVH triangle_bvh;
+	WideBVH triangle_wide_bvh; // Collapsed from triangle_bvh, used for traversal
+#ifdef RAY_FLOAT
+	TriangleSet triangle_set; // Triangles in triangle_bvh.indices order for the float leaf kernel
+#endif
+
+	std::vector<PointLight> lights;
+	LightBVH light_bvh; // Over the primitives with emissive materials
+};
+
+/** Gather the emissive primitives into the light hierarchy, emissive triangles emit from their front face. */
+inline
+void BuildSceneLights(Scene *scene) {
+	LightBVH &bvh = scene->light_bvh;
+	bvh.lights.clear();
+
+	const SphereSet &spheres = scene->spheres;
+	for (unsigned int i = 0; i < spheres.count; ++i) {
+		float luminance = Luminance(scene->materials[spheres.material_ids[i]].emission);
+		if (luminance <= 0) {
+			continue;
+		}
+		EmissiveLight light;
+		light.primitive = i;
+		light.power = luminance * 4 * PI * spheres.radius[i] * spheres.radius[i];
+		Vector3 radius(spheres.radius[i], spheres.radius[i], spheres.radius[i]);
+		Point3 center(spheres.x[i], spheres.y[i], spheres.z[i]);
+		light.bounds = BoundingBox(center - radius, center + radius);
+		light.cone = LightCone(Vector3(0, 0, 1), PI);
+		bvh.lights.push_back(light);
+	}
+
+	for (unsigned int i = 0; i < scene->triangles.size(); ++i) {
+		float luminance = Luminance(scene->materials[scene->triangle_materials[i]].emission);
+		if (luminance <= 0) {
+			continue;
+		}
+		const Triangle &triangle = scene->triangles[i];
+		Vector3 edge_1 = triangle.vertices[1] - triangle.vertices[0];
+		Vector3 edge_2 = triangle.vertices[2] - triangle.vertices[0];
+		Vector3 normal = edge_1.cross(edge_2);
+		// Degenerate triangles have no usable normal to orient their cone and never get sampled
+		double length = normal.length();
+		if (!(length > std::numeric_limits<double>::epsilon() * edge_1.length() * edge_2.length())) {
+			continue;
+		}
+		normal /= length;
+		double area = 0.5 * length;
+		EmissiveLight light;
+		light.primitive = spheres.count + i;
+		light.power = luminance * area;
+		light.bounds = PrimitiveBounds(triangle);
+		light.cone = LightCone(normal, 0);
+		bvh.lights.push_back(light);
+	}
+	BuildLightBVH(&bvh);
+}
+
+inline
+void BuildScene(Scene *scene) {
+	BuildSphereSet(&scene->spheres);
+	BVHSettings settings;
+#ifdef RAY_FLOAT
+	// As for spheres, a leaf costs about the same to test whether it holds one triangle or a full batch
+	settings.max_leaf_size = TRIANGLE_SET_WIDTH;
+	settings.intersection_cost = 1.0 / TRIANGLE_SET_WIDTH;
+#endif
+	BuildBVH(scene->triangles, settings, &scene->triangle_bvh);
+	BuildWideBVH(scene->triangle_bvh, &scene->triangle_wide_bvh);
+#ifdef RAY_FLOAT
+	BuildTriangleSet(scene->triangles, scene->triangle_bvh.indices, &scene->triangle_set);
+#endif
+	BuildSceneLights(scene);
+}
+
+inline
+unsigned int ScenePrimitiveCount(const Scene &scene) {
+	return scene.spheres.count + scene.triangles.size();
+}
+
+inline
+BoundingBox SceneBounds(const Scene &scene) {
+	BoundingBox bounds;
+	if (!scene.spheres.bvh.nodes.empty()) {
+		bounds.extend(scene.spheres.bvh.nodes[0].bounds);
+	}
+	if (!scene.triangle_bvh.nodes.empty()) {
+		bounds.extend(scene.triangle_bvh.nodes[0].bounds);
+	}
+	return bounds;
+}
+
+/**
+ * Closest hit distance and primitive id only, *t must be initialized and bounds the search.
+ * visit(node) is called with every sphere and triangle hierarchy node the traversal fetches.
+ */
+template <typename VisitFunc>
+bool SceneIntersect(const Scene &scene, const Ray &ray, double *t, unsigned int *primitive,
+		const VisitFunc &visit) {
+	STAT_INC(STAT_RAYS);
+	const WideBVH &spheres = scene.spheres.wide_bvh;
+	bool has_intersection = SphereSetIntersect(scene.spheres, ray, t, primitive, [&](unsigned int node) {
+		visit(spheres.nodes[node]);
+	});
+
+	const WideBVH &bvh = scene.triangle_wide_bvh;
+#ifdef RAY_FLOAT
+	TriangleSetRay set_ray(ray);
+	if (WideBVHTraverse(bvh, ray, t, [&](unsigned int offset, unsigned int count) {
+			float t_hit = KernelDistance<float>(*t);
+			int hit = TriangleSetIntersect(scene.triangle_set, offset, count, set_ray, &t_hit);
+			if (hit < 0) {
+				return false;
+			}
+			*t = t_hit;
+			*primitive = scene.spheres.count + bvh.indices[offset + hit];
+			return true;
+		}, [&](unsigned int node) {
+			visit(bvh.nodes[node]);
+		})) {
+#else
+	if (WideBVHTraverse(bvh, ray, t, [&](unsigned int offset, unsigned int count) {
+			bool hit = false;
+			for (unsigned int i = offset; i < offset + count; ++i) {
+				if (TriangleIntersectDistance(scene.triangles[bvh.indices[i]], ray, t)) {
+					*primitive = scene.spheres.count + bvh.indices[i];
+					hit = true;
+				}
+			}
+			return hit;
+		}, [&](unsigned int node) {
+			visit(bvh.nodes[node]);
+		})) {
+#endif
+		has_intersection = true;
+	}
+	if (has_intersection) {
+		STAT_INC(STAT_RAY_HITS);
+	}
+	return has_intersection;
+}
+
+inline
+bool SceneIntersect(const Scene &scene, const Ray &ray, double *t, unsigned int *primitive) {
+	return SceneIntersect(scene, ray, t, primitive, [](const WideBVHNode &) {});
+}
+
+inline
+bool SceneOccluded(const Scene &scene, const Ray &ray, double tmax) {
+	STAT_INC(STAT_SHADOW_RAYS);
+#ifdef RAY_FLOAT
+	TriangleSetRay set_ray(ray);
+	if (SphereSetOccluded(scene.spheres, ray, tmax) ||
+			WideBVHTraverseAny(scene.triangle_wide_bvh, ray, tmax, [&](unsigned int offset, unsigned int count) {
+				float t_hit = KernelDistance<float>(tmax);
+				return TriangleSetIntersect(scene.triangle_set, offset, count, set_ray, &t_hit) >= 0;
+			})) {
+#else
+	if (SphereSetOccluded(scene.spheres, ray, tmax) ||
+			WideBVHOccluded(scene.triangle_wide_bvh, scene.triangles, ray, tmax)) {
+#endif
+		STAT_INC(STAT_SHADOW_RAY_HITS);
+		return true;
+	}
+	return false;
+}
+
+inline
+unsigned int SceneMaterialId(const Scene &scene, unsigned int primitive) {
+	if (primitive < scene.spheres.count) {
+		return scene.spheres.material_ids[primitive];
+	}
+	return scene.triangle_materials[primitive - scene.spheres.count];
+}
+
+/** Whether a ray along |dir| hits the emitting side of |primitive|, the outside of spheres and the front of triangles. */
+inline
+bool SceneFrontFacing(const Scene &scene, unsigned int primitive, const Point3 &pos, const Vector3 &dir) {
+	Vector3 normal;
+	if (primitive < scene.spheres.count) {
+		const SphereSet &spheres = scene.spheres;
+		normal = pos - Point3(spheres.x[primitive], spheres.y[primitive], spheres.z[primitive]);
+	} else {
+		const Triangle &triangle = scene.triangles[primitive - scene.spheres.count];
+		normal = (triangle.vertices[1] - triangle.vertices[0]).cross(triangle.vertices[2] - triangle.vertices[0]);
+	}
+	return normal.dot(dir) < 0;
+}
+
+/** Unit normal at |pos| on |primitive|, triangles face against |dir| as in TriangleIntersect. */
+inline
+Vector3 SceneNormal(const Scene &scene, unsigned int primitive, const Point3 &pos, const Vector3 &dir) {
+	Vector3 normal;
+	if (primitive < scene.spheres.count) {
+		const SphereSet &spheres = scene.spheres;
+		normal = pos - Point3(spheres.x[primitive], spheres.y[primitive], spheres.z[primitive]);
+	} else {
+		const Triangle &triangle = scene.triangles[primitive - scene.spheres.count];
+		normal = (triangle.vertices[1] - triangle.vertices[0]).cross(triangle.vertices[2] - triangle.vertices[0]);
+		if (normal.dot(dir) > 0) {
+			normal = -normal;
+		}
+	}
+	normal.normalize();
+	return normal;
+}
+
+/** Direction and distance to a point on an emitter, |pdf| is per unit solid angle and includes choosing the emitter. */
+struct LightSample
+{
+	Vector3 dir;
+	double distance;
+	double pdf;
+	Colour emission;
+};
+
+/**
+ * Importance sample one emissive primitive for the shading point at |pos| through the
+ * light hierarchy, then a point on it: uniformly within the cone a sphere subtends,
+ * or uniformly by area on a triangle. |u| holds three numbers in [0, 1).
+ */
+inline
+bool SampleSceneLight(const Scene &scene, const Point3 &pos, const Vector3 &normal, const float u[3],
+		LightSample *sample) {
+	unsigned int light;
+	double pmf;
+	if (!SampleLightBVH(scene.light_bvh, pos, normal, u[0], &light, &pmf)) {
+		return false;
+	}
+	unsigned int primitive = scene.light_bvh.lights[light].primitive;
+	sample->emission = scene.materials[SceneMaterialId(scene, primitive)].emission;
+
+	if (primitive < scene.spheres.count) {
+		const SphereSet &spheres = scene.spheres;
+		Vector3 w = Point3(spheres.x[primitive], spheres.y[primitive], spheres.z[primitive]) - pos;
+		double distance = w.normalize();
+		double radius = spheres.radius[primitive];
+		if (distance <= radius) {
+			return false;
+		}
+
+		// 1 - cos(theta_max) without the cancellation for small distant spheres
+		double sin2_max = radius * radius / (distance * distance);
+		double one_minus_cos_max = sin2_max / (1 + sqrt(1 - sin2_max));
+		double cos_theta = 1 - u[1] * one_minus_cos_max;
+		double sin_theta = sqrt(std::max(0.0, 1 - cos_theta * cos_theta));
+		double phi = 2 * PI * u[2];
+
+		Vector3 axis = std::abs(w.x) > 0.9 ? Vector3(0, 1, 0) : Vector3(1, 0, 0);
+		Vector3 tangent = w.cross(axis);
+		tangent.normalize();
+		Vector3 bitangent = w.cross(tangent);
+		sample->dir = (sin_theta * cos(phi)) * tangent + (sin_theta * sin(phi)) * bitangent + cos_theta * w;
+		sample->distance = distance * cos_theta -
+			sqrt(std::max(0.0, radius * radius - distance * distance * sin_theta * sin_theta));
+		sample->pdf = pmf / (2 * PI * one_minus_cos_max);
+		return true;
+	}
+
+	const Triangle &triangle = scene.triangles[primitive - scene.spheres.count];
+	Vector3 edge_1 = triangle.vertices[1] - triangle.vertices[0];
+	Vector3 edge_2 = triangle.vertices[2] - triangle.vertices[0];
+	double root = sqrt(u[1]);
+	Point3 point = triangle.vertices[0] + (root * (1 - u[2])) * edge_1 + (root * u[2]) * edge_2;
+
+	Vector3 light_normal = edge_1.cross(edge_2);
+	double area = 0.5 * light_normal.normalize();
+	Vector3 dir = point - pos;
+	double distance = dir.normalize();
+	double cos_light = -dir.dot(light_normal);
+	if (cos_light <= 0 || area == 0) {
+		return false;
+	}
+	sample->dir = dir;
+	sample->distance = distance;
+	sample->pdf = pmf * distance * distance / (area * cos_light);
+	return true;
+}
+
+/** Closest hit with the full set of hit attributes, intersection->t must be initialized. */
+inline
+bool SceneIntersect(const Scene &scene, const Ray &ray, Intersection *intersection) {
+	unsigned int primitive;
+	if (!SceneIntersect(scene, ray, &intersection->t, &primitive)) {
+		return false;
+	}
+	intersection->pos = RayProjection(ray, intersection->t);
+	intersection->normal = SceneNormal(scene, primitive, intersection->pos, ray.dir);
+	intersection->material = scene.materials[SceneMaterialId(scene, primitive)];
+	return true;
+}
+
+#endif
@@ -0,0 +1,388 @@
+/*
+* Copyright (c) 2015 Owen Glofcheski
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+*    1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+*    2. Altered source versions must be plainly marked as such, and must not
+*    be misrepresented as being the original software.
+*
+*    3. This notice may not be removed or altered from any source
+*    distribution.
+*/
+
+
+#ifndef _SCENE_FILE_HPP_
+#define _SCENE_FILE_HPP_
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "buffer.hpp"
+#include "bvh_cache.hpp"
+#include "mapped_file.hpp"
+#include "obj.hpp"
+#include "scene.hpp"
+
+/**
+ * Binary scene container, a header and section table followed by the raw little-endian
+ * arrays of a built Scene. Sections start on SCENE_FILE_ALIGNMENT boundaries so a mapped
+ * file is used in place, loading validates the table and the indices stored in the arrays
+ * then points the scene at it.
+ * Readers skip section types they don't know so sections can be added without a version bump,
+ * the version changes when an existing section's layout does.
+ */
+#define SCENE_FILE_MAGIC 0x4e435342 // "BSCN"
+#define SCENE_FILE_VERSION 2
+#define SCENE_FILE_ALIGNMENT 64
+
+enum SceneSectionType
+{
+	SCENE_SECTION_MATERIALS = 1,
+	SCENE_SECTION_LIGHTS,
+	SCENE_SECTION_SPHERE_X,
+	SCENE_SECTION_SPHERE_Y,
+	SCENE_SECTION_SPHERE_Z,
+	SCENE_SECTION_SPHERE_RADIUS,
+	SCENE_SECTION_SPHERE_MATERIALS,
+	SCENE_SECTION_SPHERE_BVH_SETTINGS,
+	SCENE_SECTION_SPHERE_BVH_NODES,
+	SCENE_SECTION_SPHERE_BVH_INDICES,
+	SCENE_SECTION_TRIANGLES,
+	SCENE_SECTION_TRIANGLE_MATERIALS,
+	SCENE_SECTION_TRIANGLE_BVH_SETTINGS,
+	SCENE_SECTION_TRIANGLE_BVH_NODES,
+	SCENE_SECTION_TRIANGLE_BVH_INDICES,
+	SCENE_SECTION_SPHERE_WIDE_BVH_NODES,
+	SCENE_SECTION_TRIANGLE_WIDE_BVH_NODES,
+};
+
+struct SceneFileHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t section_count;
+	uint32_t sphere_count;
+};
+
+struct SceneFileSection
+{
+	uint32_t type;
+	uint32_t element_size; // Catches layout changes in the element types
+	uint64_t count;
+	uint64_t offset; // From the start of the file
+};
+
+struct SceneSectionData
+{
+	SceneFileSection section;
+	const void *data;
+};
+
+template <typename T>
+void AddSceneSection(uint32_t type, const T *data, size_t count, std::vector<SceneSectionData> *sections) {
+	SceneSectionData section;
+	section.section.type = type;
+	section.section.element_size = sizeof(T);
+	section.section.count = count;
+	section.section.offset = 0;
+	section.data = data;
+	sections->push_back(section);
+}
+
+/** Writes an already built |scene|, the arrays are written as they are in memory. */
+inline
+bool WriteSceneFile(const Scene &scene, const std::string &filename) {
+	if (!IsLittleEndian()) {
+		return false;
+	}
+
+	const SphereSet &spheres = scene.spheres;
+	std::vector<SceneSectionData> sections;
+	AddSceneSection(SCENE_SECTION_MATERIALS, scene.materials.data(), scene.materials.size(), &sections);
+	AddSceneSection(SCENE_SECTION_LIGHTS, scene.lights.data(), scene.lights.size(), &sections);
+	AddSceneSection(SCENE_SECTION_SPHERE_X, spheres.x.data(), spheres.x.size(), &sections);
+	AddSceneSection(SCENE_SECTION_SPHERE_Y, spheres.y.data(), spheres.y.size(), &sections);
+	AddSceneSection(SCENE_SECTION_SPHERE_Z, spheres.z.data(), spheres.z.size(), &sections);
+	AddSceneSection(SCENE_SECTION_SPHERE_RADIUS, spheres.radius.data(), spheres.radius.size(), &sections);
+	AddSceneSection(SCENE_SECTION_SPHERE_MATERIALS, spheres.material_ids.data(), spheres.material_ids.size(), &sections);
+	AddSceneSection(SCENE_SECTION_SPHERE_BVH_SETTINGS, &spheres.bvh.settings, 1, &sections);
+	AddSceneSection(SCENE_SECTION_SPHERE_BVH_NODES, spheres.bvh.nodes.data(), spheres.bvh.nodes.size(), &sections);
+	AddSceneSection(SCENE_SECTION_SPHERE_BVH_INDICES, spheres.bvh.indices.data(), spheres.bvh.indices.size(), &sections);
+	AddSceneSection(SCENE_SECTION_TRIANGLES, scene.triangles.data(), scene.triangles.size(), &sections);
+	AddSceneSection(SCENE_SECTION_TRIANGLE_MATERIALS, scene.triangle_materials.data(), scene.triangle_materials.size(), &sections);
+	AddSceneSection(SCENE_SECTION_TRIANGLE_BVH_SETTINGS, &scene.triangle_bvh.settings, 1, &sections);
+	AddSceneSection(SCENE_SECTION_TRIANGLE_BVH_NODES, scene.triangle_bvh.nodes.data(), scene.triangle_bvh.nodes.size(), &sections);
+	AddSceneSection(SCENE_SECTION_TRIANGLE_BVH_INDICES, scene.triangle_bvh.indices.data(), scene.triangle_bvh.indices.size(), &sections);
+	AddSceneSection(SCENE_SECTION_SPHERE_WIDE_BVH_NODES, spheres.wide_bvh.nodes.data(), spheres.wide_bvh.nodes.size(), &sections);
+	AddSceneSection(SCENE_SECTION_TRIANGLE_WIDE_BVH_NODES, scene.triangle_wide_bvh.nodes.data(), scene.triangle_wide_bvh.nodes.size(), &sections);
+
+	SceneFileHeader header;
+	header.magic = SCENE_FILE_MAGIC;
+	header.version = SCENE_FILE_VERSION;
+	header.section_count = sections.size();
+	header.sphere_count = spheres.count;
+
+	uint64_t offset = sizeof(SceneFileHeader) + sections.size() * sizeof(SceneFileSection);
+	for (SceneSectionData &section : sections) {
+		offset = (offset + SCENE_FILE_ALIGNMENT - 1) / SCENE_FILE_ALIGNMENT * SCENE_FILE_ALIGNMENT;
+		section.section.offset = offset;
+		offset += section.section.count * section.section.element_size;
+	}
+
+	std::ofstream ofs(filename, std::ios::binary);
+	if (!ofs.is_open()) {
+		return false;
+	}
+	ofs.write(reinterpret_cast<const char *>(&header), sizeof(header));
+	for (const SceneSectionData &section : sections) {
+		ofs.write(reinterpret_cast<const char *>(&section.section), sizeof(section.section));
+	}
+	const char padding[SCENE_FILE_ALIGNMENT] = {};
+	uint64_t position = sizeof(SceneFileHeader) + sections.size() * sizeof(SceneFileSection);
+	for (const SceneSectionData &section : sections) {
+		ofs.write(padding, section.section.offset - position);
+		uint64_t size = section.section.count * section.section.element_size;
+		if (size > 0) {
+			ofs.write(static_cast<const char *>(section.data), size);
+		}
+		position = section.section.offset + size;
+	}
+	return ofs.good();
+}
+
+template <typename T>
+bool ViewSceneSection(const MappedFile &file, const SceneFileSection &section, Buffer<T> *buffer) {
+	if (section.element_size != sizeof(T) || section.offset % SCENE_FILE_ALIGNMENT != 0 ||
+			section.offset > file.size || section.count > (file.size - section.offset) / sizeof(T)) {
+		return false;
+	}
+	buffer->view(reinterpret_cast<const T *>(file.data + section.offset), section.count);
+	return true;
+}
+
+// Small sections are copied so the scene can edit them freely
+template <typename T>
+bool CopySceneSection(const MappedFile &file, const SceneFileSection &section, std::vector<T> *values) {
+	Buffer<T> view;
+	if (!ViewSceneSection(file, section, &view)) {
+		return false;
+	}
+	values->assign(view.begin(), view.end());
+	return true;
+}
+
+/** ValidBVHNodes for a collapsed hierarchy, slots that are neither leaves nor interior must be unreachable. */
+inline
+bool ValidWideBVHNodes(const WideBVHNode *nodes, unsigned int node_count, unsigned int index_count) {
+	for (unsigned int i = 0; i < node_count; ++i) {
+		const WideBVHNode &node = nodes[i];
+		for (unsigned int slot = 0; slot < WIDE_BVH_WIDTH; ++slot) {
+			if (node.count[slot] > 0) {
+				if (node.child[slot] > index_count || node.count[slot] > index_count - node.child[slot]) {
+					return false;
+				}
+			} else if (node.child[slot] != 0) {
+				if (node.child[slot] <= i || node.child[slot] >= node_count) {
+					return false;
+				}
+			} else if (!(node.bounds[0][slot] > node.bounds[3][slot])) {
+				return false; // Unused slots are inverted so they are never entered
+			}
+		}
+	}
+	return true;
+}
+
+/** Checks every value in |values| is below |limit|. */
+inline
+bool ValidSceneIndices(const unsigned int *values, unsigned int count, unsigned int limit) {
+	for (unsigned int i = 0; i < count; ++i) {
+		if (values[i] >= limit) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Maps |filename| into |file| and points |scene| at it without copying the geometry or
+ * hierarchies, pages are read on first touch. |file| must outlive |scene|, editing a
+ * loaded array first copies it out of the mapping.
+ */
+inline
+bool LoadSceneFile(const std::string &filename, MappedFile *file, Scene *scene) {
+	*scene = Scene();
+	if (!IsLittleEndian() || !MapFile(filename, file)) {
+		return false;
+	}
+
+	if (file->size < sizeof(SceneFileHeader)) {
+		UnmapFile(file);
+		return false;
+	}
+	SceneFileHeader header;
+	memcpy(&header, file->data, sizeof(header));
+	if (header.magic != SCENE_FILE_MAGIC || header.version != SCENE_FILE_VERSION ||
+			header.section_count > (file->size - sizeof(header)) / sizeof(SceneFileSection)) {
+		UnmapFile(file);
+		return false;
+	}
+
+	SphereSet &spheres = scene->spheres;
+	std::vector<BVHSettings> settings;
+	bool valid = true;
+	const SceneFileSection *sections = reinterpret_cast<const SceneFileSection *>(file->data + sizeof(header));
+	for (unsigned int i = 0; i < header.section_count && valid; ++i) {
+		const SceneFileSection &section = sections[i];
+		switch (section.type) {
+			case SCENE_SECTION_MATERIALS:
+				valid = CopySceneSection(*file, section, &scene->materials);
+				break;
+			case SCENE_SECTION_LIGHTS:
+				valid = CopySceneSection(*file, section, &scene->lights);
+				break;
+			case SCENE_SECTION_SPHERE_X:
+				valid = ViewSceneSection(*file, section, &spheres.x);
+				break;
+			case SCENE_SECTION_SPHERE_Y:
+				valid = ViewSceneSection(*file, section, &spheres.y);
+				break;
+			case SCENE_SECTION_SPHERE_Z:
+				valid = ViewSceneSection(*file, section, &spheres.z);
+				break;
+			case SCENE_SECTION_SPHERE_RADIUS:
+				valid = ViewSceneSection(*file, section, &spheres.radius);
+				break;
+			case SCENE_SECTION_SPHERE_MATERIALS:
+				valid = ViewSceneSection(*file, section, &spheres.material_ids);
+				break;
+			case SCENE_SECTION_SPHERE_BVH_SETTINGS:
+				valid = CopySceneSection(*file, section, &settings) && settings.size() == 1;
+				if (valid) {
+					spheres.bvh.settings = settings[0];
+				}
+				break;
+			case SCENE_SECTION_SPHERE_BVH_NODES:
+				valid = ViewSceneSection(*file, section, &spheres.bvh.nodes);
+				break;
+			case SCENE_SECTION_SPHERE_BVH_INDICES:
+				valid = ViewSceneSection(*file, section, &spheres.bvh.indices);
+				break;
+			case SCENE_SECTION_TRIANGLES:
+				valid = ViewSceneSection(*file, section, &scene->triangles);
+				break;
+			case SCENE_SECTION_TRIANGLE_MATERIALS:
+				valid = ViewSceneSection(*file, section, &scene->triangle_materials);
+				break;
+			case SCENE_SECTION_TRIANGLE_BVH_SETTINGS:
+				valid = CopySceneSection(*file, section, &settings) && settings.size() == 1;
+				if (valid) {
+					scene->triangle_bvh.settings = settings[0];
+				}
+				break;
+			case SCENE_SECTION_TRIANGLE_BVH_NODES:
+				valid = ViewSceneSection(*file, section, &scene->triangle_bvh.nodes);
+				break;
+			case SCENE_SECTION_TRIANGLE_BVH_INDICES:
+				valid = ViewSceneSection(*file, section, &scene->triangle_bvh.indices);
+				break;
+			case SCENE_SECTION_SPHERE_WIDE_BVH_NODES:
+				valid = ViewSceneSection(*file, section, &spheres.wide_bvh.nodes);
+				break;
+			case SCENE_SECTION_TRIANGLE_WIDE_BVH_NODES:
+				valid = ViewSceneSection(*file, section, &scene->triangle_wide_bvh.nodes);
+				break;
+			default:
+				break;
+		}
+	}
+
+	// Traversal indexes the arrays with whatever the file holds so every stored index is checked,
+	// sphere leaves load SPHERE_SET_WIDTH lanes so the arrays must keep their padding
+	spheres.count = header.sphere_count;
+	unsigned int material_count = scene->materials.size();
+	valid = valid &&
+		spheres.x.size() >= spheres.count + SPHERE_SET_WIDTH - 1 && spheres.y.size() == spheres.x.size() &&
+		spheres.z.size() == spheres.x.size() && spheres.radius.size() == spheres.x.size() &&
+		spheres.material_ids.size() == spheres.x.size() && spheres.bvh.indices.size() == spheres.count &&
+		scene->triangle_materials.size() == scene->triangles.size() &&
+		scene->triangle_bvh.indices.size() == scene->triangles.size() &&
+		spheres.wide_bvh.nodes.empty() == spheres.bvh.nodes.empty() &&
+		scene->triangle_wide_bvh.nodes.empty() == scene->triangle_bvh.nodes.empty() &&
+		ValidBVHNodes(spheres.bvh.nodes.data(), spheres.bvh.nodes.size(), spheres.count) &&
+		ValidWideBVHNodes(spheres.wide_bvh.nodes.data(), spheres.wide_bvh.nodes.size(), spheres.count) &&
+		ValidSceneIndices(spheres.bvh.indices.data(), spheres.count, spheres.count) &&
+		ValidSceneIndices(spheres.material_ids.data(), spheres.count, material_count) &&
+		ValidBVHNodes(scene->triangle_bvh.nodes.data(), scene->triangle_bvh.nodes.size(), scene->triangles.size()) &&
+		ValidWideBVHNodes(scene->triangle_wide_bvh.nodes.data(), scene->triangle_wide_bvh.nodes.size(),
+			scene->triangles.size()) &&
+		ValidSceneIndices(scene->triangle_bvh.indices.data(), scene->triangles.size(), scene->triangles.size()) &&
+		ValidSceneIndices(scene->triangle_materials.data(), scene->triangles.size(), material_count);
+	if (!valid) {
+		*scene = Scene();
+		UnmapFile(file);
+		return false;
+	}
+
+	spheres.wide_bvh.indices = spheres.bvh.indices;
+	scene->triangle_wide_bvh.indices = scene->triangle_bvh.indices;
+#ifdef RAY_FLOAT
+	BuildTriangleSet(scene->triangles, scene->triangle_bvh.indices, &scene->triangle_set);
+#endif
+	BuildSceneLights(scene);
+	return true;
+}
+
+/**
+ * Converts |obj_filename| to a scene file, polygons are fanned into triangles and use |material|.
+ * The scene is built before writing so loading never touches the builder.
+ */
+inline
+bool ConvertOBJToSceneFile(const std::string &obj_filename, const std::string &filename,
+		const Material &material = Material()) {
+	OBJ obj;
+	if (!ReadOBJ(obj_filename, &obj)) {
+		return false;
+	}
+
+	Scene scene;
+	scene.materials.push_back(material);
+	for (unsigned int f = 0; f < OBJFaceCount(obj); ++f) {
+		const VertexIndex *face = OBJFace(obj, f);
+		unsigned int size = OBJFaceSize(obj, f);
+		bool valid = true;
+		for (unsigned int i = 0; i < size; ++i) {
+			valid = valid && face[i].pos >= 0 && face[i].pos < static_cast<int>(obj.positions.size());
+		}
+		if (!valid) {
+			continue;
+		}
+		for (unsigned int i = 1; i + 1 < size; ++i) {
+			Triangle triangle;
+			triangle.vertices[0] = obj.positions[face[0].pos];
+			triangle.vertices[1] = obj.positions[face[i].pos];
+			triangle.vertices[2] = obj.positions[face[i + 1].pos];
+			scene.triangles.push_back(triangle);
+			scene.triangle_materials.push_back(0);
+		}
+	}
+	BuildScene(&scene);
+	return WriteSceneFile(scene, filename);
+}
+
+#endif
@@ -0,0 +1,337 @@
+/*
+* Copyright (c) 2015 Owen Glofcheski
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+*    1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+*    2. Altered source versions must be plainly marked as such, and must not
+*    be misrepresented as being the original software.
+*
+*    3. This notice may not be removed or altered from any source
+*    distribution.
+*/
+
+#ifndef _SPHERE_SET_HPP_
+#define _SPHERE_SET_HPP_
+
+#include <iostream>
+#include <limits>
+#include <vector>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+#include "algebra.hpp"
+#include "buffer.hpp"
+#include "bvh.hpp"
+#include "primitive.hpp"
+#include "stats.hpp"
+#include "wide_bvh.hpp"
+
+#define SPHERE_SET_WIDTH 8
+
+/**
+ * Spheres stored as a structure of arrays for large particle scenes. Once built the
+ * arrays are in BVH leaf order, every leaf being a contiguous run of at most
+ * SPHERE_SET_WIDTH spheres tested together, and padded so a leaf can always load
+ * a full batch. Materials are shared by id.
+ */
+struct SphereSet
+{
+	SphereSet() : count(0) {}
+
+	Buffer<float> x;
+	Buffer<float> y;
+	Buffer<float> z;
+	Buffer<float> radius;
+	Buffer<unsigned int> material_ids;
+	std::vector<Material> materials;
+
+	BVH bvh; // bvh.indices maps a position in the arrays back to the order spheres were added
+	WideBVH wide_bvh; // Collapsed from bvh, used for traversal
+	unsigned int count;
+};
+
+inline
+void AddSphere(const Point3 &pos, double radius, unsigned int material_id, SphereSet *set) {
+	// Drop any padding from a previous build
+	set->x.resize(set->count);
+	set->y.resize(set->count);
+	set->z.resize(set->count);
+	set->radius.resize(set->count);
+	set->material_ids.resize(set->count);
+
+	set->x.push_back(pos.x);
+	set->y.push_back(pos.y);
+	set->z.push_back(pos.z);
+	set->radius.push_back(radius);
+	set->material_ids.push_back(material_id);
+	++set->count;
+}
+
+inline
+BoundingBox SphereSetBounds(const SphereSet &set, unsigned int i) {
+	return BoundingBox(Point3(set.x[i] - set.radius[i], set.y[i] - set.radius[i], set.z[i] - set.radius[i]),
+		Point3(set.x[i] + set.radius[i], set.y[i] + set.radius[i], set.z[i] + set.radius[i]));
+}
+
+template <typename Order, typename V>
+void ReorderSphereSetArray(const Order &order, unsigned int padding, Buffer<V> *values) {
+	Buffer<V> reordered;
+	reordered.resize(order.size() + padding);
+	for (unsigned int i = 0; i < order.size(); ++i) {
+		reordered[i] = (*values)[order[i]];
+	}
+	values->swap(reordered);
+}
+
+/** Build the hierarchy and reorder the arrays into leaf order. */
+inline
+void BuildSphereSet(SphereSet *set) {
+	// Rebuilds start from the order spheres were added in, spheres added since are already in place
+	if (!set->bvh.indices.empty()) {
+		std::vector<unsigned int> added_order(set->count);
+		for (unsigned int i = 0; i < set->count; ++i) {
+			added_order[i] = i;
+		}
+		for (unsigned int i = 0; i < set->bvh.indices.size(); ++i) {
+			added_order[set->bvh.indices[i]] = i;
+		}
+		set->bvh.indices.clear();
+		ReorderSphereSetArray(added_order, 0, &set->x);
+		ReorderSphereSetArray(added_order, 0, &set->y);
+		ReorderSphereSetArray(added_order, 0, &set->z);
+		ReorderSphereSetArray(added_order, 0, &set->radius);
+		ReorderSphereSetArray(added_order, 0, &set->material_ids);
+	}
+
+	std::vector<BoundingBox> bounds(set->count);
+	for (unsigned int i = 0; i < set->count; ++i) {
+		bounds[i] = SphereSetBounds(*set, i);
+	}
+
+	// A leaf costs about the same to test whether it holds one sphere or a full batch
+	BVHSettings settings;
+	settings.max_leaf_size = SPHERE_SET_WIDTH;
+	settings.intersection_cost = 1.0 / SPHERE_SET_WIDTH;
+	BuildBVHFromBounds(bounds, settings, &set->bvh);
+
+	const unsigned int padding = SPHERE_SET_WIDTH - 1;
+	ReorderSphereSetArray(set->bvh.indices, padding, &set->x);
+	ReorderSphereSetArray(set->bvh.indices, padding, &set->y);
+	ReorderSphereSetArray(set->bvh.indices, padding, &set->z);
+	ReorderSphereSetArray(set->bvh.indices, padding, &set->radius);
+	ReorderSphereSetArray(set->bvh.indices, padding, &set->material_ids);
+	BuildWideBVH(set->bvh, &set->wide_bvh);
+}
+
+/** Convenience for scenes built from Spheres, equal materials share an id. */
+inline
+void BuildSphereSet(const std::vector<Sphere> &spheres, SphereSet *set) {
+	*set = SphereSet();
+	for (const Sphere &sphere : spheres) {
+		const Material &material = sphere.material;
+		unsigned int id = 0;
+		// TODO(orglofch): Hash if scenes ever carry more than a handful of materials
+		while (id < set->materials.size() &&
+				(set->materials[id].diffuse != material.diffuse ||
+				set->materials[id].specular != material.specular ||
+				set->materials[id].shininess != material.shininess ||
+				set->materials[id].emission != material.emission)) {
+			++id;
+		}
+		if (id == set->materials.size()) {
+			set->materials.push_back(material);
+		}
+		AddSphere(sphere.pos, sphere.radius, id, set);
+	}
+	BuildSphereSet(set);
+}
+
+/** The ray converted once per traversal for the single precision leaf kernel. */
+struct SphereSetRay
+{
+	SphereSetRay(const Ray &ray) {
+		for (int i = 0; i < 3; ++i) {
+			origin[i] = static_cast<float>(ray.origin[i]);
+			dir[i] = static_cast<float>(ray.dir[i]);
+		}
+		a = dir[0] * dir[0] + dir[1] * dir[1] + dir[2] * dir[2];
+		inv_a = 1.0f / a;
+	}
+
+	float origin[3];
+	float dir[3];
+	float a;
+	float inv_a;
+};
+
+/**
+ * Tests the |count| (at most SPHERE_SET_WIDTH) spheres at |offset| at once. Each lane
+ * computes a single half-B discriminant and selects the near root by mask, falling
+ * back to the far root when the origin is inside. Returns the lane of the nearest hit
+ * in (EPSILON, *t) and shrinks *t to it, or -1.
+ */
+inline
+int SphereSetLeafIntersect(const SphereSet &set, unsigned int offset, unsigned int count,
+		const SphereSetRay &ray, float *t) {
+#if defined(__AVX__)
+	const __m256 lanes = _mm256_set_ps(7, 6, 5, 4, 3, 2, 1, 0);
+	__m256 ox = _mm256_sub_ps(_mm256_set1_ps(ray.origin[0]), _mm256_loadu_ps(&set.x[offset]));
+	__m256 oy = _mm256_sub_ps(_mm256_set1_ps(ray.origin[1]), _mm256_loadu_ps(&set.y[offset]));
+	__m256 oz = _mm256_sub_ps(_mm256_set1_ps(ray.origin[2]), _mm256_loadu_ps(&set.z[offset]));
+	__m256 r = _mm256_loadu_ps(&set.radius[offset]);
+
+	__m256 b = _mm256_add_ps(_mm256_add_ps(
+		_mm256_mul_ps(_mm256_set1_ps(ray.dir[0]), ox),
+		_mm256_mul_ps(_mm256_set1_ps(ray.dir[1]), oy)),
+		_mm256_mul_ps(_mm256_set1_ps(ray.dir[2]), oz));
+	__m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(
+		_mm256_mul_ps(ox, ox), _mm256_mul_ps(oy, oy)), _mm256_mul_ps(oz, oz)),
+		_mm256_mul_ps(r, r));
+	__m256 disc = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(_mm256_set1_ps(ray.a), c));
+
+	__m256 valid = _mm256_and_ps(_mm256_cmp_ps(disc, _mm256_setzero_ps(), _CMP_GE_OQ),
+		_mm256_cmp_ps(lanes, _mm256_set1_ps(static_cast<float>(count)), _CMP_LT_OQ));
+	if (_mm256_movemask_ps(valid) == 0) {
+		return -1;
+	}
+
+	__m256 root = _mm256_sqrt_ps(_mm256_max_ps(disc, _mm256_setzero_ps()));
+	__m256 neg_b = _mm256_sub_ps(_mm256_setzero_ps(), b);
+	__m256 inv_a = _mm256_set1_ps(ray.inv_a);
+	__m256 t_near = _mm256_mul_ps(_mm256_sub_ps(neg_b, root), inv_a);
+	__m256 t_far = _mm256_mul_ps(_mm256_add_ps(neg_b, root), inv_a);
+	__m256 epsilon = _mm256_set1_ps(static_cast<float>(EPSILON));
+	__m256 t_hit = _mm256_blendv_ps(t_far, t_near, _mm256_cmp_ps(t_near, epsilon, _CMP_GT_OQ));
+
+	valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(t_hit, epsilon, _CMP_GT_OQ),
+		_mm256_cmp_ps(t_hit, _mm256_set1_ps(*t), _CMP_LT_OQ)));
+	int mask = _mm256_movemask_ps(valid);
+	if (mask == 0) {
+		return -1;
+	}
+
+	// Horizontal minimum over the valid lanes
+	t_hit = _mm256_blendv_ps(_mm256_set1_ps(std::numeric_limits<float>::max()), t_hit, valid);
+	__m256 t_min = _mm256_min_ps(t_hit, _mm256_permute_ps(t_hit, _MM_SHUFFLE(2, 3, 0, 1)));
+	t_min = _mm256_min_ps(t_min, _mm256_permute_ps(t_min, _MM_SHUFFLE(1, 0, 3, 2)));
+	t_min = _mm256_min_ps(t_min, _mm256_permute2f128_ps(t_min, t_min, 1));
+	mask &= _mm256_movemask_ps(_mm256_cmp_ps(t_hit, t_min, _CMP_EQ_OQ));
+
+	int lane = 0;
+	while (!(mask & (1 << lane))) {
+		++lane;
+	}
+	*t = _mm256_cvtss_f32(t_min);
+	return lane;
+#else
+	int hit_lane = -1;
+	for (unsigned int lane = 0; lane < count; ++lane) {
+		unsigned int i = offset + lane;
+		float ox = ray.origin[0] - set.x[i];
+		float oy = ray.origin[1] - set.y[i];
+		float oz = ray.origin[2] - set.z[i];
+		float b = ray.dir[0] * ox + ray.dir[1] * oy + ray.dir[2] * oz;
+		float c = ox * ox + oy * oy + oz * oz - set.radius[i] * set.radius[i];
+		float disc = b * b - ray.a * c;
+		if (disc < 0) {
+			continue;
+		}
+		float root = sqrt(disc);
+		float t_near = (-b - root) * ray.inv_a;
+		float t_hit = t_near > EPSILON ? t_near : (-b + root) * ray.inv_a;
+		if (t_hit > EPSILON && t_hit < *t) {
+			*t = t_hit;
+			hit_lane = lane;
+		}
+	}
+	return hit_lane;
+#endif
+}
+
+/**
+ * Closest hit against |set|, *index is the position of the sphere in the set's arrays.
+ * Only the hit distance is computed, *t must be initialized and bounds the search.
+ * visit(node_index) sees the wide hierarchy nodes as for WideBVHTraverse.
+ */
+template <typename VisitFunc>
+bool SphereSetIntersect(const SphereSet &set, const Ray &ray, double *t, unsigned int *index,
+		const VisitFunc &visit) {
+	SphereSetRay set_ray(ray);
+	return WideBVHTraverse(set.wide_bvh, ray, t, [&](unsigned int offset, unsigned int count) {
+		float t_hit = static_cast<float>(std::min(*t, static_cast<double>(std::numeric_limits<float>::max())));
+		int lane = SphereSetLeafIntersect(set, offset, count, set_ray, &t_hit);
+		STAT_ADD(STAT_SPHERE_TESTS, count);
+		if (lane < 0) {
+			return false;
+		}
+		STAT_INC(STAT_SPHERE_HITS);
+		*t = t_hit;
+		*index = offset + lane;
+		return true;
+	}, visit);
+}
+
+inline
+bool SphereSetIntersect(const SphereSet &set, const Ray &ray, double *t, unsigned int *index) {
+	return SphereSetIntersect(set, ray, t, index, BVHNoVisit());
+}
+
+inline
+bool SphereSetIntersect(const SphereSet &set, const Ray &ray, Intersection *intersection) {
+	unsigned int index;
+	if (!SphereSetIntersect(set, ray, &intersection->t, &index)) {
+		return false;
+	}
+
+	// Hit attributes and the material are only resolved for the closest sphere
+	intersection->pos = RayProjection(ray, intersection->t);
+	intersection->normal = intersection->pos - Point3(set.x[index], set.y[index], set.z[index]);
+	intersection->normal.normalize();
+	intersection->material = set.materials[set.material_ids[index]];
+	return true;
+}
+
+inline
+bool SphereSetOccluded(const SphereSet &set, const Ray &ray, double tmax) {
+	SphereSetRay set_ray(ray);
+	return WideBVHTraverseAny(set.wide_bvh, ray, tmax, [&](unsigned int offset, unsigned int count) {
+		float t_hit = static_cast<float>(std::min(tmax, static_cast<double>(std::numeric_limits<float>::max())));
+		STAT_ADD(STAT_SPHERE_TESTS, count);
+		if (SphereSetLeafIntersect(set, offset, count, set_ray, &t_hit) < 0) {
+			return false;
+		}
+		STAT_INC(STAT_SPHERE_HITS);
+		return true;
+	});
+}
+
+// Lets whole sets sit in the leaves of a higher level BVH, e.g. one per particle system
+inline
+BoundingBox PrimitiveBounds(const SphereSet &set) {
+	return set.bvh.nodes.empty() ? BoundingBox() : set.bvh.nodes[0].bounds;
+}
+
+inline
+bool PrimitiveIntersect(const SphereSet &set, const Ray &ray, Intersection *intersection) {
+	return SphereSetIntersect(set, ray, intersection);
+}
+
+inline
+bool PrimitiveOccluded(const SphereSet &set, const Ray &ray, double tmax) {
+	return SphereSetOccluded(set, ray, tmax);
+}
+
+#endif
@@ -0,0 +1,237 @@
+/*
+* Copyright (c) 2015 Owen Glofcheski
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+*    1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+*    2. Altered source versions must be plainly marked as such, and must not
+*    be misrepresented as being the original software.
+*
+*    3. This notice may not be removed or altered from any source
+*    distribution.
+*/
+
+
+#ifndef _STATS_HPP_
+#define _STATS_HPP_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+
+/**
+ * Ray tracing counters, compiled in with RAY_STATS and to nothing otherwise. Every thread
+ * increments its own cache line padded block without synchronization, blocks are summed
+ * when a report is collected, which must happen while no thread is tracing (e.g. at frame end).
+ */
+enum StatCounter
+{
+	STAT_RAYS,
+	STAT_RAY_HITS,
+	STAT_SHADOW_RAYS,
+	STAT_SHADOW_RAY_HITS,
+	STAT_NODE_VISITS,
+	STAT_LEAF_VISITS,
+	STAT_TRIANGLE_TESTS,
+	STAT_TRIANGLE_HITS,
+	STAT_SPHERE_TESTS,
+	STAT_SPHERE_HITS,
+	STAT_PLANE_TESTS,
+	STAT_PLANE_HITS,
+	STAT_MAX_TRAVERSAL_DEPTH, // Counters from here on keep the maximum instead of the sum
+	STAT_COUNT,
+};
+
+static const char *const kStatNames[STAT_COUNT] = {
+	"rays",
+	"ray_hits",
+	"shadow_rays",
+	"shadow_ray_hits",
+	"node_visits",
+	"leaf_visits",
+	"triangle_tests",
+	"triangle_hits",
+	"sphere_tests",
+	"sphere_hits",
+	"plane_tests",
+	"plane_hits",
+	"max_traversal_depth",
+};
+
+struct alignas(64) StatCounters
+{
+	uint64_t values[STAT_COUNT];
+};
+
+inline
+void MergeStats(const StatCounters &from, StatCounters *to) {
+	for (int i = 0; i < STAT_COUNT; ++i) {
+		to->values[i] = i < STAT_MAX_TRAVERSAL_DEPTH ?
+			to->values[i] + from.values[i] : std::max(to->values[i], from.values[i]);
+	}
+}
+
+/** Blocks of live threads, exiting threads fold theirs into |retired| and leave it for reuse. */
+struct StatsRegistry
+{
+	StatsRegistry() {
+		memset(&retired, 0, sizeof(retired));
+	}
+
+	std::mutex mutex;
+	std::vector<StatCounters *> blocks;
+	std::vector<StatCounters *> free_blocks;
+	StatCounters retired;
+};
+
+/**
+ * Plain new only honours alignas(64) from C++17 on, so blocks are carved out of over
+ * allocated storage by hand to keep each on its own cache line. Blocks are recycled
+ * through the registry and never freed.
+ */
+inline
+StatCounters *AllocateStatCounters() {
+	char *storage = new char[sizeof(StatCounters) + alignof(StatCounters) - 1];
+	uintptr_t address = reinterpret_cast<uintptr_t>(storage);
+	address = (address + alignof(StatCounters) - 1) / alignof(StatCounters) * alignof(StatCounters);
+	return new (reinterpret_cast<void *>(address)) StatCounters;
+}
+
+inline
+StatsRegistry &GetStatsRegistry() {
+	static StatsRegistry registry;
+	return registry;
+}
+
+struct ThreadStats
+{
+	ThreadStats() {
+		StatsRegistry &registry = GetStatsRegistry();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		if (registry.free_blocks.empty()) {
+			counters = AllocateStatCounters();
+			registry.blocks.push_back(counters);
+		} else {
+			counters = registry.free_blocks.back();
+			registry.free_blocks.pop_back();
+		}
+		memset(counters, 0, sizeof(*counters));
+	}
+
+	~ThreadStats() {
+		StatsRegistry &registry = GetStatsRegistry();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		MergeStats(*counters, &registry.retired);
+		memset(counters, 0, sizeof(*counters));
+		registry.free_blocks.push_back(counters);
+	}
+
+	StatCounters *counters;
+};
+
+inline
+StatCounters &GetThreadStats() {
+	thread_local ThreadStats stats;
+	return *stats.counters;
+}
+
+#ifdef RAY_STATS
+#define STAT_ADD(counter, n) (GetThreadStats().values[counter] += (n))
+#define STAT_MAX(counter, n) do { uint64_t &stat_value_ = GetThreadStats().values[counter]; \
+	stat_value_ = std::max(stat_value_, static_cast<uint64_t>(n)); } while (0)
+#else
+#define STAT_ADD(counter, n)
+#define STAT_MAX(counter, n)
+#endif
+#define STAT_INC(counter) STAT_ADD(counter, 1)
+
+struct StatsReport
+{
+	StatCounters counters;
+	double seconds; // Wall clock time the counters were gathered over
+};
+
+/** Sums the counters of every thread into |report| and resets them. */
+inline
+void CollectStats(double seconds, StatsReport *report) {
+	StatsRegistry &registry = GetStatsRegistry();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+	report->counters = registry.retired;
+	report->seconds = seconds;
+	memset(&registry.retired, 0, sizeof(registry.retired));
+	for (StatCounters *block : registry.blocks) {
+		MergeStats(*block, &report->counters);
+		memset(block, 0, sizeof(*block));
+	}
+}
+
+inline
+double StatRatio(uint64_t numerator, uint64_t denominator) {
+	return denominator == 0 ? 0 : static_cast<double>(numerator) / denominator;
+}
+
+inline
+void PrintStats(const StatsReport &report, std::ostream &os) {
+	const uint64_t *values = report.counters.values;
+	uint64_t rays = values[STAT_RAYS] + values[STAT_SHADOW_RAYS];
+	uint64_t tests = values[STAT_TRIANGLE_TESTS] + values[STAT_SPHERE_TESTS] + values[STAT_PLANE_TESTS];
+#ifndef RAY_STATS
+	os << "Ray stats disabled, build with RAY_STATS" << std::endl;
+#endif
+	os << "Time: " << report.seconds << " s" << std::endl;
+	os << "Rays: " << values[STAT_RAYS] << " (" << values[STAT_SHADOW_RAYS] << " shadow), "
+		<< rays / std::max(report.seconds, 1e-9) / 1e6 << " M rays/s" << std::endl;
+	os << "Hit ratio: " << StatRatio(values[STAT_RAY_HITS], values[STAT_RAYS]) << " primary, "
+		<< StatRatio(values[STAT_SHADOW_RAY_HITS], values[STAT_SHADOW_RAYS]) << " shadow" << std::endl;
+	os << "Per ray: " << StatRatio(values[STAT_NODE_VISITS], rays) << " nodes, "
+		<< StatRatio(values[STAT_LEAF_VISITS], rays) << " leaves, "
+		<< StatRatio(tests, rays) << " tests" << std::endl;
+	os << "Tests: " << values[STAT_TRIANGLE_TESTS] << " triangles ("
+		<< StatRatio(values[STAT_TRIANGLE_HITS], values[STAT_TRIANGLE_TESTS]) << " hit), "
+		<< values[STAT_SPHERE_TESTS] << " spheres ("
+		<< StatRatio(values[STAT_SPHERE_HITS], values[STAT_SPHERE_TESTS]) << " hit), "
+		<< values[STAT_PLANE_TESTS] << " planes ("
+		<< StatRatio(values[STAT_PLANE_HITS], values[STAT_PLANE_TESTS]) << " hit)" << std::endl;
+	os << "Max traversal depth: " << values[STAT_MAX_TRAVERSAL_DEPTH] << std::endl;
+}
+
+/** Flat JSON object of the raw counters and the derived rates. */
+inline
+bool WriteStatsJSON(const StatsReport &report, const std::string &filename) {
+	std::ofstream ofs(filename);
+	if (!ofs.is_open()) {
+		return false;
+	}
+	const uint64_t *values = report.counters.values;
+	uint64_t rays = values[STAT_RAYS] + values[STAT_SHADOW_RAYS];
+	uint64_t tests = values[STAT_TRIANGLE_TESTS] + values[STAT_SPHERE_TESTS] + values[STAT_PLANE_TESTS];
+	ofs << "{" << std::endl;
+	ofs << "  \"seconds\": " << report.seconds << "," << std::endl;
+	for (int i = 0; i < STAT_COUNT; ++i) {
+		ofs << "  \"" << kStatNames[i] << "\": " << values[i] << "," << std::endl;
+	}
+	ofs << "  \"rays_per_second\": " << rays / std::max(report.seconds, 1e-9) << "," << std::endl;
+	ofs << "  \"tests_per_ray\": " << StatRatio(tests, rays) << "," << std::endl;
+	ofs << "  \"nodes_per_ray\": " << StatRatio(values[STAT_NODE_VISITS], rays) << "," << std::endl;
+	ofs << "  \"hit_ratio\": " << StatRatio(values[STAT_RAY_HITS], values[STAT_RAYS]) << std::endl;
+	ofs << "}" << std::endl;
+	return ofs.good();
+}
+
+#endif
@@ -0,0 +1,218 @@
+/*
+* Copyright (c) 2015 Owen Glofcheski
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+*    1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+*    2. Altered source versions must be plainly marked as such, and must not
+*    be misrepresented as being the original software.
+*
+*    3. This notice may not be removed or altered from any source
+*    distribution.
+*/
+
+
+#ifndef _TRIANGLE_SET_HPP_
+#define _TRIANGLE_SET_HPP_
+
+#include <algorithm>
+#include <iostream>
+#include <limits>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+#include "buffer.hpp"
+#include "primitive.hpp"
+#include "stats.hpp"
+
+#define TRIANGLE_SET_WIDTH 8
+
+/**
+ * Single precision copy of triangles for the RAY_FLOAT leaf kernel. The first vertex and
+ * both edges are stored as a structure of arrays in the order of a hierarchy's indices so
+ * a leaf's triangles are adjacent and TRIANGLE_SET_WIDTH of them are tested at once.
+ * Padded so a leaf can always load a full batch.
+ */
+struct TriangleSet
+{
+	Buffer<float> vertex[3];
+	Buffer<float> edge_1[3];
+	Buffer<float> edge_2[3];
+};
+
+/** Copy |triangles| into |set| in the order of |indices|, edges are taken in double before rounding. */
+inline
+void BuildTriangleSet(const Buffer<Triangle> &triangles, const Buffer<unsigned int> &indices, TriangleSet *set) {
+	const unsigned int padded = indices.size() + TRIANGLE_SET_WIDTH - 1;
+	for (int axis = 0; axis < 3; ++axis) {
+		set->vertex[axis].assign(padded, 0.0f);
+		set->edge_1[axis].assign(padded, 0.0f);
+		set->edge_2[axis].assign(padded, 0.0f);
+	}
+	for (unsigned int i = 0; i < indices.size(); ++i) {
+		const Triangle &triangle = triangles[indices[i]];
+		for (int axis = 0; axis < 3; ++axis) {
+			double vertex_0 = triangle.vertices[0][axis];
+			set->vertex[axis][i] = static_cast<float>(vertex_0);
+			set->edge_1[axis][i] = static_cast<float>(triangle.vertices[1][axis] - vertex_0);
+			set->edge_2[axis][i] = static_cast<float>(triangle.vertices[2][axis] - vertex_0);
+		}
+	}
+}
+
+struct TriangleSetRay
+{
+	TriangleSetRay(const Ray &ray) {
+		for (int i = 0; i < 3; ++i) {
+			origin[i] = static_cast<float>(ray.origin[i]);
+			dir[i] = static_cast<float>(ray.dir[i]);
+		}
+	}
+
+	float origin[3];
+	float dir[3];
+};
+
+#if defined(__AVX__)
+inline
+void TriangleSetCross(const __m256 a[3], const __m256 b[3], __m256 out[3]) {
+	out[0] = _mm256_sub_ps(_mm256_mul_ps(a[1], b[2]), _mm256_mul_ps(a[2], b[1]));
+	out[1] = _mm256_sub_ps(_mm256_mul_ps(a[2], b[0]), _mm256_mul_ps(a[0], b[2]));
+	out[2] = _mm256_sub_ps(_mm256_mul_ps(a[0], b[1]), _mm256_mul_ps(a[1], b[0]));
+}
+
+inline
+__m256 TriangleSetDot(const __m256 a[3], const __m256 b[3]) {
+	return _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(a[0], b[0]), _mm256_mul_ps(a[1], b[1])),
+		_mm256_mul_ps(a[2], b[2]));
+}
+#endif
+
+/**
+ * Moller-Trumbore over the |count| (at most TRIANGLE_SET_WIDTH) triangles at |offset| at
+ * once, with the same tests as TriangleKernel. Returns the lane of the nearest hit in
+ * (EPSILON, *t) and shrinks *t to it, or -1.
+ */
+inline
+int TriangleSetLeafIntersect(const TriangleSet &set, unsigned int offset, unsigned int count,
+		const TriangleSetRay &ray, float *t) {
+#if defined(__AVX__)
+	const __m256 lanes = _mm256_set_ps(7, 6, 5, 4, 3, 2, 1, 0);
+	const __m256 epsilon = _mm256_set1_ps(static_cast<float>(EPSILON));
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 one = _mm256_set1_ps(1.0f);
+	__m256 edge_1[3], edge_2[3], origin[3], dir[3];
+	for (int axis = 0; axis < 3; ++axis) {
+		edge_1[axis] = _mm256_loadu_ps(&set.edge_1[axis][offset]);
+		edge_2[axis] = _mm256_loadu_ps(&set.edge_2[axis][offset]);
+		origin[axis] = _mm256_sub_ps(_mm256_set1_ps(ray.origin[axis]), _mm256_loadu_ps(&set.vertex[axis][offset]));
+		dir[axis] = _mm256_set1_ps(ray.dir[axis]);
+	}
+
+	__m256 P[3];
+	TriangleSetCross(dir, edge_2, P);
+	__m256 det = TriangleSetDot(edge_1, P);
+	__m256 valid = _mm256_and_ps(
+		_mm256_or_ps(_mm256_cmp_ps(det, _mm256_sub_ps(zero, epsilon), _CMP_LE_OQ), _mm256_cmp_ps(det, epsilon, _CMP_GE_OQ)),
+		_mm256_cmp_ps(lanes, _mm256_set1_ps(static_cast<float>(count)), _CMP_LT_OQ));
+	if (_mm256_movemask_ps(valid) == 0) {
+		return -1;
+	}
+	__m256 inv_det = _mm256_div_ps(one, det);
+
+	__m256 u = _mm256_mul_ps(TriangleSetDot(origin, P), inv_det);
+	__m256 Q[3];
+	TriangleSetCross(origin, edge_1, Q);
+	__m256 v = _mm256_mul_ps(TriangleSetDot(dir, Q), inv_det);
+	__m256 t_hit = _mm256_mul_ps(TriangleSetDot(edge_2, Q), inv_det);
+	valid = _mm256_and_ps(valid, _mm256_and_ps(
+		_mm256_and_ps(_mm256_cmp_ps(u, zero, _CMP_GE_OQ), _mm256_cmp_ps(u, one, _CMP_LE_OQ)),
+		_mm256_and_ps(_mm256_cmp_ps(v, zero, _CMP_GE_OQ), _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ))));
+	valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(t_hit, epsilon, _CMP_GT_OQ),
+		_mm256_cmp_ps(t_hit, _mm256_set1_ps(*t), _CMP_LT_OQ)));
+	int mask = _mm256_movemask_ps(valid);
+	if (mask == 0) {
+		return -1;
+	}
+
+	// Horizontal minimum over the valid lanes
+	t_hit = _mm256_blendv_ps(_mm256_set1_ps(std::numeric_limits<float>::max()), t_hit, valid);
+	__m256 t_min = _mm256_min_ps(t_hit, _mm256_permute_ps(t_hit, _MM_SHUFFLE(2, 3, 0, 1)));
+	t_min = _mm256_min_ps(t_min, _mm256_permute_ps(t_min, _MM_SHUFFLE(1, 0, 3, 2)));
+	t_min = _mm256_min_ps(t_min, _mm256_permute2f128_ps(t_min, t_min, 1));
+	mask &= _mm256_movemask_ps(_mm256_cmp_ps(t_hit, t_min, _CMP_EQ_OQ));
+
+	int lane = 0;
+	while (!(mask & (1 << lane))) {
+		++lane;
+	}
+	*t = _mm256_cvtss_f32(t_min);
+	return lane;
+#else
+	int hit_lane = -1;
+	for (unsigned int lane = 0; lane < count; ++lane) {
+		unsigned int i = offset + lane;
+		float edge_1[3], edge_2[3], origin[3];
+		for (int axis = 0; axis < 3; ++axis) {
+			edge_1[axis] = set.edge_1[axis][i];
+			edge_2[axis] = set.edge_2[axis][i];
+			origin[axis] = ray.origin[axis] - set.vertex[axis][i];
+		}
+
+		float P[3];
+		KernelCross(ray.dir, edge_2, P);
+		float det = KernelDot(edge_1, P);
+		if (det > -static_cast<float>(EPSILON) && det < static_cast<float>(EPSILON)) {
+			continue;
+		}
+		float inv_det = 1 / det;
+		float u = KernelDot(origin, P) * inv_det;
+		float Q[3];
+		KernelCross(origin, edge_1, Q);
+		float v = KernelDot(ray.dir, Q) * inv_det;
+		float t_hit = KernelDot(edge_2, Q) * inv_det;
+		if (u >= 0 && u <= 1 && v >= 0 && u + v <= 1 && t_hit > static_cast<float>(EPSILON) && t_hit < *t) {
+			*t = t_hit;
+			hit_lane = lane;
+		}
+	}
+	return hit_lane;
+#endif
+}
+
+/**
+ * Closest hit among the |count| triangles at |offset|, any number of them, in batches
+ * of TRIANGLE_SET_WIDTH. Returns the hit's position after |offset| and shrinks *t to
+ * it, or -1.
+ */
+inline
+int TriangleSetIntersect(const TriangleSet &set, unsigned int offset, unsigned int count,
+		const TriangleSetRay &ray, float *t) {
+	STAT_ADD(STAT_TRIANGLE_TESTS, count);
+	int hit = -1;
+	for (unsigned int batch = 0; batch < count; batch += TRIANGLE_SET_WIDTH) {
+		unsigned int batch_count = std::min(count - batch, static_cast<unsigned int>(TRIANGLE_SET_WIDTH));
+		int lane = TriangleSetLeafIntersect(set, offset + batch, batch_count, ray, t);
+		if (lane >= 0) {
+			hit = batch + lane;
+		}
+	}
+	if (hit >= 0) {
+		STAT_INC(STAT_TRIANGLE_HITS);
+	}
+	return hit;
+}
+
+#endif
@@ -0,0 +1,360 @@
+/*
+* Copyright (c) 2015 Owen Glofcheski
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+*    1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+*    2. Altered source versions must be plainly marked as such, and must not
+*    be misrepresented as being the original software.
+*
+*    3. This notice may not be removed or altered from any source
+*    distribution.
+*/
+
+
+#ifndef _TRIANGULATE_HPP_
+#define _TRIANGULATE_HPP_
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <unordered_map>
+#include <vector>
+
+#include "algebra.hpp"
+#include "parallel.hpp"
+#include "primitive.hpp"
+
+#define TRIANGULATE_BATCH_SIZE 256 // Polygons triangulated per parallel task
+
+struct TriIndex
+{
+	unsigned int i1, i2, i3;
+};
+
+/** Per-thread working storage for EarClipPolygon, reused across polygons to avoid allocating. */
+struct EarClipScratch
+{
+	std::vector<Point2> points;
+	std::vector<unsigned int> prev;
+	std::vector<unsigned int> next;
+	std::vector<unsigned char> reflex;
+	std::vector<unsigned int> reflex_vertices;
+};
+
+inline
+double EarClipCross(const Point2 &a, const Point2 &b, const Point2 &c) {
+	return (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+}
+
+/** Inclusive of the boundary, |a|, |b| and |c| are counter-clockwise. */
+inline
+bool EarClipContains(const Point2 &a, const Point2 &b, const Point2 &c, const Point2 &p) {
+	return EarClipCross(a, b, p) >= 0 && EarClipCross(b, c, p) >= 0 && EarClipCross(c, a, p) >= 0;
+}
+
+/**
+ * Project the polygon onto the plane of its dominant Newell normal axis,
+ * with the axes ordered so the projection winds counter-clockwise.
+ */
+inline
+void ProjectPolygon(const Point3 *vertices, unsigned int count, std::vector<Point2> *points) {
+	Vector3 normal(0, 0, 0);
+	for (unsigned int i = 0, j = count - 1; i < count; j = i++) {
+		normal.x += (vertices[j].y - vertices[i].y) * (vertices[j].z + vertices[i].z);
+		normal.y += (vertices[j].z - vertices[i].z) * (vertices[j].x + vertices[i].x);
+		normal.z += (vertices[j].x - vertices[i].x) * (vertices[j].y + vertices[i].y);
+	}
+
+	int axis = 2;
+	if (std::abs(normal.x) > std::abs(normal.y) && std::abs(normal.x) > std::abs(normal.z)) {
+		axis = 0;
+	} else if (std::abs(normal.y) > std::abs(normal.z)) {
+		axis = 1;
+	}
+	int u = (axis + 1) % 3;
+	int v = (axis + 2) % 3;
+	if (normal[axis] < 0) {
+		std::swap(u, v);
+	}
+
+	points->resize(count);
+	for (unsigned int i = 0; i < count; ++i) {
+		(*points)[i] = Point2(vertices[i][u], vertices[i][v]);
+	}
+}
+
+inline
+bool IsEar(const EarClipScratch &scratch, unsigned int i) {
+	if (scratch.reflex[i]) {
+		return false;
+	}
+	unsigned int prev = scratch.prev[i];
+	unsigned int next = scratch.next[i];
+	const Point2 &a = scratch.points[prev];
+	const Point2 &b = scratch.points[i];
+	const Point2 &c = scratch.points[next];
+
+	// Only reflex vertices can lie inside a convex vertex's triangle
+	for (unsigned int r : scratch.reflex_vertices) {
+		if (!scratch.reflex[r] || r == prev || r == next) {
+			continue;
+		}
+		const Point2 &p = scratch.points[r];
+		if (p == a || p == b || p == c) {
+			continue;
+		}
+		if (EarClipContains(a, b, c, p)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+inline
+void UpdateReflex(unsigned int i, EarClipScratch *scratch) {
+	// Clipping only shrinks the interior angles of the neighbours, so a vertex never becomes reflex again
+	if (scratch->reflex[i] &&
+			EarClipCross(scratch->points[scratch->prev[i]], scratch->points[i], scratch->points[scratch->next[i]]) > 0) {
+		scratch->reflex[i] = 0;
+	}
+}
+
+/**
+ * Ear clip a simple, possibly concave, polygon into exactly |count| - 2 triangles
+ * written to |triangles|, indices are offset by |base| and keep the polygon's winding.
+ * Containment is only tested against the remaining reflex vertices so this is
+ * O(n r) for r reflex vertices, linear for convex polygons. Degenerate or
+ * self-intersecting input still terminates, by clipping the vertex it stalled on.
+ */
+inline
+void EarClipPolygon(const Point3 *vertices, unsigned int count, unsigned int base,
+		EarClipScratch *scratch, TriIndex *triangles) {
+	if (count < 3) {
+		return;
+	}
+	if (count == 3) {
+		triangles[0] = { base, base + 1, base + 2 };
+		return;
+	}
+
+	ProjectPolygon(vertices, count, &scratch->points);
+	scratch->prev.resize(count);
+	scratch->next.resize(count);
+	scratch->reflex.resize(count);
+	scratch->reflex_vertices.clear();
+	for (unsigned int i = 0; i < count; ++i) {
+		scratch->prev[i] = i == 0 ? count - 1 : i - 1;
+		scratch->next[i] = i == count - 1 ? 0 : i + 1;
+	}
+	for (unsigned int i = 0; i < count; ++i) {
+		const Point2 &a = scratch->points[scratch->prev[i]];
+		scratch->reflex[i] = EarClipCross(a, scratch->points[i], scratch->points[scratch->next[i]]) <= 0;
+		if (scratch->reflex[i]) {
+			scratch->reflex_vertices.push_back(i);
+		}
+	}
+
+	unsigned int remaining = count;
+	unsigned int i = 0;
+	unsigned int stalled = 0;
+	while (remaining > 3) {
+		if (!IsEar(*scratch, i) && ++stalled <= remaining) {
+			i = scratch->next[i];
+			continue;
+		}
+
+		unsigned int prev = scratch->prev[i];
+		unsigned int next = scratch->next[i];
+		*triangles++ = { base + prev, base + i, base + next };
+		scratch->next[prev] = next;
+		scratch->prev[next] = prev;
+		scratch->reflex[i] = 0;
+		--remaining;
+		stalled = 0;
+
+		UpdateReflex(prev, scratch);
+		UpdateReflex(next, scratch);
+		i = prev;
+	}
+	*triangles = { base + scratch->prev[i], base + i, base + scratch->next[i] };
+}
+
+inline
+unsigned int PolygonTriangleCount(const Polygon &polygon) {
+	return polygon.vertices.size() < 3 ? 0 : polygon.vertices.size() - 2;
+}
+
+/** Grid cell of a vertex being welded, the bits of its exact position when welding without a tolerance. */
+struct WeldCell
+{
+	long long pos[3];
+
+	bool operator == (const WeldCell &other) const {
+		return pos[0] == other.pos[0] && pos[1] == other.pos[1] && pos[2] == other.pos[2];
+	}
+};
+
+struct WeldCellHash
+{
+	size_t operator () (const WeldCell &cell) const {
+		size_t hash = 0;
+		for (int i = 0; i < 3; ++i) {
+			hash ^= static_cast<unsigned long long>(cell.pos[i]) + 0x9e3779b97f4a7c15ull + (hash << 6) + (hash >> 2);
+		}
+		return hash;
+	}
+};
+
+inline
+WeldCell WeldVertexCell(const Point3 &pos, double tolerance) {
+	WeldCell cell;
+	for (int i = 0; i < 3; ++i) {
+		if (tolerance > 0) {
+			// Clamped so far away vertices can't overflow the cell coordinates
+			double coordinate = std::floor(pos[i] / tolerance);
+			cell.pos[i] = static_cast<long long>(std::max(-4e18, std::min(4e18, coordinate)));
+		} else {
+			// Adding zero folds -0 into 0 so they land in the same cell
+			double coordinate = pos[i] + 0.0;
+			memcpy(&cell.pos[i], &coordinate, sizeof(coordinate));
+		}
+	}
+	return cell;
+}
+
+/**
+ * Merge the vertices within |tolerance| of each other in place, bitwise identical ones
+ * when it's 0, and fill |remap| with the survivor of each original vertex. Survivors
+ * sit in a hashed grid of |tolerance| sized cells so a vertex is only compared against
+ * the survivors of its 27 neighbouring cells, which being more than |tolerance| apart
+ * are at most 8 per cell.
+ */
+inline
+void WeldVertexPositions(std::vector<Point3> *vertices, std::vector<unsigned int> *remap, double tolerance = 0) {
+	const unsigned int none = std::numeric_limits<unsigned int>::max();
+	std::unordered_map<WeldCell, unsigned int, WeldCellHash> cells; // Latest survivor in each cell
+	cells.reserve(vertices->size());
+	std::vector<unsigned int> next_in_cell; // Previous survivor in the same cell, per survivor
+	next_in_cell.reserve(vertices->size());
+	remap->resize(vertices->size());
+
+	const int reach = tolerance > 0 ? 1 : 0;
+	unsigned int count = 0;
+	for (unsigned int i = 0; i < vertices->size(); ++i) {
+		const Point3 pos = (*vertices)[i];
+		WeldCell cell = WeldVertexCell(pos, tolerance);
+		unsigned int survivor = none;
+		for (int dx = -reach; dx <= reach && survivor == none; ++dx) {
+			for (int dy = -reach; dy <= reach && survivor == none; ++dy) {
+				for (int dz = -reach; dz <= reach && survivor == none; ++dz) {
+					WeldCell neighbour = { { cell.pos[0] + dx, cell.pos[1] + dy, cell.pos[2] + dz } };
+					auto found = cells.find(neighbour);
+					for (unsigned int j = found == cells.end() ? none : found->second; j != none; j = next_in_cell[j]) {
+						Vector3 offset = (*vertices)[j] - pos;
+						if (reach == 0 || offset.dot(offset) <= tolerance * tolerance) {
+							survivor = j;
+							break;
+						}
+					}
+				}
+			}
+		}
+
+		if (survivor == none) {
+			survivor = count++;
+			auto inserted = cells.insert(std::make_pair(cell, survivor));
+			next_in_cell.push_back(inserted.second ? none : inserted.first->second);
+			inserted.first->second = survivor;
+			(*vertices)[survivor] = pos;
+		}
+		(*remap)[i] = survivor;
+	}
+	vertices->resize(count);
+}
+
+/**
+ * Weld |vertices| as in WeldVertexPositions and remap |indices| to the survivors,
+ * triangles left without three distinct vertices are dropped.
+ */
+inline
+void WeldVertices(std::vector<Point3> *vertices, std::vector<TriIndex> *indices, double tolerance = 0) {
+	std::vector<unsigned int> remap;
+	WeldVertexPositions(vertices, &remap, tolerance);
+
+	unsigned int count = 0;
+	for (const TriIndex &triangle : *indices) {
+		TriIndex welded = { remap[triangle.i1], remap[triangle.i2], remap[triangle.i3] };
+		if (welded.i1 != welded.i2 && welded.i2 != welded.i3 && welded.i3 != welded.i1) {
+			(*indices)[count++] = welded;
+		}
+	}
+	indices->resize(count);
+}
+
+/**
+ * Triangulate |polygons| into a shared vertex array and an index buffer.
+ * Polygons are ear clipped in parallel batches, each into its own range found
+ * by a prefix sum over the vertex and triangle counts, then coincident vertices
+ * of neighbouring polygons are welded.
+ */
+inline
+void TriangulatePolygons(const std::vector<Polygon> &polygons,
+		std::vector<Point3> *vertices, std::vector<TriIndex> *indices) {
+	unsigned int polygon_count = polygons.size();
+	std::vector<unsigned int> vertex_offsets(polygon_count + 1, 0);
+	std::vector<unsigned int> triangle_offsets(polygon_count + 1, 0);
+	for (unsigned int i = 0; i < polygon_count; ++i) {
+		vertex_offsets[i + 1] = vertex_offsets[i] + polygons[i].vertices.size();
+		triangle_offsets[i + 1] = triangle_offsets[i] + PolygonTriangleCount(polygons[i]);
+	}
+
+	vertices->resize(vertex_offsets[polygon_count]);
+	indices->resize(triangle_offsets[polygon_count]);
+
+	unsigned int batch_count = (polygon_count + TRIANGULATE_BATCH_SIZE - 1) / TRIANGULATE_BATCH_SIZE;
+	ParallelFor(0, batch_count, [&](unsigned int batch) {
+		EarClipScratch scratch;
+		unsigned int end = std::min(polygon_count, (batch + 1) * TRIANGULATE_BATCH_SIZE);
+		for (unsigned int i = batch * TRIANGULATE_BATCH_SIZE; i < end; ++i) {
+			const std::vector<Point3> &polygon = polygons[i].vertices;
+			std::copy(polygon.begin(), polygon.end(), vertices->begin() + vertex_offsets[i]);
+			if (polygon.size() >= 3) {
+				EarClipPolygon(&polygon[0], polygon.size(), vertex_offsets[i], &scratch,
+					&(*indices)[triangle_offsets[i]]);
+			}
+		}
+	});
+
+	WeldVertices(vertices, indices);
+}
+
+inline
+void TriangulatePolygons(const std::vector<Polygon> &polygons, std::vector<Triangle> *triangles) {
+	std::vector<Point3> vertices;
+	std::vector<TriIndex> indices;
+	TriangulatePolygons(polygons, &vertices, &indices);
+
+	triangles->reserve(triangles->size() + indices.size());
+	for (const TriIndex &index : indices) {
+		Triangle triangle;
+		triangle.vertices[0] = vertices[index.i1];
+		triangle.vertices[1] = vertices[index.i2];
+		triangle.vertices[2] = vertices[index.i3];
+		triangles->push_back(triangle);
+	}
+}
+
+#endif
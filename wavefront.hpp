@@ -0,0 +1,700 @@
+/*
+* Copyright (c) 2015 Owen Glofcheski
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+*    1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+*    2. Altered source versions must be plainly marked as such, and must not
+*    be misrepresented as being the original software.
+*
+*    3. This notice may not be removed or altered from any source
+*    distribution.
+*/
+
+
+#ifndef _WAVEFRONT_HPP_
+#define _WAVEFRONT_HPP_
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include "algebra.hpp"
+#include "camera.hpp"
+#include "colour.hpp"
+#include "image.hpp"
+#include "parallel.hpp"
+#include "primitive.hpp"
+#include "scene.hpp"
+
+#define WAVEFRONT_CHUNK 1024
+#define WAVEFRONT_DEAD 0xffffffffu
+
+struct WavefrontSettings
+{
+	WavefrontSettings() : samples(1), max_depth(4), seed(0), sort_rays(true) {}
+
+	unsigned int samples; // Per pixel
+	unsigned int max_depth; // Number of extend stages per path
+	unsigned int seed;
+	bool sort_rays; // Reorder secondary rays by origin and direction before extending them
+};
+
+/** Paths in flight, one entry per path. */
+struct RayQueue
+{
+	RayQueue() : size(0) {}
+
+	void reserve(unsigned int capacity) {
+		origin_x.resize(capacity);
+		origin_y.resize(capacity);
+		origin_z.resize(capacity);
+		dir_x.resize(capacity);
+		dir_y.resize(capacity);
+		dir_z.resize(capacity);
+		throughput_r.resize(capacity);
+		throughput_g.resize(capacity);
+		throughput_b.resize(capacity);
+		pixels.resize(capacity);
+		rng.resize(capacity);
+	}
+
+	Ray ray(unsigned int i) const {
+		return Ray(Point3(origin_x[i], origin_y[i], origin_z[i]), Vector3(dir_x[i], dir_y[i], dir_z[i]));
+	}
+
+	void set(unsigned int i, const Ray &ray) {
+		origin_x[i] = ray.origin.x;
+		origin_y[i] = ray.origin.y;
+		origin_z[i] = ray.origin.z;
+		dir_x[i] = ray.dir.x;
+		dir_y[i] = ray.dir.y;
+		dir_z[i] = ray.dir.z;
+	}
+
+	Colour throughput(unsigned int i) const {
+		return Colour(throughput_r[i], throughput_g[i], throughput_b[i]);
+	}
+
+	void copy(const RayQueue &source, unsigned int from, unsigned int to) {
+		origin_x[to] = source.origin_x[from];
+		origin_y[to] = source.origin_y[from];
+		origin_z[to] = source.origin_z[from];
+		dir_x[to] = source.dir_x[from];
+		dir_y[to] = source.dir_y[from];
+		dir_z[to] = source.dir_z[from];
+		throughput_r[to] = source.throughput_r[from];
+		throughput_g[to] = source.throughput_g[from];
+		throughput_b[to] = source.throughput_b[from];
+		pixels[to] = source.pixels[from];
+		rng[to] = source.rng[from];
+	}
+
+	void copy(unsigned int from, unsigned int to) {
+		copy(*this, from, to);
+	}
+
+	std::vector<double> origin_x, origin_y, origin_z;
+	std::vector<double> dir_x, dir_y, dir_z;
+	std::vector<float> throughput_r, throughput_g, throughput_b;
+	std::vector<unsigned int> pixels; // WAVEFRONT_DEAD once a path terminates
+	std::vector<unsigned int> rng; // Per path random state
+	unsigned int size;
+};
+
+/** Compact hit records, the material is only looked up again when shading. */
+struct HitQueue
+{
+	HitQueue() : size(0) {}
+
+	void reserve(unsigned int capacity) {
+		rays.resize(capacity);
+		primitives.resize(capacity);
+		material_ids.resize(capacity);
+		t.resize(capacity);
+	}
+
+	std::vector<unsigned int> rays; // Index into the ray queue
+	std::vector<unsigned int> primitives;
+	std::vector<unsigned int> material_ids;
+	std::vector<double> t;
+	unsigned int size;
+};
+
+/** Shadow rays towards the lights carrying the radiance they deliver if unoccluded. */
+struct ShadowQueue
+{
+	ShadowQueue() : size(0) {}
+
+	void reserve(unsigned int capacity) {
+		origin_x.resize(capacity);
+		origin_y.resize(capacity);
+		origin_z.resize(capacity);
+		dir_x.resize(capacity);
+		dir_y.resize(capacity);
+		dir_z.resize(capacity);
+		tmax.resize(capacity);
+		radiance_r.resize(capacity);
+		radiance_g.resize(capacity);
+		radiance_b.resize(capacity);
+		pixels.resize(capacity);
+		occluded.resize(capacity);
+	}
+
+	std::vector<double> origin_x, origin_y, origin_z;
+	std::vector<double> dir_x, dir_y, dir_z;
+	std::vector<double> tmax;
+	std::vector<float> radiance_r, radiance_g, radiance_b;
+	std::vector<unsigned int> pixels; // WAVEFRONT_DEAD for unused slots
+	std::vector<unsigned char> occluded;
+	unsigned int size;
+};
+
+/** Queues and film for the wavefront renderer, kept between samples so no stage allocates. */
+struct Wavefront
+{
+	RayQueue rays;
+	RayQueue next_rays;
+	std::vector<double> ray_t; // Extend results per ray before compaction
+	std::vector<unsigned int> ray_primitives;
+	HitQueue hits;
+	HitQueue sorted_hits;
+	std::vector<unsigned int> material_offsets;
+	ShadowQueue shadows;
+	std::vector<float> radiance; // RGB per pixel
+
+	std::vector<uint64_t> ray_keys; // Ray sorting
+	std::vector<uint64_t> ray_keys_scratch;
+	std::vector<unsigned int> ray_order;
+	std::vector<unsigned int> ray_order_scratch;
+};
+
+inline
+unsigned int WavefrontHash(unsigned int x) {
+	x ^= x >> 16;
+	x *= 0x7feb352d;
+	x ^= x >> 15;
+	x *= 0x846ca68b;
+	x ^= x >> 16;
+	return x;
+}
+
+inline
+float WavefrontRandom(unsigned int *state) {
+	// xorshift32
+	unsigned int x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return (x >> 8) * (1.0f / 16777216.0f);
+}
+
+/** Shadow rays queued per hit, one per point light and one towards a sampled emitter. */
+inline
+unsigned int WavefrontShadowsPerHit(const Scene &scene) {
+	return scene.lights.size() + (scene.light_bvh.lights.empty() ? 0 : 1);
+}
+
+inline
+void ReserveWavefront(const Scene &scene, unsigned int pixel_count, Wavefront *wavefront) {
+	wavefront->rays.reserve(pixel_count);
+	wavefront->next_rays.reserve(pixel_count);
+	wavefront->ray_t.resize(pixel_count);
+	wavefront->ray_primitives.resize(pixel_count);
+	wavefront->hits.reserve(pixel_count);
+	wavefront->sorted_hits.reserve(pixel_count);
+	wavefront->material_offsets.resize(scene.materials.size() + 1);
+	wavefront->shadows.reserve(pixel_count * std::max<unsigned int>(1, WavefrontShadowsPerHit(scene)));
+	wavefront->radiance.assign(3 * pixel_count, 0.0f);
+	wavefront->ray_keys.resize(pixel_count);
+	wavefront->ray_keys_scratch.resize(pixel_count);
+	wavefront->ray_order.resize(pixel_count);
+	wavefront->ray_order_scratch.resize(pixel_count);
+}
+
+/** Spreads the low 10 bits of |x| to every third bit. */
+inline
+uint64_t MortonSpread(uint64_t x) {
+	x &= 0x3ff;
+	x = (x | (x << 16)) & 0x30000ff;
+	x = (x | (x << 8)) & 0x300f00f;
+	x = (x | (x << 4)) & 0x30c30c3;
+	x = (x | (x << 2)) & 0x9249249;
+	return x;
+}
+
+inline
+uint64_t Morton3(unsigned int x, unsigned int y, unsigned int z) {
+	return MortonSpread(x) | (MortonSpread(y) << 1) | (MortonSpread(z) << 2);
+}
+
+/**
+ * Coherence key for a ray, the direction octant in the top bits then the Morton
+ * code of its origin cell (10 bits per axis within |bounds|) then the Morton code
+ * of its direction quantized to 3 bits per axis within the octant.
+ */
+inline
+uint64_t RayCoherenceKey(const BoundingBox &bounds, const Point3 &origin, const Vector3 &dir) {
+	uint64_t octant = (dir.x < 0 ? 1 : 0) | (dir.y < 0 ? 2 : 0) | (dir.z < 0 ? 4 : 0);
+
+	unsigned int cell[3];
+	unsigned int direction[3];
+	double length = dir.length();
+	for (int i = 0; i < 3; ++i) {
+		double extent = bounds.max[i] - bounds.min[i];
+		double u = extent > 0 ? (origin[i] - bounds.min[i]) / extent : 0;
+		cell[i] = static_cast<unsigned int>(std::min(1023.0, std::max(0.0, u * 1024)));
+		double d = length > 0 ? std::abs(dir[i]) / length : 0;
+		direction[i] = static_cast<unsigned int>(std::min(7.0, d * 8));
+	}
+	return (octant << 39) | (Morton3(cell[0], cell[1], cell[2]) << 9) | Morton3(direction[0], direction[1], direction[2]);
+}
+
+/** LSD radix sort of |order| by |keys| over the low 42 key bits, both are sorted in place. */
+inline
+void RadixSortKeys(unsigned int size, std::vector<uint64_t> *keys, std::vector<unsigned int> *order,
+		std::vector<uint64_t> *keys_scratch, std::vector<unsigned int> *order_scratch) {
+	const int digit_bits = 11;
+	const unsigned int digit_count = 1 << digit_bits;
+	unsigned int counts[digit_count];
+	for (int shift = 0; shift < 42; shift += digit_bits) {
+		std::fill(counts, counts + digit_count, 0);
+		for (unsigned int i = 0; i < size; ++i) {
+			++counts[((*keys)[i] >> shift) & (digit_count - 1)];
+		}
+		unsigned int offset = 0;
+		for (unsigned int d = 0; d < digit_count; ++d) {
+			unsigned int count = counts[d];
+			counts[d] = offset;
+			offset += count;
+		}
+		for (unsigned int i = 0; i < size; ++i) {
+			unsigned int j = counts[((*keys)[i] >> shift) & (digit_count - 1)]++;
+			(*keys_scratch)[j] = (*keys)[i];
+			(*order_scratch)[j] = (*order)[i];
+		}
+		keys->swap(*keys_scratch);
+		order->swap(*order_scratch);
+	}
+}
+
+/**
+ * Reorders the ray queue by RayCoherenceKey so rays that traverse the same nodes are
+ * extended together. Pixels travel with their rays so results still land where they belong.
+ */
+inline
+void WavefrontSortRays(const BoundingBox &bounds, Wavefront *wavefront) {
+	RayQueue &rays = wavefront->rays;
+	ParallelFor(0, (rays.size + WAVEFRONT_CHUNK - 1) / WAVEFRONT_CHUNK, [&](unsigned int chunk) {
+		unsigned int end = std::min(rays.size, (chunk + 1) * WAVEFRONT_CHUNK);
+		for (unsigned int i = chunk * WAVEFRONT_CHUNK; i < end; ++i) {
+			wavefront->ray_keys[i] = RayCoherenceKey(bounds,
+				Point3(rays.origin_x[i], rays.origin_y[i], rays.origin_z[i]),
+				Vector3(rays.dir_x[i], rays.dir_y[i], rays.dir_z[i]));
+			wavefront->ray_order[i] = i;
+		}
+	});
+	RadixSortKeys(rays.size, &wavefront->ray_keys, &wavefront->ray_order,
+		&wavefront->ray_keys_scratch, &wavefront->ray_order_scratch);
+
+	RayQueue &sorted = wavefront->next_rays;
+	for (unsigned int i = 0; i < rays.size; ++i) {
+		sorted.copy(rays, wavefront->ray_order[i], i);
+	}
+	sorted.size = rays.size;
+	std::swap(wavefront->rays, wavefront->next_rays);
+}
+
+/**
+ * Replays the extend stage over the queued rays in queue order through a direct mapped
+ * cache of |cache_lines| 64 byte lines and returns the number of line fetches that miss.
+ * The rays go through SceneIntersect itself and every hierarchy node it visits is fetched
+ * whole. Compare before and after WavefrontSortRays to measure the benefit of sorting.
+ */
+inline
+unsigned int SimulateNodeFetchMisses(const Scene &scene, const RayQueue &rays, unsigned int cache_lines,
+		unsigned int *fetches) {
+	std::vector<uintptr_t> tags(cache_lines, 0);
+	unsigned int misses = 0;
+	*fetches = 0;
+
+	auto fetch = [&](const WideBVHNode &node) {
+		uintptr_t first = reinterpret_cast<uintptr_t>(&node) / 64;
+		uintptr_t last = (reinterpret_cast<uintptr_t>(&node + 1) - 1) / 64;
+		for (uintptr_t line = first; line <= last; ++line) {
+			uintptr_t &tag = tags[line % cache_lines];
+			if (tag != line + 1) {
+				tag = line + 1;
+				++misses;
+			}
+			++*fetches;
+		}
+	};
+
+	for (unsigned int i = 0; i < rays.size; ++i) {
+		double t = std::numeric_limits<double>::max();
+		unsigned int primitive;
+		SceneIntersect(scene, rays.ray(i), &t, &primitive, fetch);
+	}
+	return misses;
+}
+
+/**
+ * Generate stage, one jittered camera ray per pixel of the |row_count| rows from
+ * |first_row|. Pixels are numbered within those rows but seeded by their position
+ * in the image, so rendering in bands gives the same result.
+ */
+inline
+void WavefrontGenerate(const Camera &camera, const Size &size, unsigned int first_row, unsigned int row_count,
+		unsigned int sample, const WavefrontSettings &settings, Wavefront *wavefront) {
+	RayQueue &rays = wavefront->rays;
+	rays.size = size.width * row_count;
+	const unsigned int first_pixel = first_row * size.width;
+	ParallelFor(0, (rays.size + WAVEFRONT_CHUNK - 1) / WAVEFRONT_CHUNK, [&](unsigned int chunk) {
+		unsigned int end = std::min(rays.size, (chunk + 1) * WAVEFRONT_CHUNK);
+		for (unsigned int i = chunk * WAVEFRONT_CHUNK; i < end; ++i) {
+			unsigned int pixel = first_pixel + i;
+			unsigned int state = WavefrontHash(pixel ^ WavefrontHash(sample ^ WavefrontHash(settings.seed))) | 1;
+			double x = (pixel % size.width) + WavefrontRandom(&state);
+			double y = (pixel / size.width) + WavefrontRandom(&state);
+			rays.set(i, CameraRay(camera, size, x, y));
+			rays.throughput_r[i] = rays.throughput_g[i] = rays.throughput_b[i] = 1.0f;
+			rays.pixels[i] = i;
+			rays.rng[i] = state;
+		}
+	});
+}
+
+/** Extend stage, closest hits for every queued ray compacted into the hit queue. */
+inline
+void WavefrontExtend(const Scene &scene, Wavefront *wavefront) {
+	const RayQueue &rays = wavefront->rays;
+	ParallelFor(0, (rays.size + WAVEFRONT_CHUNK - 1) / WAVEFRONT_CHUNK, [&](unsigned int chunk) {
+		unsigned int end = std::min(rays.size, (chunk + 1) * WAVEFRONT_CHUNK);
+		for (unsigned int i = chunk * WAVEFRONT_CHUNK; i < end; ++i) {
+			double t = std::numeric_limits<double>::max();
+			unsigned int primitive = WAVEFRONT_DEAD;
+			SceneIntersect(scene, rays.ray(i), &t, &primitive);
+			wavefront->ray_t[i] = t;
+			wavefront->ray_primitives[i] = primitive;
+		}
+	});
+
+	// Misses leave the scene, there is no environment to add
+	HitQueue &hits = wavefront->hits;
+	hits.size = 0;
+	for (unsigned int i = 0; i < rays.size; ++i) {
+		unsigned int primitive = wavefront->ray_primitives[i];
+		if (primitive == WAVEFRONT_DEAD) {
+			continue;
+		}
+		hits.rays[hits.size] = i;
+		hits.primitives[hits.size] = primitive;
+		hits.material_ids[hits.size] = SceneMaterialId(scene, primitive);
+		hits.t[hits.size] = wavefront->ray_t[i];
+		++hits.size;
+	}
+}
+
+/** Counting sort of the hit queue by material id so each material shades as one batch. */
+inline
+void WavefrontSortHits(Wavefront *wavefront) {
+	const HitQueue &hits = wavefront->hits;
+	HitQueue &sorted = wavefront->sorted_hits;
+	std::vector<unsigned int> &offsets = wavefront->material_offsets;
+
+	std::fill(offsets.begin(), offsets.end(), 0);
+	for (unsigned int i = 0; i < hits.size; ++i) {
+		++offsets[hits.material_ids[i] + 1];
+	}
+	for (unsigned int m = 1; m < offsets.size(); ++m) {
+		offsets[m] += offsets[m - 1];
+	}
+	for (unsigned int i = 0; i < hits.size; ++i) {
+		unsigned int j = offsets[hits.material_ids[i]]++;
+		sorted.rays[j] = hits.rays[i];
+		sorted.primitives[j] = hits.primitives[i];
+		sorted.material_ids[j] = hits.material_ids[i];
+		sorted.t[j] = hits.t[i];
+	}
+	sorted.size = hits.size;
+	std::swap(wavefront->hits, wavefront->sorted_hits);
+}
+
+inline
+Vector3 CosineSampleHemisphere(const Vector3 &normal, float r1, float r2) {
+	Vector3 axis = std::abs(normal.x) > 0.9 ? Vector3(0, 1, 0) : Vector3(1, 0, 0);
+	Vector3 tangent = normal.cross(axis);
+	tangent.normalize();
+	Vector3 bitangent = normal.cross(tangent);
+
+	double phi = 2 * PI * r1;
+	double r = sqrt(r2);
+	return (r * cos(phi)) * tangent + (r * sin(phi)) * bitangent + sqrt(1 - r2) * normal;
+}
+
+/**
+ * Shade stage over the material sorted hit queue, queues a shadow ray per light with
+ * the Blinn-Phong radiance it would deliver and a cosine weighted diffuse bounce.
+ * Point light colours are intensities falling off with the squared distance, and
+ * diffuse reflects albedo / PI of them to match the cosine weighted bounce.
+ * Emissive primitives contribute through one light hierarchy sample per hit, their
+ * emission is radiance, and directly when the camera sees their emitting side. Bounces that land
+ * on an emitter add nothing since the light sample already accounts for it.
+ */
+inline
+void WavefrontShade(const Scene &scene, unsigned int depth, const WavefrontSettings &settings, Wavefront *wavefront) {
+	const HitQueue &hits = wavefront->hits;
+	const RayQueue &rays = wavefront->rays;
+	RayQueue &next_rays = wavefront->next_rays;
+	ShadowQueue &shadows = wavefront->shadows;
+	const unsigned int light_count = scene.lights.size();
+	const unsigned int shadows_per_hit = WavefrontShadowsPerHit(scene);
+	const bool bounce = depth + 1 < settings.max_depth;
+
+	ParallelFor(0, (hits.size + WAVEFRONT_CHUNK - 1) / WAVEFRONT_CHUNK, [&](unsigned int chunk) {
+		unsigned int end = std::min(hits.size, (chunk + 1) * WAVEFRONT_CHUNK);
+		const Material *material = NULL;
+		unsigned int material_id = WAVEFRONT_DEAD;
+		for (unsigned int i = chunk * WAVEFRONT_CHUNK; i < end; ++i) {
+			if (hits.material_ids[i] != material_id) {
+				material_id = hits.material_ids[i];
+				material = &scene.materials[material_id];
+			}
+
+			unsigned int r = hits.rays[i];
+			Ray ray = rays.ray(r);
+			Point3 pos = ray.origin + hits.t[i] * ray.dir;
+			Vector3 normal = SceneNormal(scene, hits.primitives[i], pos, ray.dir);
+			Point3 origin = OffsetRayOrigin(pos, normal);
+			Colour throughput = rays.throughput(r);
+			unsigned int state = rays.rng[r];
+
+			// Each pixel has a single camera path so this doesn't race
+			if (depth == 0 && SceneFrontFacing(scene, hits.primitives[i], pos, ray.dir)) {
+				const Colour &emission = material->emission;
+				wavefront->radiance[3 * rays.pixels[r]] += throughput.r * emission.r;
+				wavefront->radiance[3 * rays.pixels[r] + 1] += throughput.g * emission.g;
+				wavefront->radiance[3 * rays.pixels[r] + 2] += throughput.b * emission.b;
+			}
+
+			for (unsigned int l = 0; l < light_count; ++l) {
+				unsigned int s = i * shadows_per_hit + l;
+				shadows.pixels[s] = WAVEFRONT_DEAD;
+
+				const PointLight &light = scene.lights[l];
+				Vector3 to_light = light.pos - pos;
+				double distance = to_light.length();
+				to_light /= distance;
+				double n_dot_l = normal.dot(to_light);
+				if (n_dot_l <= 0) {
+					continue;
+				}
+
+				Vector3 half = to_light - ray.dir;
+				half.normalize();
+				double n_dot_h = std::max(0.0, normal.dot(half));
+				Colour brdf = material->diffuse * static_cast<float>(n_dot_l / PI) +
+					material->specular * static_cast<float>(pow(n_dot_h, material->shininess));
+				Colour radiance = throughput * brdf * light.colour / static_cast<float>(distance * distance);
+
+				shadows.origin_x[s] = origin.x;
+				shadows.origin_y[s] = origin.y;
+				shadows.origin_z[s] = origin.z;
+				shadows.dir_x[s] = to_light.x;
+				shadows.dir_y[s] = to_light.y;
+				shadows.dir_z[s] = to_light.z;
+				shadows.tmax[s] = distance - EPSILON;
+				shadows.radiance_r[s] = radiance.r;
+				shadows.radiance_g[s] = radiance.g;
+				shadows.radiance_b[s] = radiance.b;
+				shadows.pixels[s] = rays.pixels[r];
+			}
+
+			if (shadows_per_hit > light_count) {
+				unsigned int s = i * shadows_per_hit + light_count;
+				shadows.pixels[s] = WAVEFRONT_DEAD;
+
+				float u[3] = { WavefrontRandom(&state), WavefrontRandom(&state), WavefrontRandom(&state) };
+				LightSample sample;
+				double n_dot_l;
+				if (SampleSceneLight(scene, pos, normal, u, &sample) && sample.pdf > 0 &&
+						(n_dot_l = normal.dot(sample.dir)) > 0) {
+					Vector3 half = sample.dir - ray.dir;
+					half.normalize();
+					double n_dot_h = std::max(0.0, normal.dot(half));
+					Colour brdf = material->diffuse * n_dot_l +
+						material->specular * static_cast<float>(pow(n_dot_h, material->shininess));
+					Colour radiance = throughput * brdf * sample.emission / static_cast<float>(PI * sample.pdf);
+
+					shadows.origin_x[s] = origin.x;
+					shadows.origin_y[s] = origin.y;
+					shadows.origin_z[s] = origin.z;
+					shadows.dir_x[s] = sample.dir.x;
+					shadows.dir_y[s] = sample.dir.y;
+					shadows.dir_z[s] = sample.dir.z;
+					shadows.tmax[s] = sample.distance - EPSILON;
+					shadows.radiance_r[s] = radiance.r;
+					shadows.radiance_g[s] = radiance.g;
+					shadows.radiance_b[s] = radiance.b;
+					shadows.pixels[s] = rays.pixels[r];
+				}
+			}
+
+			next_rays.pixels[i] = WAVEFRONT_DEAD;
+			Colour next_throughput = throughput * material->diffuse;
+			if (!bounce || std::max(next_throughput.r, std::max(next_throughput.g, next_throughput.b)) < 1e-3f) {
+				continue;
+			}
+			float r1 = WavefrontRandom(&state);
+			float r2 = WavefrontRandom(&state);
+			next_rays.set(i, Ray(origin, CosineSampleHemisphere(normal, r1, r2)));
+			next_rays.throughput_r[i] = next_throughput.r;
+			next_rays.throughput_g[i] = next_throughput.g;
+			next_rays.throughput_b[i] = next_throughput.b;
+			next_rays.pixels[i] = rays.pixels[r];
+			next_rays.rng[i] = state;
+		}
+	});
+	shadows.size = hits.size * shadows_per_hit;
+
+	// Compact the surviving paths and make them the next wave
+	unsigned int size = 0;
+	for (unsigned int i = 0; i < hits.size; ++i) {
+		if (next_rays.pixels[i] != WAVEFRONT_DEAD) {
+			next_rays.copy(i, size++);
+		}
+	}
+	next_rays.size = size;
+	std::swap(wavefront->rays, wavefront->next_rays);
+}
+
+/** Connect stage, traces the shadow rays and accumulates the unoccluded radiance. */
+inline
+void WavefrontConnect(const Scene &scene, Wavefront *wavefront) {
+	ShadowQueue &shadows = wavefront->shadows;
+	ParallelFor(0, (shadows.size + WAVEFRONT_CHUNK - 1) / WAVEFRONT_CHUNK, [&](unsigned int chunk) {
+		unsigned int end = std::min(shadows.size, (chunk + 1) * WAVEFRONT_CHUNK);
+		for (unsigned int i = chunk * WAVEFRONT_CHUNK; i < end; ++i) {
+			if (shadows.pixels[i] == WAVEFRONT_DEAD) {
+				continue;
+			}
+			Ray ray(Point3(shadows.origin_x[i], shadows.origin_y[i], shadows.origin_z[i]),
+				Vector3(shadows.dir_x[i], shadows.dir_y[i], shadows.dir_z[i]));
+			shadows.occluded[i] = SceneOccluded(scene, ray, shadows.tmax[i]);
+		}
+	});
+
+	// Serial so paths sharing a pixel don't race
+	for (unsigned int i = 0; i < shadows.size; ++i) {
+		unsigned int pixel = shadows.pixels[i];
+		if (pixel == WAVEFRONT_DEAD || shadows.occluded[i]) {
+			continue;
+		}
+		wavefront->radiance[3 * pixel] += shadows.radiance_r[i];
+		wavefront->radiance[3 * pixel + 1] += shadows.radiance_g[i];
+		wavefront->radiance[3 * pixel + 2] += shadows.radiance_b[i];
+	}
+}
+
+/**
+ * Path trace the |row_count| rows of an image of |size| from |first_row| in wavefront
+ * order, leaving the summed radiance of every sample in wavefront->radiance.
+ * Each bounce runs the extend, shade and connect stages over the whole wave of
+ * paths instead of shading each ray straight after intersecting it.
+ */
+inline
+void RenderWavefrontRows(const Scene &scene, const Camera &camera, const Size &size,
+		unsigned int first_row, unsigned int row_count, const WavefrontSettings &settings, Wavefront *wavefront) {
+	const BoundingBox bounds = SceneBounds(scene);
+	ReserveWavefront(scene, size.width * row_count, wavefront);
+
+	for (unsigned int sample = 0; sample < settings.samples; ++sample) {
+		WavefrontGenerate(camera, size, first_row, row_count, sample, settings, wavefront);
+		for (unsigned int depth = 0; depth < settings.max_depth && wavefront->rays.size > 0; ++depth) {
+			// Primary rays are already coherent in scanline order
+			if (settings.sort_rays && depth > 0) {
+				WavefrontSortRays(bounds, wavefront);
+			}
+			WavefrontExtend(scene, wavefront);
+			WavefrontSortHits(wavefront);
+			WavefrontShade(scene, depth, settings, wavefront);
+			WavefrontConnect(scene, wavefront);
+		}
+	}
+}
+
+/** Path trace |scene| into |image|, which must already be sized. */
+inline
+void RenderWavefront(const Scene &scene, const Camera &camera, const WavefrontSettings &settings,
+		Wavefront *wavefront, Image *image) {
+	const Size &size = image->size;
+	RenderWavefrontRows(scene, camera, size, 0, size.y, settings, wavefront);
+
+	float inv_samples = 1.0f / std::max(1u, settings.samples);
+	for (int y = 0; y < size.y; ++y) {
+		for (int x = 0; x < size.x; ++x) {
+			const float *radiance = &wavefront->radiance[3 * (y * size.x + x)];
+			image->set(x, y, Colour(radiance[0], radiance[1], radiance[2]) * inv_samples);
+		}
+	}
+}
+
+inline
+void RenderWavefront(const Scene &scene, const Camera &camera, const WavefrontSettings &settings, Image *image) {
+	Wavefront wavefront;
+	RenderWavefront(scene, camera, settings, &wavefront, image);
+}
+
+/**
+ * Path trace |scene| straight to the PNG |filename| in bands of |band_rows| rows (at
+ * least 1), each encoded as soon as it completes. The queues and film only ever hold one
+ * band, so memory no longer grows with the image height.
+ */
+inline
+bool RenderWavefrontPNG(const Scene &scene, const Camera &camera, const Size &size, unsigned int band_rows,
+		const WavefrontSettings &settings, const std::string &filename) {
+	if (band_rows == 0) {
+		return false;
+	}
+	PNGStream stream;
+	if (!BeginPNGStream(filename, size, 3, &stream)) {
+		return false;
+	}
+
+	Wavefront wavefront;
+	std::vector<float> band(3 * size.width * band_rows);
+	float inv_samples = 1.0f / std::max(1u, settings.samples);
+	// Image rows increase upwards so the file, written top down, starts from the last row
+	for (unsigned int written = 0; written < (unsigned int)size.height; written += band_rows) {
+		unsigned int row_count = std::min(band_rows, size.height - written);
+		unsigned int first_row = size.height - written - row_count;
+		RenderWavefrontRows(scene, camera, size, first_row, row_count, settings, &wavefront);
+
+		for (unsigned int y = 0; y < row_count; ++y) {
+			const float *radiance = &wavefront.radiance[3 * (row_count - 1 - y) * size.width];
+			float *row = &band[3 * y * size.width];
+			for (unsigned int i = 0; i < 3 * (unsigned int)size.width; ++i) {
+				row[i] = radiance[i] * inv_samples;
+			}
+		}
+		if (!WritePNGRows(&band[0], row_count, &stream)) {
+			return false;
+		}
+	}
+	return EndPNGStream(&stream);
+}
+
+#endif
@@ -0,0 +1,366 @@
+/*
+* Copyright (c) 2015 Owen Glofcheski
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+*    1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+*    2. Altered source versions must be plainly marked as such, and must not
+*    be misrepresented as being the original software.
+*
+*    3. This notice may not be removed or altered from any source
+*    distribution.
+*/
+
+
+#ifndef _WIDE_BVH_HPP_
+#define _WIDE_BVH_HPP_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <limits>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+#include "buffer.hpp"
+#include "bvh.hpp"
+#include "stats.hpp"
+
+#define WIDE_BVH_WIDTH 8
+#define WIDE_BVH_STACK_SIZE (BVH_STACK_SIZE * (WIDE_BVH_WIDTH - 1))
+
+/**
+ * 8-wide node with single precision child bounds stored as a structure of arrays so
+ * all children are tested at once. Bounds are rounded outwards from the binary tree's,
+ * unused slots hold inverted bounds that no ray hits.
+ */
+struct alignas(32) WideBVHNode
+{
+	float bounds[6][WIDE_BVH_WIDTH]; // min x, y, z then max x, y, z
+	unsigned int child[WIDE_BVH_WIDTH]; // Node index for interior children, first index for leaves
+	unsigned int count[WIDE_BVH_WIDTH]; // Number of primitives in a leaf child, 0 for interior children
+};
+
+/** Wide BVH collapsed from a binary one, leaves are the same runs of the same indices. */
+struct WideBVH
+{
+	Buffer<WideBVHNode> nodes;
+	Buffer<unsigned int> indices;
+};
+
+inline
+float RoundDown(double value) {
+	float rounded = static_cast<float>(value);
+	return rounded > value ? std::nextafter(rounded, -std::numeric_limits<float>::infinity()) : rounded;
+}
+
+inline
+float RoundUp(double value) {
+	float rounded = static_cast<float>(value);
+	return rounded < value ? std::nextafter(rounded, std::numeric_limits<float>::infinity()) : rounded;
+}
+
+inline
+unsigned int CollapseBVHNode(const BVH &bvh, const unsigned int *children, unsigned int child_count, WideBVH *wide) {
+	unsigned int wide_index = wide->nodes.size();
+	wide->nodes.resize(wide_index + 1);
+
+	WideBVHNode node;
+	for (unsigned int i = 0; i < WIDE_BVH_WIDTH; ++i) {
+		for (int axis = 0; axis < 3; ++axis) {
+			node.bounds[axis][i] = std::numeric_limits<float>::infinity();
+			node.bounds[3 + axis][i] = -std::numeric_limits<float>::infinity();
+		}
+		node.child[i] = 0;
+		node.count[i] = 0;
+	}
+
+	for (unsigned int i = 0; i < child_count; ++i) {
+		const BVHNode &child = bvh.nodes[children[i]];
+		for (int axis = 0; axis < 3; ++axis) {
+			node.bounds[axis][i] = RoundDown(child.bounds.min[axis]);
+			node.bounds[3 + axis][i] = RoundUp(child.bounds.max[axis]);
+		}
+		if (child.leaf()) {
+			node.child[i] = child.offset;
+			node.count[i] = child.count;
+		} else {
+			unsigned int grandchildren[WIDE_BVH_WIDTH];
+			unsigned int grandchild_count = GatherBVHChildren(bvh, children[i], WIDE_BVH_WIDTH, grandchildren);
+			node.child[i] = CollapseBVHNode(bvh, grandchildren, grandchild_count, wide);
+		}
+	}
+	wide->nodes[wide_index] = node;
+	return wide_index;
+}
+
+/** Collapse a built binary |bvh| into |wide|. */
+inline
+void BuildWideBVH(const BVH &bvh, WideBVH *wide) {
+	wide->nodes.clear();
+	wide->indices = bvh.indices;
+	if (bvh.nodes.empty()) {
+		return;
+	}
+
+	wide->nodes.reserve(bvh.nodes.size() / 4 + 1);
+	unsigned int children[WIDE_BVH_WIDTH];
+	unsigned int child_count = 1;
+	children[0] = 0;
+	if (!bvh.nodes[0].leaf()) {
+		child_count = GatherBVHChildren(bvh, 0, WIDE_BVH_WIDTH, children);
+	}
+	CollapseBVHNode(bvh, children, child_count, wide);
+}
+
+/** The ray converted once per traversal, near and far select the slab planes by direction. */
+struct WideBVHRay
+{
+	WideBVHRay(const Ray &ray) {
+		for (int axis = 0; axis < 3; ++axis) {
+			// Keep the reciprocal finite so axis aligned rays never compute 0 * inf
+			double dir = ray.dir[axis];
+			if (std::abs(dir) < 1e-20) {
+				dir = dir < 0 ? -1e-20 : 1e-20;
+			}
+			origin[axis] = static_cast<float>(ray.origin[axis]);
+			inv_dir[axis] = static_cast<float>(1.0 / dir);
+			near[axis] = inv_dir[axis] < 0 ? 3 + axis : axis;
+			far[axis] = inv_dir[axis] < 0 ? axis : 3 + axis;
+		}
+	}
+
+	float origin[3];
+	float inv_dir[3];
+	int near[3];
+	int far[3];
+};
+
+/** Bitmask of the children of |node| the ray enters in [0, tmax), their entry distances in |tnear|. */
+inline
+unsigned int WideBVHNodeIntersect(const WideBVHNode &node, const WideBVHRay &ray, float tmax, float *tnear) {
+	// Widen the far distance slightly so float rounding never culls a box the ray grazes
+	tmax *= 1.0000004f;
+#if defined(__AVX__)
+	__m256 t0 = _mm256_setzero_ps();
+	__m256 t1 = _mm256_set1_ps(tmax);
+	for (int axis = 0; axis < 3; ++axis) {
+		__m256 origin = _mm256_set1_ps(ray.origin[axis]);
+		__m256 inv_dir = _mm256_set1_ps(ray.inv_dir[axis]);
+		__m256 near_t = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bounds[ray.near[axis]]), origin), inv_dir);
+		__m256 far_t = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bounds[ray.far[axis]]), origin), inv_dir);
+		t0 = _mm256_max_ps(near_t, t0);
+		t1 = _mm256_min_ps(far_t, t1);
+	}
+	_mm256_storeu_ps(tnear, t0);
+	return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+#else
+	unsigned int mask = 0;
+	for (unsigned int i = 0; i < WIDE_BVH_WIDTH; ++i) {
+		float t0 = 0;
+		float t1 = tmax;
+		for (int axis = 0; axis < 3; ++axis) {
+			float near_t = (node.bounds[ray.near[axis]][i] - ray.origin[axis]) * ray.inv_dir[axis];
+			float far_t = (node.bounds[ray.far[axis]][i] - ray.origin[axis]) * ray.inv_dir[axis];
+			t0 = near_t > t0 ? near_t : t0;
+			t1 = far_t < t1 ? far_t : t1;
+		}
+		tnear[i] = t0;
+		mask |= (t0 <= t1) << i;
+	}
+	return mask;
+#endif
+}
+
+inline
+void CompareExchange(uint64_t *a, uint64_t *b) {
+	uint64_t lo = std::min(*a, *b);
+	*b = std::max(*a, *b);
+	*a = lo;
+}
+
+/**
+ * Sorts up to WIDE_BVH_WIDTH keys with fixed sorting networks, branch free apart from
+ * picking the network. Unused keys past |count| must be the maximum value.
+ */
+inline
+void SortWideBVHHits(unsigned int count, uint64_t *keys) {
+	if (count <= 1) {
+		return;
+	} else if (count == 2) {
+		CompareExchange(&keys[0], &keys[1]);
+	} else if (count <= 4) {
+		CompareExchange(&keys[0], &keys[1]);
+		CompareExchange(&keys[2], &keys[3]);
+		CompareExchange(&keys[0], &keys[2]);
+		CompareExchange(&keys[1], &keys[3]);
+		CompareExchange(&keys[1], &keys[2]);
+	} else {
+		// Batcher's odd-even merge sort
+		static const unsigned char pairs[19][2] = {
+			{0, 1}, {2, 3}, {4, 5}, {6, 7}, {0, 2}, {1, 3}, {4, 6}, {5, 7}, {1, 2}, {5, 6},
+			{0, 4}, {3, 7}, {1, 5}, {2, 6}, {1, 4}, {3, 6}, {2, 4}, {3, 5}, {3, 4} };
+		for (int i = 0; i < 19; ++i) {
+			CompareExchange(&keys[pairs[i][0]], &keys[pairs[i][1]]);
+		}
+	}
+}
+
+struct WideBVHEntry
+{
+	unsigned int node;
+	float tnear;
+};
+
+/**
+ * Closest hit traversal testing every child of a node at once, calls leaf(offset, count) for the
+ * runs of indices the ray reaches, nearer children first. As for BVHTraverse leaf returns
+ * whether it found a hit and shrinks *tmax to it when it does, and visit(node_index) is called
+ * for every node whose child bounds are fetched.
+ */
+template <typename LeafFunc, typename VisitFunc>
+bool WideBVHTraverse(const WideBVH &bvh, const Ray &ray, double *tmax, const LeafFunc &leaf,
+		const VisitFunc &visit) {
+	if (bvh.nodes.empty()) {
+		return false;
+	}
+
+	WideBVHRay wide_ray(ray);
+	bool has_intersection = false;
+	WideBVHEntry stack[WIDE_BVH_STACK_SIZE];
+	unsigned int stack_size = 0;
+	stack[stack_size].node = 0;
+	stack[stack_size++].tnear = 0;
+	while (stack_size > 0) {
+		WideBVHEntry entry = stack[--stack_size];
+		if (entry.tnear > *tmax) {
+			continue;
+		}
+		const WideBVHNode &node = bvh.nodes[entry.node];
+		STAT_INC(STAT_NODE_VISITS);
+		visit(entry.node);
+
+		float tnear[WIDE_BVH_WIDTH];
+		float tfar = static_cast<float>(std::min(*tmax, static_cast<double>(std::numeric_limits<float>::max())));
+		unsigned int mask = WideBVHNodeIntersect(node, wide_ray, tfar, tnear);
+		if (mask == 0) {
+			continue;
+		}
+
+		// Non-negative floats order the same as their bits, the low bits carry the slot
+		uint64_t keys[WIDE_BVH_WIDTH];
+		unsigned int hit_count = 0;
+		for (unsigned int i = 0; i < WIDE_BVH_WIDTH; ++i) {
+			if (mask & (1 << i)) {
+				uint32_t bits;
+				memcpy(&bits, &tnear[i], sizeof(bits));
+				keys[hit_count++] = (static_cast<uint64_t>(bits) << 32) | i;
+			}
+		}
+		for (unsigned int i = hit_count; i < WIDE_BVH_WIDTH; ++i) {
+			keys[i] = std::numeric_limits<uint64_t>::max();
+		}
+		SortWideBVHHits(hit_count, keys);
+
+		// Leaves are intersected now, nearest first, so interior children can be culled on pop
+		for (unsigned int i = 0; i < hit_count; ++i) {
+			unsigned int slot = keys[i] & 0xffffffff;
+			if (node.count[slot] > 0 && tnear[slot] <= *tmax) {
+				STAT_INC(STAT_LEAF_VISITS);
+				if (leaf(node.child[slot], node.count[slot])) {
+					has_intersection = true;
+				}
+			}
+		}
+		for (unsigned int i = hit_count; i > 0; --i) {
+			unsigned int slot = keys[i - 1] & 0xffffffff;
+			if (node.count[slot] == 0) {
+				stack[stack_size].node = node.child[slot];
+				stack[stack_size++].tnear = tnear[slot];
+			}
+		}
+		STAT_MAX(STAT_MAX_TRAVERSAL_DEPTH, stack_size);
+	}
+	return has_intersection;
+}
+
+template <typename LeafFunc>
+bool WideBVHTraverse(const WideBVH &bvh, const Ray &ray, double *tmax, const LeafFunc &leaf) {
+	return WideBVHTraverse(bvh, ray, tmax, leaf, BVHNoVisit());
+}
+
+/** Any hit traversal, stops as soon as leaf(offset, count) reports a hit in (EPSILON, tmax). */
+template <typename LeafFunc>
+bool WideBVHTraverseAny(const WideBVH &bvh, const Ray &ray, double tmax, const LeafFunc &leaf) {
+	if (bvh.nodes.empty()) {
+		return false;
+	}
+
+	WideBVHRay wide_ray(ray);
+	float tfar = static_cast<float>(std::min(tmax, static_cast<double>(std::numeric_limits<float>::max())));
+	unsigned int stack[WIDE_BVH_STACK_SIZE];
+	unsigned int stack_size = 0;
+	stack[stack_size++] = 0;
+	while (stack_size > 0) {
+		const WideBVHNode &node = bvh.nodes[stack[--stack_size]];
+		STAT_INC(STAT_NODE_VISITS);
+		float tnear[WIDE_BVH_WIDTH];
+		unsigned int mask = WideBVHNodeIntersect(node, wide_ray, tfar, tnear);
+		for (unsigned int i = 0; i < WIDE_BVH_WIDTH; ++i) {
+			if (!(mask & (1 << i))) {
+				continue;
+			}
+			if (node.count[i] > 0) {
+				STAT_INC(STAT_LEAF_VISITS);
+				if (leaf(node.child[i], node.count[i])) {
+					return true;
+				}
+			} else {
+				stack[stack_size++] = node.child[i];
+			}
+		}
+		STAT_MAX(STAT_MAX_TRAVERSAL_DEPTH, stack_size);
+	}
+	return false;
+}
+
+template <typename Primitives>
+bool WideBVHIntersect(const WideBVH &bvh, const Primitives &primitives, const Ray &ray, Intersection *intersection) {
+	return WideBVHTraverse(bvh, ray, &intersection->t, [&](unsigned int offset, unsigned int count) {
+		bool has_intersection = false;
+		for (unsigned int i = offset; i < offset + count; ++i) {
+			if (PrimitiveIntersect(primitives[bvh.indices[i]], ray, intersection)) {
+				has_intersection = true;
+			}
+		}
+		return has_intersection;
+	});
+}
+
+template <typename Primitives>
+bool WideBVHOccluded(const WideBVH &bvh, const Primitives &primitives, const Ray &ray, double tmax) {
+	return WideBVHTraverseAny(bvh, ray, tmax, [&](unsigned int offset, unsigned int count) {
+		for (unsigned int i = offset; i < offset + count; ++i) {
+			if (PrimitiveOccluded(primitives[bvh.indices[i]], ray, tmax)) {
+				return true;
+			}
+		}
+		return false;
+	});
+}
+
+#endif